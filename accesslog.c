@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+
+#include "accesslog.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    // written by the worker
+    _Alignas(64) _Atomic uint64_t head;
+    _Atomic uint64_t dropped;
+    atomic_bool used;
+    // written by the logger
+    _Alignas(64) _Atomic uint64_t tail;
+    _Alignas(64) AccessRecord records[WS_ACCESS_RING];
+} Ring;
+
+_Static_assert((WS_ACCESS_RING & (WS_ACCESS_RING - 1)) == 0, "WS_ACCESS_RING must be a power of two");
+
+// one per worker and one for the parent, the rings never in use cost no memory
+#define RING_COUNT (WS_MAX_WORKERS + 1)
+
+// rings whose records go out in one writev(), each may wrap around into a second iovec
+#define BATCH_RINGS 32
+
+static Ring* rings = NULL;
+static Ring* own = NULL;
+static uint16_t own_slot = 0;
+// the tail as last seen, the logger's cache line is only read when the ring looks full
+static uint64_t own_tail = 0;
+
+bool accesslog_start()
+{
+    void* mem = mmap(NULL, RING_COUNT * sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+    if (mem == MAP_FAILED) {
+        int en = errno;
+        DebugErr("access log mmap() %s\n", strerror(en));
+        return false;
+    }
+    rings = mem;
+    return true;
+}
+
+void accesslog_worker(int slot)
+{
+    if (rings == NULL || slot < 0 || slot >= RING_COUNT) {
+        return;
+    }
+    own = &rings[slot];
+    own_slot = slot;
+    // a respawned worker carries on where the last one in its slot stopped
+    own_tail = atomic_load_explicit(&own->tail, memory_order_acquire);
+    atomic_store(&own->used, true);
+}
+
+bool accesslog_on() { return own != NULL; }
+
+void accesslog_peer(AccessRecord* record, int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    record->family = 0;
+    record->port = 0;
+    memset(record->addr, 0, sizeof(record->addr));
+    if (getpeername(fd, (struct sockaddr*)&addr, &len) < 0) {
+        return;
+    }
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+        record->family = 4;
+        record->port = ntohs(in->sin_port);
+        memcpy(record->addr, &in->sin_addr, 4);
+    } else if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        record->family = 6;
+        record->port = ntohs(in6->sin6_port);
+        memcpy(record->addr, &in6->sin6_addr, 16);
+    }
+}
+
+void accesslog_request(AccessRecord* record, const HttpRequest* req)
+{
+    size_t len = strnlen(req->line.uri, WS_URI_BUFFER_SIZE);
+    record->method = req->line.method;
+    record->version = req->line.version;
+    record->uri_len = len;
+    memcpy(record->uri, req->line.uri, len < WS_ACCESS_URI_MAX ? len : WS_ACCESS_URI_MAX);
+}
+
+void accesslog_append(AccessRecord* record, uint32_t status, uint64_t duration_ns)
+{
+    if (own == NULL) {
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&own->head, memory_order_relaxed);
+    if (head - own_tail >= WS_ACCESS_RING) {
+        own_tail = atomic_load_explicit(&own->tail, memory_order_acquire);
+        if (head - own_tail >= WS_ACCESS_RING) {
+            // only this process writes it, like head
+            atomic_store_explicit(&own->dropped, atomic_load_explicit(&own->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return;
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t duration_us = duration_ns / 1000;
+    record->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record->duration_us = duration_us > UINT32_MAX ? UINT32_MAX : duration_us;
+    record->status = status;
+    record->worker = own_slot;
+    own->records[head & (WS_ACCESS_RING - 1)] = *record;
+    atomic_store_explicit(&own->head, head + 1, memory_order_release);
+}
+
+// the records of up to BATCH_RINGS rings, taken off them once written
+typedef struct {
+    struct iovec iov[2 * BATCH_RINGS];
+    int iovcnt;
+    Ring* rings[BATCH_RINGS];
+    uint64_t heads[BATCH_RINGS];
+    int ring_count;
+} Batch;
+
+static bool write_all(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static bool write_header(int fd)
+{
+    AccessLogHeader header = {.record_size = sizeof(AccessRecord), .byte_order = 0x01020304};
+    memcpy(header.magic, WS_ACCESS_MAGIC, sizeof(header.magic));
+    struct iovec iov = {&header, sizeof(header)};
+    return write_all(fd, &iov, 1);
+}
+
+/* Writes the batch whole or not at all: after a failed write the file is
+ * cut back to where it ended, so the records left in the rings go out again
+ * without doubling any or leaving part of one to misalign the rest.
+ */
+static bool flush(int fd, Batch* batch)
+{
+    if (batch->ring_count == 0) {
+        return true;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+    if ((st.st_size > 0 || write_header(fd)) && write_all(fd, batch->iov, batch->iovcnt)) {
+        for (int i = 0; i < batch->ring_count; i++) {
+            atomic_store_explicit(&batch->rings[i]->tail, batch->heads[i], memory_order_release);
+        }
+        batch->iovcnt = 0;
+        batch->ring_count = 0;
+        return true;
+    }
+    int en = errno;
+    if (ftruncate(fd, st.st_size) < 0) {
+        int truncate_en = errno;
+        DebugErr("access log ftruncate() %s, it may hold part of a record\n", strerror(truncate_en));
+    }
+    errno = en;
+    return false;
+}
+
+int64_t accesslog_drain(int fd)
+{
+    Batch batch = {};
+    int64_t written = 0;
+    bool ok = true;
+    for (int i = 0; ok && rings && i < RING_COUNT; i++) {
+        Ring* ring = &rings[i];
+        if (!atomic_load_explicit(&ring->used, memory_order_relaxed)) {
+            continue;
+        }
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (head == tail) {
+            continue;
+        }
+        uint64_t from = tail & (WS_ACCESS_RING - 1);
+        uint64_t count = head - tail;
+        uint64_t first = count < WS_ACCESS_RING - from ? count : WS_ACCESS_RING - from;
+        batch.iov[batch.iovcnt++] = (struct iovec){&ring->records[from], first * sizeof(AccessRecord)};
+        if (first < count) {
+            batch.iov[batch.iovcnt++] = (struct iovec){&ring->records[0], (count - first) * sizeof(AccessRecord)};
+        }
+        batch.rings[batch.ring_count] = ring;
+        batch.heads[batch.ring_count] = head;
+        batch.ring_count++;
+        written += count;
+        if (batch.ring_count == BATCH_RINGS) {
+            ok = flush(fd, &batch);
+        }
+    }
+    if (ok && flush(fd, &batch)) {
+        return written;
+    }
+    int en = errno;
+    DebugErr("access log write() %s\n", strerror(en));
+    return -1;
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int signal) { stop_requested = 1; }
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the open log, reopened when the path now names another file or none, e.g. after rotation
+static int follow_path(int fd, const char* path)
+{
+    struct stat at_path;
+    struct stat open_file;
+    if (fd >= 0 && stat(path, &at_path) == 0 && fstat(fd, &open_file) == 0 && at_path.st_ino == open_file.st_ino &&
+        at_path.st_dev == open_file.st_dev) {
+        return fd;
+    }
+    int next = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (next < 0) {
+        if (fd < 0) {
+            int en = errno;
+            DebugErr("%s: %s\n", path, strerror(en));
+        }
+        return fd;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return next;
+}
+
+static uint64_t dropped_total()
+{
+    uint64_t total = 0;
+    for (int i = 0; i < RING_COUNT; i++) {
+        total += atomic_load_explicit(&rings[i].dropped, memory_order_relaxed);
+    }
+    return total;
+}
+
+void accesslog_run()
+{
+    struct sigaction sa = {.sa_handler = stop_handler};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    const char* path = ws_config->access_log;
+    int fd = follow_path(-1, path);
+    uint64_t checked = now_ms();
+    uint64_t dropped = dropped_total();
+    while (true) {
+        bool stopping = stop_requested;
+        uint64_t now = now_ms();
+        if (fd < 0 || now - checked >= WS_ACCESS_REOPEN_MS) {
+            fd = follow_path(fd, path);
+            checked = now;
+            uint64_t total = dropped_total();
+            if (total != dropped) {
+                DebugErr("access log dropped %lu records, the rings were full\n", total - dropped);
+                dropped = total;
+            }
+        }
+        int64_t written = fd >= 0 ? accesslog_drain(fd) : 0;
+        if (stopping && written <= 0) {
+            break;
+        }
+        if (written < 0) {
+            // the records stay in the rings, tried again with the file looked up anew
+            usleep(WS_ACCESS_REOPEN_MS * 1000);
+            checked = 0;
+        } else if (written < WS_ACCESS_RING / 2) {
+            // waiting lets the records pile up into larger writes, unless a ring is filling up
+            usleep(WS_ACCESS_FLUSH_MS * 1000);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static const char* method_names[] = {"-", "GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE", "POST", "PATCH", "CONNECT"};
+
+static const char* method_name(uint8_t method)
+{
+    return method < sizeof(method_names) / sizeof(method_names[0]) ? method_names[method] : "-";
+}
+
+static const char* version_name(uint8_t version)
+{
+    switch (version) {
+    case REQ_VERSION_1_0:
+        return "HTTP/1.0";
+    case REQ_VERSION_1_1:
+        return "HTTP/1.1";
+    case REQ_VERSION_2_0:
+        return "HTTP/2";
+    default:
+        return "-";
+    }
+}
+
+// text bounded by room, what does not fit is cut off
+typedef struct {
+    char* out;
+    size_t room;
+    size_t len;
+} Text;
+
+static void put(Text* t, const char* format, ...)
+{
+    if (t->len + 1 >= t->room) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(t->out + t->len, t->room - t->len, format, args);
+    va_end(args);
+    if (n > 0) {
+        t->len += (size_t)n < t->room - t->len ? (size_t)n : t->room - t->len - 1;
+    }
+}
+
+// the uri with what a log line or JSON string can not hold as it is escaped
+static void put_uri(Text* t, const AccessRecord* r, bool json)
+{
+    size_t len = r->uri_len < WS_ACCESS_URI_MAX ? r->uri_len : WS_ACCESS_URI_MAX;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = r->uri[i];
+        if (c == '"' || c == '\\') {
+            put(t, json ? "\\%c" : "\\x%02x", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            put(t, json ? "\\u%04x" : "\\x%02x", c);
+        } else {
+            put(t, "%c", c);
+        }
+    }
+    if (r->uri_len > WS_ACCESS_URI_MAX) {
+        put(t, "...");
+    }
+}
+
+size_t AccessRecord_format(const AccessRecord* r, bool json, char* out, size_t room)
+{
+    Text t = {out, room, 0};
+    if (room == 0) {
+        return 0;
+    }
+    out[0] = '\0';
+
+    char addr[INET6_ADDRSTRLEN] = "-";
+    if (r->family == 4 || r->family == 6) {
+        inet_ntop(r->family == 4 ? AF_INET : AF_INET6, r->addr, addr, sizeof(addr));
+    }
+    time_t seconds = r->time_ns / 1000000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char when[32];
+    if (json) {
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        put(&t, "{\"time\":\"%s.%06luZ\",\"addr\":\"%s\",\"port\":%u,\"method\":\"%s\",\"uri\":\"", when,
+            (unsigned long)(r->time_ns % 1000000000 / 1000), addr, r->port, method_name(r->method));
+        put_uri(&t, r, true);
+        put(&t, "\",\"version\":\"%s\",\"status\":%u,\"bytes\":%lu,\"first_byte_us\":%u,\"duration_us\":%u,\"worker\":%u}",
+            version_name(r->version), r->status, (unsigned long)r->bytes, r->first_byte_us, r->duration_us, r->worker);
+        return t.len;
+    }
+    // the Common Log Format, then the times and the worker
+    strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    put(&t, "%s - - [%s] \"%s ", addr, when, method_name(r->method));
+    put_uri(&t, r, false);
+    put(&t, " %s\" %u %lu %uus %uus %u", version_name(r->version), r->status, (unsigned long)r->bytes,
+        r->first_byte_us, r->duration_us, r->worker);
+    return t.len;
+}
@@ -0,0 +1,104 @@
+#ifndef NBH_ACCESSLOG_HEADER
+#define NBH_ACCESSLOG_HEADER
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// records each worker can have waiting for the logger, a power of two
+#define WS_ACCESS_RING 8192
+
+// the logger looks for new records this often
+#define WS_ACCESS_FLUSH_MS 10
+
+// the log file is looked for again this often, so a rotated one is reopened
+#define WS_ACCESS_REOPEN_MS 1000
+
+// bytes of the request target a record keeps
+#define WS_ACCESS_URI_MAX 76
+
+/* One response, as the workers hand it to the logger and the log file
+ * holds it: fixed size, native byte order, no pointers.
+ */
+typedef struct {
+    // CLOCK_REALTIME when the last byte went out
+    uint64_t time_ns;
+    // header and body bytes of the response
+    uint64_t bytes;
+    uint32_t first_byte_us;
+    uint32_t duration_us;
+    uint16_t status;
+    uint16_t port;
+    uint16_t worker;
+    // of the whole request target, more than WS_ACCESS_URI_MAX when uri was cut
+    uint16_t uri_len;
+    // REQ_METHOD_* or a REQ_ERROR_* when the request line did not parse
+    uint8_t method;
+    // REQ_VERSION_*
+    uint8_t version;
+    // 4 or 6, 0 when the peer is not known
+    uint8_t family;
+    uint8_t reserved;
+    // an IPv4 address takes the first 4 bytes
+    uint8_t addr[16];
+    // the request target as sent, not NUL terminated
+    char uri[WS_ACCESS_URI_MAX];
+} AccessRecord;
+
+_Static_assert(sizeof(AccessRecord) == 128, "AccessRecord is two cache lines");
+
+#define WS_ACCESS_MAGIC "WSACCESS"
+
+// what a log file starts with, wslog checks it before reading records
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    // 0x01020304 as written, another value is a log from a host of the other byte order
+    uint32_t byte_order;
+} AccessLogHeader;
+
+/* Access logging through one single producer, single consumer ring per
+ * worker in shared memory.
+ *
+ * A worker copies a record into its ring when a response is done and
+ * never waits: when the ring is full the record is dropped and counted.
+ * The logger process drains every ring into the access_log file of the
+ * configuration with one writev() per round, so the workers never touch
+ * the file.
+ */
+
+// maps the rings before forking so every worker shares them, false after printing why
+bool accesslog_start();
+
+// this process appends to ring slot, 0 to WS_MAX_WORKERS, the last one for serving from the parent
+void accesslog_worker(int slot);
+
+// true when this process has a ring to append to
+bool accesslog_on();
+
+// the address of the peer of socket fd into record, once per connection
+void accesslog_peer(AccessRecord* record, int fd);
+
+// the request line into record, before the target is decoded and routed
+void accesslog_request(AccessRecord* record, const HttpRequest* req);
+
+// completes record with the status and duration and appends it to the ring of this process
+void accesslog_append(AccessRecord* record, uint32_t status, uint64_t duration_ns);
+
+/* Writes what every ring holds to fd, behind a header when fd is empty.
+ * Returns the records written, -1 after printing why.
+ */
+int64_t accesslog_drain(int fd);
+
+/* The logger process, drains the rings into the file until SIGINT or
+ * SIGTERM and once more after that.
+ */
+void accesslog_run();
+
+/* record as one line of text, or of JSON when json is set, NUL terminated.
+ * Returns its length without the NUL, at most room - 1.
+ */
+size_t AccessRecord_format(const AccessRecord* record, bool json, char* out, size_t room);
+
+#endif
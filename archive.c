@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// deepest directory nesting packed, symlinked directories count too
+#define PACK_DEPTH 32
+
+struct Archive {
+    int refs;
+    int fd;
+    const char* map;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    // the file Archive_reopen last failed on, not tried again
+    dev_t failed_dev;
+    ino_t failed_ino;
+    const WspackHeader* header;
+    const uint32_t* slots;
+    const WspackMember* members;
+    // the server's content type id of each of the archive's
+    int types[WSPACK_TYPES];
+    char path[];
+};
+
+// FNV-1a, the same as the file cache
+static uint64_t path_hash(const char* path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)path[i];
+        h *= 0x100000001b3ull;
+    }
+    return h ? h : 1;
+}
+
+static uint64_t align_up(uint64_t n, uint64_t to) { return (n + to - 1) / to * to; }
+
+typedef struct {
+    char* path;
+    FileInfo info;
+    uint16_t entity_size;
+    char entity[WS_ENTITY_HEADER_MAX];
+    uint64_t offset;
+} PackFile;
+
+typedef struct {
+    PackFile* files;
+    size_t count;
+    size_t cap;
+    // the archive being replaced, never packed into itself
+    dev_t skip_dev;
+    ino_t skip_ino;
+} PackList;
+
+static bool collect(PackList* list, const char* path, int depth)
+{
+    if (depth > PACK_DEPTH) {
+        DebugErr("%s nests deeper than %i directories\n", path, PACK_DEPTH);
+        return false;
+    }
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        int en = errno;
+        DebugErr("opendir(%s) %s\n", path, strerror(en));
+        return false;
+    }
+    bool ok = true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char sub[PATH_MAX];
+        int len = snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (len >= WS_PATH_BUFFER_SIZE || stat(sub, &st) < 0) {
+            // can never be asked for, or a dangling symlink
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            ok = collect(list, sub, depth + 1);
+        } else if (S_ISREG(st.st_mode) && !(st.st_dev == list->skip_dev && st.st_ino == list->skip_ino)) {
+            if (list->count == list->cap) {
+                size_t cap = list->cap ? list->cap * 2 : 256;
+                PackFile* files = realloc(list->files, cap * sizeof(PackFile));
+                if (files == NULL) {
+                    ok = false;
+                    break;
+                }
+                list->files = files;
+                list->cap = cap;
+            }
+            PackFile* f = &list->files[list->count];
+            f->path = strdup(sub);
+            ok = f->path != NULL;
+            list->count += ok;
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+// copies the body of f to offset in out, failing if the file changed since it was looked at
+static bool copy_body(int out, const PackFile* f)
+{
+    int in = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        int en = errno;
+        DebugErr("open(%s) %s\n", f->path, strerror(en));
+        return false;
+    }
+    struct stat st;
+    if (fstat(in, &st) < 0 || (size_t)st.st_size != f->info.size ||
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != f->info.mtime_ns) {
+        DebugErr("%s changed while packing\n", f->path);
+        close(in);
+        return false;
+    }
+    loff_t in_off = 0;
+    loff_t out_off = f->offset;
+    size_t left = f->info.size;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, left, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            // no in-kernel copy between these two, go through a buffer
+            char buffer[64 * 1024];
+            n = pread(in, buffer, left < sizeof(buffer) ? left : sizeof(buffer), in_off);
+            if (n > 0 && pwrite(out, buffer, n, out_off) != n) {
+                n = -1;
+            } else if (n > 0) {
+                in_off += n;
+                out_off += n;
+            }
+        }
+        if (n <= 0) {
+            int en = n < 0 ? errno : 0;
+            DebugErr("copying %s: %s\n", f->path, n < 0 ? strerror(en) : "file shrank");
+            close(in);
+            return false;
+        }
+        left -= n;
+    }
+    close(in);
+    return true;
+}
+
+/* The header, index, members and strings of the archive, with the body
+ * offset of every file filled in. Returns its size, 0 on failure.
+ */
+static size_t build_head(PackList* list, char** head_o, uint64_t* total_o)
+{
+    uint32_t slots = 1;
+    while (slots < list->count * 2) {
+        slots <<= 1;
+    }
+    int types = content_type_count();
+    uint64_t slots_offset = align_up(sizeof(WspackHeader), 8);
+    uint64_t members_offset = align_up(slots_offset + (uint64_t)slots * sizeof(uint32_t), 8);
+    uint64_t types_offset = members_offset + list->count * sizeof(WspackMember);
+    uint64_t strings_offset = types_offset + types * sizeof(uint32_t);
+    uint64_t strings_size = 0;
+    for (int i = 0; i < types; i++) {
+        strings_size += strlen(content_type_name(i)) + 1;
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        strings_size += strlen(list->files[i].path) + list->files[i].entity_size;
+    }
+    size_t head_size = strings_offset + strings_size;
+    char* head = calloc(1, head_size);
+    if (head == NULL) {
+        return 0;
+    }
+
+    WspackHeader* header = (WspackHeader*)head;
+    memcpy(header->magic, WSPACK_MAGIC, sizeof(header->magic));
+    header->version = WSPACK_VERSION;
+    header->count = list->count;
+    header->slots = slots;
+    header->types = types;
+    header->slots_offset = slots_offset;
+    header->members_offset = members_offset;
+    header->types_offset = types_offset;
+
+    uint64_t string = strings_offset;
+    uint32_t* type_names = (uint32_t*)(head + types_offset);
+    for (int i = 0; i < types; i++) {
+        size_t len = strlen(content_type_name(i)) + 1;
+        type_names[i] = string;
+        memcpy(head + string, content_type_name(i), len);
+        string += len;
+    }
+    uint32_t* index = (uint32_t*)(head + slots_offset);
+    WspackMember* members = (WspackMember*)(head + members_offset);
+    uint64_t body = align_up(head_size, WSPACK_ALIGN);
+    for (size_t i = 0; i < list->count; i++) {
+        PackFile* f = &list->files[i];
+        WspackMember* m = &members[i];
+        size_t len = strlen(f->path);
+        m->hash = path_hash(f->path, len);
+        m->offset = f->offset = body;
+        m->size = f->info.size;
+        m->mtime_ns = f->info.mtime_ns;
+        m->ino = f->info.ino;
+        m->dev = f->info.dev;
+        m->path_offset = string;
+        m->path_len = len;
+        memcpy(head + string, f->path, len);
+        string += len;
+        m->entity_offset = string;
+        m->entity_size = f->entity_size;
+        memcpy(head + string, f->entity, f->entity_size);
+        string += f->entity_size;
+        m->content_type = f->info.content_type;
+        m->encoding = f->info.encoding;
+        m->encodings = f->info.encodings;
+        body = align_up(body + f->info.size, WSPACK_ALIGN);
+
+        uint32_t slot = m->hash & (slots - 1);
+        while (index[slot] != 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        index[slot] = i + 1;
+    }
+    // no padding after the last body
+    uint64_t total = list->count ? members[list->count - 1].offset + members[list->count - 1].size : head_size;
+    header->size = total;
+    *head_o = head;
+    *total_o = total;
+    return head_size;
+}
+
+bool Archive_pack(const char* root, const char* out)
+{
+    PackList list = {};
+    struct stat st;
+    if (stat(out, &st) == 0) {
+        list.skip_dev = st.st_dev;
+        list.skip_ino = st.st_ino;
+    }
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", out) >= (int)sizeof(tmp)) {
+        DebugErr("%s: path too long\n", out);
+        return false;
+    }
+    bool ok = collect(&list, root, 0);
+    for (size_t i = 0; ok && i < list.count; i++) {
+        PackFile* f = &list.files[i];
+        f->info = file_open(f->path, false);
+        if (f->info.err != 0) {
+            DebugErr("stat(%s) %s\n", f->path, strerror(f->info.err));
+            ok = false;
+        }
+        f->entity_size = f->info.content_type < 0 ? 0 : entity_header(&f->info, f->entity);
+    }
+
+    char* head = NULL;
+    uint64_t total = 0;
+    size_t head_size = ok ? build_head(&list, &head, &total) : 0;
+    int fd = -1;
+    if (head_size == 0) {
+        ok = false;
+    } else if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        int en = errno;
+        DebugErr("open(%s) %s\n", tmp, strerror(en));
+        ok = false;
+    } else if (pwrite(fd, head, head_size, 0) != (ssize_t)head_size || ftruncate(fd, total) < 0) {
+        int en = errno;
+        DebugErr("writing %s: %s\n", tmp, strerror(en));
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < list.count; i++) {
+        ok = copy_body(fd, &list.files[i]);
+    }
+    if (ok && fsync(fd) < 0) {
+        int en = errno;
+        DebugErr("fsync(%s) %s\n", tmp, strerror(en));
+        ok = false;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ok && rename(tmp, out) < 0) {
+        int en = errno;
+        DebugErr("rename(%s, %s) %s\n", tmp, out, strerror(en));
+        ok = false;
+    }
+    if (!ok && fd >= 0) {
+        unlink(tmp);
+    }
+    if (ok) {
+        DebugMsg("%s: %zu files, %lu bytes\n", out, list.count, total);
+    }
+    free(head);
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.files[i].path);
+    }
+    free(list.files);
+    return ok;
+}
+
+// whether [offset, offset + len) lies inside the archive
+static bool inside(const Archive* a, uint64_t offset, uint64_t len) { return offset <= a->size && len <= a->size - offset; }
+
+// checks every offset once so lookups can trust them
+static const char* validate(Archive* a)
+{
+    const WspackHeader* h = a->header;
+    if (a->size < sizeof(WspackHeader) || memcmp(h->magic, WSPACK_MAGIC, sizeof(h->magic)) != 0) {
+        return "not an archive";
+    } else if (h->version != WSPACK_VERSION) {
+        return "unsupported version";
+    } else if (h->size != a->size) {
+        return "truncated";
+    } else if (h->slots == 0 || (h->slots & (h->slots - 1)) != 0 || h->slots / 2 < h->count ||
+               h->slots_offset % 8 != 0 || h->members_offset % 8 != 0 ||
+               !inside(a, h->slots_offset, (uint64_t)h->slots * sizeof(uint32_t)) ||
+               !inside(a, h->members_offset, (uint64_t)h->count * sizeof(WspackMember)) || h->types > WSPACK_TYPES ||
+               h->types_offset % 4 != 0 || !inside(a, h->types_offset, (uint64_t)h->types * sizeof(uint32_t))) {
+        return "bad index";
+    }
+    a->slots = (const uint32_t*)(a->map + h->slots_offset);
+    a->members = (const WspackMember*)(a->map + h->members_offset);
+
+    const uint32_t* names = (const uint32_t*)(a->map + h->types_offset);
+    for (uint32_t i = 0; i < h->types; i++) {
+        if (!inside(a, names[i], 1) || memchr(a->map + names[i], '\0', a->size - names[i]) == NULL) {
+            return "bad content type";
+        }
+        a->types[i] = -1;
+        for (int id = 0; id < content_type_count(); id++) {
+            if (strcmp(content_type_name(id), a->map + names[i]) == 0) {
+                a->types[i] = id;
+                break;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < h->slots; i++) {
+        if (a->slots[i] > h->count) {
+            return "bad index";
+        }
+    }
+    for (uint32_t i = 0; i < h->count; i++) {
+        const WspackMember* m = &a->members[i];
+        if (!inside(a, m->path_offset, m->path_len) || !inside(a, m->entity_offset, m->entity_size) ||
+            !inside(a, m->offset, m->size) || m->content_type >= (int)h->types || m->content_type < -1 ||
+            m->entity_size > WS_ENTITY_HEADER_MAX) {
+            return "bad member";
+        }
+    }
+    return NULL;
+}
+
+Archive* Archive_open(const char* path)
+{
+    size_t path_len = strlen(path);
+    Archive* a = calloc(1, sizeof(Archive) + path_len + 1);
+    if (a == NULL) {
+        return NULL;
+    }
+    memcpy(a->path, path, path_len + 1);
+    a->refs = 1;
+    a->map = MAP_FAILED;
+    a->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char* why = NULL;
+    if (a->fd < 0 || fstat(a->fd, &st) < 0) {
+        why = strerror(errno);
+    } else if (st.st_size < (off_t)sizeof(WspackHeader)) {
+        why = "not an archive";
+    } else {
+        a->size = st.st_size;
+        a->dev = st.st_dev;
+        a->ino = st.st_ino;
+        a->map = mmap(NULL, a->size, PROT_READ, MAP_SHARED, a->fd, 0);
+        if (a->map == MAP_FAILED) {
+            why = strerror(errno);
+        } else {
+            a->header = (const WspackHeader*)a->map;
+            why = validate(a);
+        }
+    }
+    if (why) {
+        DebugErr("%s: %s\n", path, why);
+        Archive_release(a);
+        return NULL;
+    }
+    return a;
+}
+
+void Archive_retain(Archive* archive) { archive->refs++; }
+
+void Archive_release(Archive* archive)
+{
+    if (archive->refs-- > 1) {
+        return;
+    }
+    if (archive->map != MAP_FAILED) {
+        munmap((void*)archive->map, archive->size);
+    }
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+    free(archive);
+}
+
+int Archive_fd(const Archive* archive) { return archive->fd; }
+
+bool Archive_lookup(const Archive* archive, const char* path, size_t len, FileInfo* file, StringView* entity)
+{
+    uint64_t hash = path_hash(path, len);
+    uint32_t mask = archive->header->slots - 1;
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        uint32_t n = archive->slots[slot];
+        if (n == 0) {
+            return false;
+        }
+        const WspackMember* m = &archive->members[n - 1];
+        if (m->hash != hash || m->path_len != len || memcmp(archive->map + m->path_offset, path, len) != 0) {
+            continue;
+        }
+        *file = (FileInfo){
+            .fd = archive->fd,
+            .offset = m->offset,
+            .size = m->size,
+            .mtime_ns = m->mtime_ns,
+            .ino = m->ino,
+            .dev = m->dev,
+            .content_type = m->content_type < 0 ? -1 : archive->types[m->content_type],
+            .encoding = m->encoding,
+            .encodings = m->encodings,
+        };
+        entity->ptr = archive->map + m->entity_offset;
+        entity->size = m->entity_size;
+        return true;
+    }
+}
+
+Archive* Archive_reopen(Archive* archive)
+{
+    struct stat st;
+    if (stat(archive->path, &st) < 0 || (st.st_dev == archive->dev && st.st_ino == archive->ino) ||
+        (st.st_dev == archive->failed_dev && st.st_ino == archive->failed_ino)) {
+        return NULL;
+    }
+    Archive* next = Archive_open(archive->path);
+    if (next == NULL) {
+        archive->failed_dev = st.st_dev;
+        archive->failed_ino = st.st_ino;
+    }
+    return next;
+}
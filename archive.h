@@ -0,0 +1,93 @@
+#ifndef NBH_ARCHIVE_HEADER
+#define NBH_ARCHIVE_HEADER
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A whole site packed into one read-only file by wspack.
+ *
+ * Layout: the header, the path index (open addressing, WspackHeader.slots
+ * uint32_t member numbers + 1, 0 when empty), the members, the strings
+ * (paths and the entity_header() of every member), then the bodies each
+ * starting on a WSPACK_ALIGN boundary so sendfile() reads whole pages.
+ *
+ * Content types are stored as the packer's ids together with their names,
+ * the server maps them onto its own ids when it opens the archive.
+ */
+#define WSPACK_MAGIC "NBHPACK"
+#define WSPACK_VERSION 1
+#define WSPACK_ALIGN 4096
+
+// most content types an archive can name
+#define WSPACK_TYPES 64
+
+// poll for a new archive renamed over the served one this often
+#define WS_ARCHIVE_CHECK_MS 1000
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t slots; // a power of two, at least twice count
+    uint32_t types;
+    uint64_t slots_offset;
+    uint64_t members_offset;
+    uint64_t types_offset; // types uint32_t offsets of NUL terminated names
+    uint64_t size;         // of the whole file, a shorter one is refused
+} WspackHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset; // of the body
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t path_offset;
+    uint64_t entity_offset;
+    uint16_t path_len;
+    uint16_t entity_size;
+    int16_t content_type; // index into the archive's type names, -1 if unknown
+    uint8_t encoding;
+    uint8_t encodings;
+} WspackMember;
+
+/* Packs every regular file under root, following symlinks, into out.
+ *
+ * Members are named root/... like the paths uri_to_path() makes. The
+ * archive is written next to out and renamed over it, so a server serving
+ * out switches to it in one step. Returns false after printing why.
+ */
+bool Archive_pack(const char* root, const char* out);
+
+/* An archive mapped into memory, reference counted so a response sending
+ * from it keeps it alive after a newer one replaced it.
+ */
+typedef struct Archive Archive;
+
+// maps path, NULL after printing why
+Archive* Archive_open(const char* path);
+
+void Archive_retain(Archive* archive);
+
+// unmaps and closes the archive with its last reference
+void Archive_release(Archive* archive);
+
+// every body is sent from this descriptor, at FileInfo.offset
+int Archive_fd(const Archive* archive);
+
+/* Looks up the member path, true when there is one. file is filled in like
+ * file_open(path, true) would, but its fd is Archive_fd() and the body
+ * starts at file->offset. entity is the stored entity_header().
+ */
+bool Archive_lookup(const Archive* archive, const char* path, size_t len, FileInfo* file, StringView* entity);
+
+/* Returns the archive now at the path archive was opened from when that is
+ * another file, NULL while it is the same one or can not be opened. A file
+ * that failed to open is not tried again until it is replaced too.
+ */
+Archive* Archive_reopen(Archive* archive);
+
+#endif
@@ -1,148 +1,88 @@
+#define _GNU_SOURCE
+
 #include "common.h"
+#include "metrics.h"
+#include "phash.h"
+#include "router.h"
+#include "scan.h"
 
 #include <arpa/inet.h>
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/openat2.h>
 #include <netdb.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-static const char* HTTP_1_1 = "HTTP/1.1 ";
-static const char* HTTP_1_0 = "HTTP/1.0 ";
+static const char* http_versions[] = {"HTTP/1.0", "HTTP/1.1"};
 
-static const char* HTTP_200 = "200 Ok\r\n";
 
-// errors wont have files attached so double \r\n
-static const char* HTTP_400 = "400 Bad Request\r\n";
-static const char* HTTP_403 = "403 Forbidden\r\n";
-static const char* HTTP_404 = "404 Not Found\r\n";
-static const char* HTTP_405 = "405 Method Not Allowed\r\n";
-static const char* HTTP_414 = "414 URI Too Long\r\n";
-static const char* HTTP_500 = "500 Internal Sever Error\r\n";
-static const char* HTTP_505 = "505 HTTP Versoin Not Supported\r\n";
+// every status we send, errors get a small html body
+static const struct {
+    uint32_t code;
+    const char* reason;
+} statuses[] = {
+    {200, "Ok"},
+    {206, "Partial Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {400, "Bad Request"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {414, "URI Too Long"},
+    {416, "Range Not Satisfiable"},
+    {500, "Internal Server Error"},
+    {505, "HTTP Version Not Supported"},
+};
 
-static int text_hash(const char* text, size_t size)
-{
-    int ret = 0;
-    for (size_t i = 0; i < size - 1; i++) {
-        ret += (int)text[i] * (int)text[i + 1];
-    }
-    return ret;
-}
+#define STATUS_COUNT (sizeof(statuses) / sizeof(statuses[0]))
 
-#define CONTENT_TYPE_COUNT 16
-static char content_type_trans[CONTENT_TYPE_COUNT][2][64] = {
-    {"html", "text/html"},
-    {"css", "text/css"},
-    {"js", "application/javascript"},
-    {"jpg", "image/jpg"},
-    {"png", "image/png"},
-    {"gif", "image/gif"},
-    {"txt", "text/plain"},
-    {"htm", "text/html"},
-    {"ico", "image/x-icon"},
-    // not required
-    {"pdf", "application/pdf"},
-    {"json", "application/json"},
-    {"bin", "application/octect-stream"},
-    {"bmp", "image/bmp"},
-    {"csv", "image/csv"},
-    {"webp", "image/webp"},
-    {"jpeg", "image/jpg"},
-};
+_Static_assert(STATUS_COUNT <= WS_STATUS_MAX, "statuses outgrew WS_STATUS_MAX");
 
-#define HTTP_METHOD_COUNT 9
-static const char http_methods[HTTP_METHOD_COUNT][8] =
-    {"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE", "POST", "PATCH", "CONNECT"};
-#define RMH_GET 10695
-#define RMH_HEAD 13873
-#define RMH_OPTIONS 37575
-#define RMH_TRACE 21196
-#define RMH_PUT 13940
-#define RMH_DELETE 26772
-#define RMH_POST 19849
-#define RMH_PATCH 21112
-#define RMH_CONNECT 33172
-
-#define HTTP_VERSION_COUNT 3
-const char http_versions[HTTP_VERSION_COUNT][16] = {
-    "HTTP/1.0",
-    "HTTP/1.1",
-    "HTTP/2.0",
+// sidecar codings, the preferred first
+static const struct {
+    uint8_t encoding;
+    const char* suffix;
+    const char* header;
+} encodings[] = {
+    {ENC_BR, ".br", "Content-Encoding: br\r\n"},
+    {ENC_GZIP, ".gz", "Content-Encoding: gzip\r\n"},
 };
-#define RVH_1_0 30349
-#define RVH_1_1 30395
-#define RVH_2_0 30442
 
-void compute_hashes()
-{
-    for (size_t m = 0; m < HTTP_METHOD_COUNT; m++) {
-        printf("%s -> %i\n", http_methods[m], text_hash(http_methods[m], strlen(http_methods[m])));
-    }
-    for (size_t m = 0; m < HTTP_VERSION_COUNT; m++) {
-        printf("%s -> %i\n", http_versions[m], text_hash(http_versions[m], strlen(http_versions[m])));
-    }
-}
+#define ENCODING_COUNT (sizeof(encodings) / sizeof(encodings[0]))
 
 static bool is_whitespace(char c) { return c == ' ' || c == '\r' || c == '\t'; }
 
 size_t http_nlen(const char* src, size_t max)
 {
-    for (size_t i = 1; i < max; i++) {
-        if (src[i - 1] == '\r' && src[i] == '\n') {
-            return i - 1;
-        } else if (src[i] == '\0') {
+    size_t i = 0;
+    while (i < max) {
+        i += scan_cr_or_nul(src + i, max - i);
+        if (i + 1 >= max || src[i] == '\0') {
             return max;
+        } else if (src[i + 1] == '\n') {
+            return i;
         }
+        i++;
     }
     return max;
 }
 
-static int get_http_method_from_hash(int method_hash)
-{
-    switch (method_hash) {
-    case RMH_GET:
-        return REQ_METHOD_GET;
-    case RMH_HEAD:
-        return REQ_METHOD_HEAD;
-    case RMH_OPTIONS:
-        return REQ_METHOD_OPTIONS;
-    case RMH_TRACE:
-        return REQ_METHOD_TRACE;
-    case RMH_PUT:
-        return REQ_METHOD_PUT;
-    case RMH_DELETE:
-        return REQ_METHOD_DELETE;
-    case RMH_POST:
-        return REQ_METHOD_POST;
-    case RMH_PATCH:
-        return REQ_METHOD_PATCH;
-    case RMH_CONNECT:
-        return REQ_METHOD_CONNECT;
-    }
-    return REQ_ERROR_METHOD_PARSE;
-}
-
-static int get_http_version_from_hash(int version_hash)
-{
-    switch (version_hash) {
-    case RVH_1_0:
-        return REQ_VERSION_1_0;
-    case RVH_1_1:
-        return REQ_VERSION_1_1;
-    case RVH_2_0:
-        return REQ_VERSION_2_0;
-    }
-    return REQ_ERROR_VERSION_PARSE;
-}
-
 StringView parse_word(const char* src, size_t max)
 {
     size_t i = 0;
@@ -151,348 +91,1327 @@ StringView parse_word(const char* src, size_t max)
         i++;
     }
     ret.ptr = src + i;
-    while (i < max && !is_whitespace(src[i])) {
-        ret.size++;
-        i++;
-    }
+    ret.size = scan_space(src + i, max - i);
     return ret;
 }
 
-HttpRequestLine HttpRequestLine_create(const char from[WS_BUFFER_SIZE])
+HttpRequestLine HttpRequestLine_parse(const char* line, size_t len)
 {
     HttpRequestLine rv = {};
-    const char* from_cpy = from;
+    const char* from_cpy = line;
 
-    // make sure request is not too long
-    size_t request_line_len = http_nlen(from_cpy, WS_BUFFER_SIZE);
-    if (request_line_len == WS_BUFFER_SIZE) {
-        rv.method = REQ_ERROR_URI_SIZE;
+    // parsing http method
+    StringView method_sv = parse_word(from_cpy, len);
+    if (method_sv.size == 0) {
+        rv.method = REQ_ERROR_METHOD_PARSE;
         return rv;
     }
-    // parsing http method
-    StringView method_sv = parse_word(from_cpy, WS_BUFFER_SIZE);
-    rv.method = get_http_method_from_hash(text_hash(method_sv.ptr, method_sv.size));
-    if (method_sv.size == 0 || method_sv.size == WS_BUFFER_SIZE || rv.method == REQ_ERROR_METHOD_PARSE) {
+    int method = phash_method(method_sv.ptr, method_sv.size);
+    if (method < 0) {
+        rv.method = REQ_ERROR_METHOD_PARSE;
         return rv;
     }
-    from_cpy = from + (method_sv.ptr - from) + method_sv.size;
+    rv.method = method;
+    from_cpy = method_sv.ptr + method_sv.size;
     // parsing http uri
-    StringView uri_sv = parse_word(from_cpy, WS_BUFFER_SIZE - (from_cpy - from));
-    if (uri_sv.size == 0 || uri_sv.size == WS_BUFFER_SIZE) {
+    StringView uri_sv = parse_word(from_cpy, len - (from_cpy - line));
+    if (uri_sv.size == 0) {
         rv.method = REQ_ERROR_URI_PARSE;
         return rv;
     }
+    if (uri_sv.size >= WS_PATH_BUFFER_SIZE) {
+        rv.method = REQ_ERROR_URI_SIZE;
+        return rv;
+    }
     memcpy(rv.uri, uri_sv.ptr, uri_sv.size);
-    from_cpy = from + (uri_sv.ptr - from) + uri_sv.size;
+    from_cpy = uri_sv.ptr + uri_sv.size;
     // parsing http versoin
-    StringView version_sv = parse_word(from_cpy, WS_BUFFER_SIZE - (from_cpy - from));
-    rv.version = get_http_version_from_hash(text_hash(version_sv.ptr, version_sv.size));
-    if (version_sv.size == 0 || version_sv.size == WS_BUFFER_SIZE || rv.version == REQ_ERROR_VERSION_PARSE) {
+    StringView version_sv = parse_word(from_cpy, len - (from_cpy - line));
+    int version = phash_version(version_sv.ptr, version_sv.size);
+    if (version < 0) {
         rv.method = REQ_ERROR_VERSION_PARSE;
+        rv.version = REQ_ERROR_VERSION_PARSE;
         return rv;
     }
+    rv.version = version;
     return rv;
 }
 
-HttpRequest HttpRequest_create(const char from[WS_BUFFER_SIZE])
+HttpRequestLine HttpRequestLine_create(const char from[WS_BUFFER_SIZE])
+{
+    // make sure request is not too long
+    size_t request_line_len = http_nlen(from, WS_BUFFER_SIZE);
+    if (request_line_len == WS_BUFFER_SIZE) {
+        HttpRequestLine rv = {.method = REQ_ERROR_URI_SIZE};
+        return rv;
+    }
+    return HttpRequestLine_parse(from, request_line_len);
+}
+
+static size_t trim_end(const char* s, size_t len)
 {
-    HttpRequest req = {};
-    req.line = HttpRequestLine_create(from);
-    if (req.line.method > REQ_ERROR) {
-        return req;
+    while (len > 0 && is_whitespace(s[len - 1])) {
+        len--;
     }
+    return len;
+}
 
-    size_t i = 0;
+int header_id(const char* name, size_t len) { return phash_header(name, len); }
+
+// splits a "name: value" line, returns the HDR_* id of the name or -1
+static int header_split(const char* line, size_t len, StringView* value)
+{
+    size_t colon = scan_colon(line, len);
+    if (colon == len) {
+        return -1;
+    }
+    size_t name_start = 0;
+    while (name_start < colon && is_whitespace(line[name_start])) {
+        name_start++;
+    }
+    int id = header_id(line + name_start, trim_end(line + name_start, colon - name_start));
+    if (id < 0) {
+        return -1;
+    }
+    size_t value_start = colon + 1;
+    while (value_start < len && is_whitespace(line[value_start])) {
+        value_start++;
+    }
+    value->ptr = line + value_start;
+    value->size = trim_end(value->ptr, len - value_start);
+    return id;
+}
+
+// keep-alive or close out of a Connection token list, close wins
+static int connection_value(const char* value, size_t len)
+{
     int rv = 0;
-    while (1) {
-        size_t header_len = http_nlen(from + i, WS_BUFFER_SIZE - i);
-        if (header_len + i >= WS_BUFFER_SIZE || header_len == 0) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (is_whitespace(value[i]) || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',') {
+            i++;
+        }
+        size_t token_len = trim_end(value + start, i - start);
+        if (token_len == strlen("close") && strncasecmp(value + start, "close", token_len) == 0) {
+            return REQ_CONNECTION_CLOSE;
+        } else if (token_len == strlen("keep-alive") && strncasecmp(value + start, "keep-alive", token_len) == 0) {
+            rv = REQ_CONNECTION_KEEP_ALIVE;
+        }
+    }
+    return rv;
+}
+
+/* Copies a header value into the request so it outlives the receive
+ * buffer. A repeated header is joined to the earlier value as a comma
+ * separated list, values that do not fit are dropped.
+ */
+static void HttpHeaders_store(HttpHeaders* headers, int id, StringView value)
+{
+    HeaderValue* hv = &headers->values[id];
+    size_t prefix = hv->size > 0 ? hv->size + 2 : 0;
+    size_t need = prefix + value.size;
+    if (value.size == 0 || need > (size_t)(WS_HEADER_VALUES_SIZE - headers->used)) {
+        return;
+    }
+    char* dst = headers->buffer + headers->used;
+    if (prefix > 0) {
+        memcpy(dst, headers->buffer + hv->offset, hv->size);
+        memcpy(dst + hv->size, ", ", 2);
+    }
+    memcpy(dst + prefix, value.ptr, value.size);
+    hv->offset = headers->used;
+    hv->size = need;
+    headers->used += need;
+}
+
+static void HttpHeaders_keep(HttpHeaders* headers, int id, StringView value)
+{
+    HttpHeaders_store(headers, id, value);
+    if (id == HDR_CONNECTION) {
+        int connection = connection_value(value.ptr, value.size);
+        if (connection > 0) {
+            headers->connection = connection;
+        }
+    }
+}
+
+int HttpHeaders_add(HttpHeaders* headers, const char* name, size_t name_len, StringView value)
+{
+    int id = header_id(name, name_len);
+    if (id >= 0) {
+        HttpHeaders_keep(headers, id, value);
+    }
+    return id;
+}
+
+StringView HttpHeaders_get(const HttpHeaders* headers, int id)
+{
+    StringView rv = {headers->buffer + headers->values[id].offset, headers->values[id].size};
+    return rv;
+}
+
+// any Content-Length other than 0
+static bool has_body(const HttpHeaders* headers)
+{
+    StringView cl = HttpHeaders_get(headers, HDR_CONTENT_LENGTH);
+    for (size_t i = 0; i < cl.size; i++) {
+        if (cl.ptr[i] != '0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HttpParser_init(HttpParser* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->limit = WS_BUFFER_SIZE;
+}
+
+// one complete line without its line ending
+static void HttpParser_line(HttpParser* p, const char* line, size_t len)
+{
+    if (!p->in_headers) {
+        p->request.line = HttpRequestLine_parse(line, len);
+        p->in_headers = true;
+        return;
+    }
+    StringView value;
+    int id = header_split(line, len, &value);
+    if (id < 0) {
+        // not a header we keep
+        return;
+    }
+    HttpHeaders_keep(&p->request.headers, id, value);
+}
+
+int HttpParser_feed(HttpParser* p, const char* buffer, size_t len)
+{
+    if (p->state != PARSE_INCOMPLETE) {
+        return p->state;
+    }
+    while (p->scanned < len) {
+        size_t end = p->scanned + scan_lf(buffer + p->scanned, len - p->scanned);
+        if (end == len) {
+            p->scanned = len;
             break;
         }
-        // skip to next header
-        i += header_len + 2;
-        if ((rv = headers_connection_parse(from + i, WS_BUFFER_SIZE - i)) > 0) {
-            req.headers.connection = rv;
+        size_t line_len = end - p->line_start;
+        if (line_len > 0 && buffer[end - 1] == '\r') {
+            line_len--;
         }
+        p->scanned = end + 1;
+
+        if (line_len == 0 && p->in_headers) {
+            // the empty line after the headers
+            p->head_len = p->scanned;
+            p->state = PARSE_DONE;
+            if (p->request.headers.connection == 0 && p->request.line.version == REQ_VERSION_1_1) {
+                // persistent unless asked otherwise since HTTP/1.1
+                p->request.headers.connection = REQ_CONNECTION_KEEP_ALIVE;
+            }
+            if (has_body(&p->request.headers)) {
+                // bodies are never read, what follows them can not be framed
+                p->request.headers.connection = REQ_CONNECTION_CLOSE;
+            }
+            return p->state;
+        } else if (line_len > 0) {
+            HttpParser_line(p, buffer + p->line_start, line_len);
+        }
+        // a blank line before the request line is ignored
+        p->line_start = p->scanned;
+    }
+
+    if (len >= p->limit) {
+        // the head can not fit in the buffer
+        if (!p->in_headers) {
+            p->request.line.method = REQ_ERROR_URI_SIZE;
+        } else if (p->request.line.method < REQ_ERROR) {
+            p->request.line.method = REQ_ERROR_HEADERS_PARSE;
+        }
+        p->head_len = len;
+        p->state = PARSE_ERROR;
+    }
+    return p->state;
+}
+
+HttpRequest HttpRequest_create(const char from[WS_BUFFER_SIZE])
+{
+    HttpParser parser;
+    HttpParser_init(&parser);
+    HttpParser_feed(&parser, from, strnlen(from, WS_BUFFER_SIZE));
+    if (!parser.in_headers) {
+        // no complete request line
+        parser.request.line = HttpRequestLine_create(from);
     }
-    return req;
+    return parser.request;
 }
 
-const char* get_content_type(const char* path)
+int content_type_id(const char* path)
 {
-    size_t dot_index = WS_PATH_BUFFER_SIZE;
-    size_t path_len = strnlen(path, WS_PATH_BUFFER_SIZE);
+    size_t dot_index = WS_URI_BUFFER_SIZE;
+    size_t path_len = strnlen(path, WS_URI_BUFFER_SIZE);
     for (int i = ((int)path_len) - 1; i > 0; i--) {
         if (path[i] == '.') {
             dot_index = i;
             break;
         }
     }
-    if (dot_index == WS_PATH_BUFFER_SIZE) {
-        return "";
+    if (dot_index == WS_URI_BUFFER_SIZE) {
+        return -1;
     }
 
-    for (size_t i = 0; i < CONTENT_TYPE_COUNT; i++) {
-        if (strncmp(path + dot_index + 1, content_type_trans[i][0], WS_PATH_BUFFER_SIZE - (dot_index + 1)) == 0) {
-            return content_type_trans[i][1];
+    const Config* config = ws_startup;
+    for (int i = 0; i < config->mime_count; i++) {
+        if (strcmp(path + dot_index + 1, config->mime[i].ext) == 0) {
+            return i;
         }
     }
-    return "";
+    return -1;
 }
 
-int uri_to_path(char uri[WS_URI_BUFFER_SIZE])
+const char* content_type_name(int id) { return id < 0 ? "" : ws_startup->mime[id].type; }
+
+int content_type_count() { return ws_startup->mime_count; }
+
+const char* get_content_type(const char* path) { return content_type_name(content_type_id(path)); }
+
+int status_id(uint32_t code)
 {
-    unsigned int root_len = strlen(ROOT_DIR);
-    if (strncmp("/", uri, WS_URI_BUFFER_SIZE) == 0 || strncmp("/inside/", uri, WS_URI_BUFFER_SIZE) == 0) {
-        const char* default_path = "/index.html";
-        memcpy(uri, ROOT_DIR, root_len);
-        memcpy(uri + root_len, default_path, strlen(default_path));
-        return 0;
+    size_t s = 0;
+    while (s < STATUS_COUNT - 1 && statuses[s].code != code) {
+        s++;
     }
-    unsigned int uri_len = strnlen(uri, WS_PATH_BUFFER_SIZE);
-    memmove(uri + root_len, uri, uri_len);
-    memcpy(uri, ROOT_DIR, root_len);
-    return 0;
+    return s;
 }
 
-ssize_t get_file_size(const char* uri)
+uint32_t status_code(int id) { return statuses[id].code; }
+
+int status_count() { return STATUS_COUNT; }
+
+static int hex_digit(char c)
 {
-    static struct stat st;
-    int rv = stat(uri, &st);
-    if (rv < 0) {
-        return -1;
+    if (c >= '0' && c <= '9') {
+        return c - '0';
     }
-    return st.st_size;
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
 }
 
-// i got carried away with callgrind
-static int connection_hash(const char* src, size_t size)
+bool uri_decode(char uri[WS_URI_BUFFER_SIZE], char query[WS_URI_BUFFER_SIZE])
 {
-    int hash = 0;
-    int pos = 1;
-    for (size_t i = 0; i < size; i++) {
-        switch (src[i]) {
-        case ' ':
-            break;
-        case 'c':
-        case 'C':
-        case 'o':
-        case 'n':
-        case 'e':
-        case 't':
-        case 'i':
-        case 'k':
-        case 'K':
-        case 'a':
-        case 'A':
-        case 'l':
-        case 'v':
-        case 's':
-        case 'p':
-        case ':':
-        case '-':
-            hash += tolower(src[i]) * pos;
-            pos++;
-            break;
-        default:
-            return -1;
+    size_t len = strnlen(uri, WS_URI_BUFFER_SIZE);
+    size_t end = strcspn(uri, "?#");
+    query[0] = '\0';
+    if (uri[end] == '?') {
+        size_t query_len = strcspn(uri + end + 1, "#");
+        memcpy(query, uri + end + 1, query_len);
+        query[query_len] = '\0';
+    }
+    size_t out = 0;
+    for (size_t i = 0; i < end; i++) {
+        char c = uri[i];
+        if (c == '%') {
+            int high = i + 2 < end ? hex_digit(uri[i + 1]) : -1;
+            int low = high >= 0 ? hex_digit(uri[i + 2]) : -1;
+            if (low < 0 || (high == 0 && low == 0)) {
+                return false;
+            }
+            c = high << 4 | low;
+            i += 2;
         }
+        uri[out++] = c;
     }
-    return hash;
+    memset(uri + out, 0, len - out);
+    return out > 0 && uri[0] == '/';
+}
+
+int uri_to_path(char uri[WS_URI_BUFFER_SIZE])
+{
+    const Router* router = router_active();
+    return router ? Router_route(router, uri, ws_config->root) : -1;
 }
 
 int headers_connection_parse(const char* from, size_t max_len)
 {
     size_t header_len = http_nlen(from, max_len);
-    int chash = connection_hash(from, header_len);
-    // printf("header_len=%zu, hash=%i, header=%s|\n", header_len, chash, from);
-    switch (chash) {
-    case 23059:
-        return REQ_CONNECTION_KEEP_ALIVE;
-    case 14066:
-        return REQ_CONNECTION_CLOSE;
+    StringView value;
+    if (header_split(from, header_len, &value) != HDR_CONNECTION) {
+        return 0;
     }
-    return 0;
+    return connection_value(value.ptr, value.size);
 }
 
-static char* response_pushn(char* head_ptr, const char* topush, size_t n)
+// longest template, status line and Connection header plus an error body
+#define TEMPLATE_MAX 256
+
+/* The status line and Connection header of every (version, status,
+ * connection) combination, and for errors the whole response. Built again
+ * whenever the configuration changes so a response header is a memcpy of
+ * the template plus the entity header.
+ */
+typedef struct {
+    uint16_t status_size; // status line and Connection header
+    uint16_t header_size; // without the error body
+    uint16_t size;
+    char data[TEMPLATE_MAX];
+} ResponseTemplate;
+
+static ResponseTemplate templates[2][STATUS_COUNT][2];
+
+// generation + 1 of the configuration the templates were built from, 0 before the first response
+static uint64_t templates_generation = 0;
+
+// "Content-Type: <type>\r\nContent-Length: " for every content type, rows fit the longest type
+static char entity_prefixes[WS_MIME_MAX][sizeof("Content-Type: \r\nContent-Length: ") - 1 + WS_MIME_TYPE_MAX];
+static uint8_t entity_prefix_sizes[WS_MIME_MAX];
+
+_Static_assert(sizeof(entity_prefixes[0]) <= UINT8_MAX, "entity_prefix_sizes must hold a whole row");
+
+static pthread_once_t entity_prefixes_once = PTHREAD_ONCE_INIT;
+
+// the MIME table only changes on restart, so neither do these
+static void entity_prefixes_init()
 {
-    strncpy(head_ptr, topush, n);
-    return head_ptr + n;
+    const Config* config = ws_startup;
+    for (int i = 0; i < config->mime_count; i++) {
+        entity_prefix_sizes[i] = snprintf(
+            entity_prefixes[i], sizeof(entity_prefixes[i]), "Content-Type: %s\r\nContent-Length: ", config->mime[i].type
+        );
+    }
 }
 
-static char* response_push(char* head_ptr, const char* topush)
+// "Content-Type: <type>\r\nContent-Length: " of content type id, the table is built on first use from any caller
+static const char* entity_prefix(int id, size_t* size)
 {
-    strcpy(head_ptr, topush);
-    return head_ptr + strlen(topush);
+    pthread_once(&entity_prefixes_once, entity_prefixes_init);
+    *size = entity_prefix_sizes[id];
+    return entity_prefixes[id];
 }
 
-static char* response_push_crlf(char* head_ptr)
+static void templates_build(const Config* config)
 {
-    strcpy(head_ptr, "\r\n");
-    return head_ptr + 2;
+    char keep_alive[80];
+    snprintf(
+        keep_alive,
+        sizeof(keep_alive),
+        "Connection: keep-alive\r\nKeep-Alive: timeout=%i, max=%i\r\n",
+        (config->keepalive_timeout + 999) / 1000,
+        config->keepalive_requests
+    );
+    const char* connection_headers[] = {"Connection: close\r\n", keep_alive};
+    for (int v = 0; v < 2; v++) {
+        for (size_t s = 0; s < STATUS_COUNT; s++) {
+            for (int c = 0; c < 2; c++) {
+                ResponseTemplate* t = &templates[v][s][c];
+                int n = snprintf(
+                    t->data,
+                    TEMPLATE_MAX,
+                    "%s %u %s\r\n%s",
+                    http_versions[v],
+                    statuses[s].code,
+                    statuses[s].reason,
+                    connection_headers[c]
+                );
+                t->status_size = n;
+                t->header_size = n;
+                t->size = n;
+                if (statuses[s].code < 400) {
+                    continue;
+                }
+                char body[96];
+                int body_len = snprintf(
+                    body, sizeof(body), "<html><body><h1>%u %s</h1></body></html>\n", statuses[s].code, statuses[s].reason
+                );
+                n += snprintf(
+                    t->data + n, TEMPLATE_MAX - n, "Content-Type: text/html\r\nContent-Length: %i\r\n\r\n", body_len
+                );
+                t->header_size = n;
+                n += snprintf(t->data + n, TEMPLATE_MAX - n, "%s", body);
+                t->size = n;
+            }
+        }
+    }
+    templates_generation = config->generation + 1;
 }
 
-static const char* connection_close_cstr = "Connection: close\r\n";
-static const char* connection_keepalive_str = "Connection: keep-alive\r\nKeep-Alive: timeout=1, max=500\r\n";
-static char* response_push_connection_header(char* head_ptr, int connection_header)
+static const ResponseTemplate* response_template(uint32_t code, const HttpRequest* req)
 {
-    if (connection_header == REQ_CONNECTION_CLOSE || connection_header == 0) {
-        head_ptr = response_push(head_ptr, connection_close_cstr);
-    } else {
-        head_ptr = response_push(head_ptr, connection_keepalive_str);
+    const Config* config = ws_config;
+    if (templates_generation != config->generation + 1) {
+        templates_build(config);
     }
-    return head_ptr;
+    int s = status_id(code);
+    // 505 is the one answer that can not echo the version asked for
+    int v = req->line.version == REQ_VERSION_1_0 && code != 505 ? 0 : 1;
+    int c = req->headers.connection == REQ_CONNECTION_KEEP_ALIVE ? 1 : 0;
+    return &templates[v][s][c];
 }
 
-static const char* code_str(int code)
-{
-    switch (code) {
-    case 200:
-        return HTTP_200;
-    case 400:
-        return HTTP_400;
-    case 403:
-        return HTTP_403;
-    case 404:
-        return HTTP_404;
-    case 405:
-        return HTTP_405;
-    case 414:
-        return HTTP_414;
-    case 500:
-        return HTTP_500;
-    }
-    return HTTP_505;
-}
-
-static char* fill_response_header(
-    int code,
-    const char* http_version,
-    const HttpRequest* req,
-    HttpResponse* ret,
-    char* header_buffer,
-    bool finish
-)
-{
-    char* head_ptr = header_buffer;
-    head_ptr = response_push(head_ptr, http_version);
+/* Copies the template for code. With finish the response is complete, an
+ * error body is left out for HEAD; otherwise only the status line and
+ * Connection header are written and the caller appends the rest.
+ */
+static char* fill_response_header(int code, const HttpRequest* req, HttpResponse* ret, char* header_buffer, bool finish)
+{
+    const ResponseTemplate* t = response_template(code, req);
     ret->code = code;
-    head_ptr = response_push(head_ptr, code_str(code));
-    head_ptr = response_push_connection_header(head_ptr, req->headers.connection);
+    size_t size = t->status_size;
     if (finish) {
-        head_ptr = response_push_crlf(head_ptr);
-        ret->header_size = head_ptr - header_buffer;
+        size = req->line.method == REQ_METHOD_HEAD ? t->header_size : t->size;
     }
-    return head_ptr;
+    memcpy(header_buffer, t->data, size);
+    if (finish) {
+        ret->header_size = size;
+    }
+    return header_buffer + size;
 }
 
-HttpResponse HttpResponse_create(HttpRequest* req, char* header_buffer, size_t header_buffer_size)
+// bytes a Location value can not carry as they are
+static bool location_escaped(unsigned char c) { return c <= ' ' || c >= 0x7f || strchr("\"<>\\^`{|}", c); }
+
+static size_t escaped_len(const char* s)
+{
+    size_t len = 0;
+    for (; *s; s++) {
+        len += location_escaped(*s) ? 3 : 1;
+    }
+    return len;
+}
+
+static char* put_escaped(char* out, const char* s)
+{
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (location_escaped(c)) {
+            *out++ = '%';
+            *out++ = "0123456789ABCDEF"[c >> 4];
+            *out++ = "0123456789ABCDEF"[c & 15];
+        } else {
+            *out++ = c;
+        }
+    }
+    return out;
+}
+
+/* A redirect to the target uri_to_path() left in the uri, with the query
+ * of the request. The target was percent-decoded, whatever can not go into
+ * a header as it is gets encoded again.
+ */
+static void put_location(const HttpRequest* req, int code, const char* query, HttpResponse* ret, char* header_buffer)
+{
+    if (escaped_len(req->line.uri) + 1 + escaped_len(query) >= WS_URI_BUFFER_SIZE) {
+        fill_response_header(414, req, ret, header_buffer, true);
+        return;
+    }
+    char* head_ptr = fill_response_header(code, req, ret, header_buffer, false);
+    memcpy(head_ptr, "Location: ", 10);
+    head_ptr = put_escaped(head_ptr + 10, req->line.uri);
+    if (query[0]) {
+        *head_ptr++ = '?';
+        head_ptr = put_escaped(head_ptr, query);
+    }
+    memcpy(head_ptr, "\r\nContent-Length: 0\r\n\r\n", 23);
+    ret->header_size = head_ptr + 23 - header_buffer;
+}
+
+// a scrape of metrics_path, the body is sent from a memfd like a file
+static void put_metrics(const HttpRequest* req, HttpResponse* ret, char* header_buffer)
+{
+    int fd = metrics_body();
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fill_response_header(500, req, ret, header_buffer, true);
+        return;
+    }
+    if (req->line.method == REQ_METHOD_GET) {
+        ret->fd = fd;
+        ret->file_size = st.st_size;
+    } else {
+        close(fd);
+    }
+    char* head_ptr = fill_response_header(200, req, ret, header_buffer, false);
+    head_ptr += sprintf(
+        head_ptr,
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %lu\r\nCache-Control: no-store\r\n\r\n",
+        (unsigned long)st.st_size
+    );
+    ret->header_size = head_ptr - header_buffer;
+}
+
+bool HttpResponse_begin(HttpRequest* req, HttpResponse* ret, char* header_buffer)
 {
-    HttpResponse ret = {};
+    memset(ret, 0, sizeof(*ret));
+    ret->fd = -1;
 
-    const char* http_version_str;
     switch (req->line.version) {
     case REQ_VERSION_1_0:
-        http_version_str = HTTP_1_0;
-        break;
     case REQ_VERSION_1_1:
-        http_version_str = HTTP_1_1;
         break;
     case REQ_VERSION_2_0:
     default:
         // Version not supported error
-        fill_response_header(505, HTTP_1_1, req, &ret, header_buffer, true);
-        return ret;
+        fill_response_header(505, req, ret, header_buffer, true);
+        return true;
     }
-
     // some error happend with request parsing
     if (req->line.method >= REQ_ERROR) {
         switch (req->line.method) {
         case REQ_ERROR_URI_SIZE:
-            fill_response_header(414, http_version_str, req, &ret, header_buffer, true);
-            return ret;
+            fill_response_header(414, req, ret, header_buffer, true);
+            return true;
 
         case REQ_ERROR_URI_PARSE:
         case REQ_ERROR_METHOD_PARSE:
         case REQ_ERROR_VERSION_PARSE:
         default:
-            fill_response_header(400, http_version_str, req, &ret, header_buffer, true);
-            return ret;
+            fill_response_header(400, req, ret, header_buffer, true);
+            return true;
         }
     }
 
     // only support GET and HEAD
     if (req->line.method != REQ_METHOD_GET && req->line.method != REQ_METHOD_HEAD) {
-        fill_response_header(405, http_version_str, req, &ret, header_buffer, true);
-        return ret;
+        fill_response_header(405, req, ret, header_buffer, true);
+        return true;
     }
 
+    // the query only matters to a redirect, it is kept apart while the path is decoded
+    char query[WS_URI_BUFFER_SIZE];
+    if (!uri_decode(req->line.uri, query)) {
+        fill_response_header(400, req, ret, header_buffer, true);
+        return true;
+    }
+    // reserved ahead of the routes and the files
+    const char* metrics_path = ws_config->metrics_path;
+    if (metrics_path[0] && strcmp(req->line.uri, metrics_path) == 0) {
+        put_metrics(req, ret, header_buffer);
+        return true;
+    }
     // getting the path for the file requested
     int rv = uri_to_path(req->line.uri);
     if (rv < 0) {
-        fill_response_header(500, http_version_str, req, &ret, header_buffer, true);
-        return ret;
+        fill_response_header(500, req, ret, header_buffer, true);
+        return true;
+    } else if (rv > 0) {
+        put_location(req, rv, query, ret, header_buffer);
+        return true;
     }
+    return false;
+}
 
-    // get file size
-    ret.file_size = get_file_size(req->line.uri);
-    if (ret.file_size < 0) {
-        switch (errno) {
-        case EACCES:
-            fill_response_header(403, http_version_str, req, &ret, header_buffer, true);
+static void file_info_stat(FileInfo* info, const struct stat* st)
+{
+    info->size = st->st_size;
+    info->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    info->ino = st->st_ino;
+    info->dev = st->st_dev;
+}
+
+// the ENC_* of path if it is the sidecar of a file with a known type, else 0
+static uint8_t sidecar_encoding(const char* path, int* content_type)
+{
+    size_t len = strnlen(path, WS_URI_BUFFER_SIZE);
+    for (size_t i = 0; i < ENCODING_COUNT; i++) {
+        if (len > 3 && strcmp(path + len - 3, encodings[i].suffix) == 0) {
+            char original[WS_URI_BUFFER_SIZE];
+            memcpy(original, path, len - 3);
+            original[len - 3] = '\0';
+            *content_type = content_type_id(original);
+            return *content_type < 0 ? 0 : encodings[i].encoding;
+        }
+    }
+    return 0;
+}
+
+/* O_PATH descriptor of the root, -1 while it can not be opened. Its number
+ * never changes once open, a new root is dup3()ed over it so a lookup
+ * running on an fs pool thread meanwhile sees one or the other.
+ */
+static _Atomic int root_fd = -1;
+static pthread_once_t root_once = PTHREAD_ONCE_INIT;
+static uint64_t root_checked = 0;
+
+// openat2() is missing, lookups refuse ".." themselves then, symlinks out of the root are not caught
+static atomic_bool no_openat2 = false;
+
+static int open_root() { return open(ws_startup->root, O_PATH | O_DIRECTORY | O_CLOEXEC); }
+
+static void root_init() { root_fd = open_root(); }
+
+static uint64_t monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool root_dir_check()
+{
+    uint64_t now = monotonic_ms();
+    if (now - root_checked < WS_ROOT_CHECK_MS) {
+        return false;
+    }
+    root_checked = now;
+    pthread_once(&root_once, root_init);
+    struct stat named, held;
+    int fd = root_fd;
+    if (stat(ws_startup->root, &named) < 0 ||
+        (fd >= 0 && fstat(fd, &held) == 0 && named.st_dev == held.st_dev && named.st_ino == held.st_ino)) {
+        return false;
+    }
+    int next = open_root();
+    if (next < 0) {
+        return false;
+    }
+    if (fd < 0) {
+        root_fd = next;
+    } else {
+        dup3(next, fd, O_CLOEXEC);
+        close(next);
+    }
+    DebugMsg("%i: following the new %s\n", getpid(), ws_startup->root);
+    return true;
+}
+
+static bool has_dot_dot(const char* rel)
+{
+    for (const char* p = rel; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == rel || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* open() of path, beneath the root when it is under it, see file_open().
+ * Sets untracked when the watcher may not see the file change: it is
+ * outside the root, was reached through a symlink, or can not be told.
+ */
+static int open_path(const char* path, int flags, bool* untracked)
+{
+    const char* root = ws_startup->root;
+    size_t root_len = strlen(root);
+    if (strncmp(path, root, root_len) != 0 || path[root_len] != '/') {
+        *untracked = true;
+        return open(path, flags);
+    }
+    pthread_once(&root_once, root_init);
+    int dir = root_fd;
+    if (dir < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    const char* rel = path + root_len;
+    while (*rel == '/') {
+        rel++;
+    }
+    if (*rel == '\0') {
+        rel = ".";
+    }
+    if (!no_openat2) {
+        // without symlinks first, the watcher only names the path a change happened under
+        struct open_how how = {.flags = flags, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | RESOLVE_NO_SYMLINKS};
+        int fd = syscall(SYS_openat2, dir, rel, &how, sizeof(how));
+        if (fd < 0 && errno == ELOOP) {
+            *untracked = true;
+            how.resolve &= ~RESOLVE_NO_SYMLINKS;
+            fd = syscall(SYS_openat2, dir, rel, &how, sizeof(how));
+        }
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        no_openat2 = true;
+    }
+    *untracked = true;
+    if (has_dot_dot(rel)) {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(dir, rel, flags);
+}
+
+// stat() of path, resolved like open_path()
+static int stat_path(const char* path, struct stat* st, bool* untracked)
+{
+    int fd = open_path(path, O_PATH | O_CLOEXEC, untracked);
+    if (fd < 0) {
+        return -1;
+    }
+    int rv = fstat(fd, st);
+    close(fd);
+    return rv;
+}
+
+// which sidecars of path exist and were written after it
+static uint8_t find_sidecars(const char* path, FileInfo* info)
+{
+    uint8_t found = 0;
+    size_t len = strnlen(path, WS_URI_BUFFER_SIZE);
+    char sidecar[WS_URI_BUFFER_SIZE + 4];
+    memcpy(sidecar, path, len);
+    for (size_t i = 0; i < ENCODING_COUNT; i++) {
+        memcpy(sidecar + len, encodings[i].suffix, 4);
+        struct stat st;
+        if (stat_path(sidecar, &st, &info->untracked) == 0 && S_ISREG(st.st_mode) &&
+            (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec >= info->mtime_ns) {
+            found |= encodings[i].encoding;
+        }
+    }
+    return found;
+}
+
+FileInfo file_open(const char* path, bool want_fd)
+{
+    FileInfo info = {.fd = -1, .content_type = content_type_id(path)};
+    struct stat st;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    info.looked_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    info.encoding = sidecar_encoding(path, &info.content_type);
+    if (!want_fd) {
+        if (stat_path(path, &st, &info.untracked) < 0) {
+            info.err = errno;
+            return info;
+        }
+        file_info_stat(&info, &st);
+        if (info.encoding == 0 && info.content_type >= 0) {
+            info.encodings = find_sidecars(path, &info);
+        }
+        return info;
+    }
+
+    // open first so the size is that of the file actually sent
+    info.fd = open_path(path, O_RDONLY | O_CLOEXEC, &info.untracked);
+    if (info.fd < 0) {
+        info.err = errno;
+        return info;
+    }
+    if (fstat(info.fd, &st) < 0) {
+        info.err = errno;
+        close(info.fd);
+        info.fd = -1;
+        return info;
+    }
+    file_info_stat(&info, &st);
+    if (info.encoding == 0 && info.content_type >= 0) {
+        info.encodings = find_sidecars(path, &info);
+    }
+    return info;
+}
+
+uint8_t accepted_encodings(const HttpRequest* req)
+{
+    StringView value = HttpHeaders_get(&req->headers, HDR_ACCEPT_ENCODING);
+    const char* p = value.ptr;
+    const char* end = value.ptr + value.size;
+    uint8_t accepted = 0;
+    uint8_t listed = 0;
+    bool star = false;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char* token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        size_t token_len = p - token;
+
+        // only a q of zero matters, it refuses the coding
+        bool refused = false;
+        while (p < end && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (p < end && (*p == ' ' || *p == '\t')) {
+                    p++;
+                }
+                if (end - p >= 3 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=' && p[2] == '0') {
+                    refused = true;
+                    for (const char* q = p + 3; q < end && *q != ',' && *q != ';'; q++) {
+                        if (*q >= '1' && *q <= '9') {
+                            refused = false;
+                        }
+                    }
+                }
+                continue;
+            }
+            p++;
+        }
+
+        uint8_t coding = 0;
+        if (token_len == 2 && strncasecmp(token, "br", 2) == 0) {
+            coding = ENC_BR;
+        } else if ((token_len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+                   (token_len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            coding = ENC_GZIP;
+        } else if (token_len == 1 && token[0] == '*') {
+            star = !refused;
+            continue;
+        }
+        listed |= coding;
+        if (!refused) {
+            accepted |= coding;
+        }
+    }
+    if (star) {
+        // anything not named
+        accepted |= (ENC_GZIP | ENC_BR) & ~listed;
+    }
+    return accepted;
+}
+
+uint8_t sidecar_path(char* path, uint8_t available)
+{
+    size_t len = strnlen(path, WS_URI_BUFFER_SIZE);
+    for (size_t i = 0; i < ENCODING_COUNT; i++) {
+        if ((available & encodings[i].encoding) && len + 4 <= WS_URI_BUFFER_SIZE) {
+            memcpy(path + len, encodings[i].suffix, 4);
+            return encodings[i].encoding;
+        }
+    }
+    return 0;
+}
+
+static char* put_hex(char* head_ptr, uint64_t n)
+{
+    char digits[16];
+    int i = 0;
+    do {
+        digits[i++] = "0123456789abcdef"[n & 15];
+        n >>= 4;
+    } while (n);
+    while (i) {
+        *head_ptr++ = digits[--i];
+    }
+    return head_ptr;
+}
+
+static char* put_decimal(char* head_ptr, uint64_t n)
+{
+    char digits[20];
+    int i = 0;
+    do {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (i) {
+        *head_ptr++ = digits[--i];
+    }
+    return head_ptr;
+}
+
+// strong, any change to the inode, size or mtime gives a new one
+static size_t etag(const FileInfo* file, char* buffer)
+{
+    char* head_ptr = buffer;
+    *head_ptr++ = '"';
+    head_ptr = put_hex(head_ptr, file->ino);
+    *head_ptr++ = '-';
+    head_ptr = put_hex(head_ptr, file->size);
+    *head_ptr++ = '-';
+    head_ptr = put_hex(head_ptr, file->mtime_ns);
+    *head_ptr++ = '"';
+    return head_ptr - buffer;
+}
+
+/* ETag and Last-Modified lines, then Content-Encoding for a sidecar and
+ * Vary for anything that has more than one encoding.
+ */
+static size_t validator_header(const FileInfo* file, char* buffer)
+{
+    char* head_ptr = buffer;
+    memcpy(head_ptr, "ETag: ", 6);
+    head_ptr += 6;
+    head_ptr += etag(file, head_ptr);
+
+    time_t mtime = file->mtime_ns / 1000000000;
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    head_ptr += strftime(head_ptr, 64, "\r\nLast-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+
+    for (size_t i = 0; i < ENCODING_COUNT; i++) {
+        if (file->encoding == encodings[i].encoding) {
+            size_t len = strlen(encodings[i].header);
+            memcpy(head_ptr, encodings[i].header, len);
+            head_ptr += len;
+        }
+    }
+    if (file->encoding || file->encodings) {
+        memcpy(head_ptr, "Vary: Accept-Encoding\r\n", 23);
+        head_ptr += 23;
+    }
+    return head_ptr - buffer;
+}
+
+size_t entity_header(const FileInfo* file, char* buffer)
+{
+    char* head_ptr = buffer;
+    size_t prefix_size;
+    const char* prefix = entity_prefix(file->content_type, &prefix_size);
+    memcpy(head_ptr, prefix, prefix_size);
+    head_ptr += prefix_size;
+    head_ptr = put_decimal(head_ptr, file->size);
+    memcpy(head_ptr, "\r\n", 2);
+    head_ptr += 2;
+    head_ptr += validator_header(file, head_ptr);
+    memcpy(head_ptr, "\r\n", 2);
+    return head_ptr + 2 - buffer;
+}
+
+// true if tag is in the If-None-Match list, compared weakly as GET and HEAD must
+static bool etag_listed(StringView list, const char* tag, size_t tag_len)
+{
+    const char* p = list.ptr;
+    const char* end = list.ptr + list.size;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
             break;
-        default:
-            fill_response_header(404, http_version_str, req, &ret, header_buffer, true);
+        } else if (*p == '*') {
+            return true;
         }
-        return ret;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        const char* start = p;
+        if (*p == '"') {
+            p++;
+            while (p < end && *p != '"') {
+                p++;
+            }
+            p += p < end;
+        } else {
+            while (p < end && *p != ',') {
+                p++;
+            }
+        }
+        if ((size_t)(p - start) == tag_len && memcmp(start, tag, tag_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool not_modified(const HttpRequest* req, const FileInfo* file)
+{
+    StringView none_match = HttpHeaders_get(&req->headers, HDR_IF_NONE_MATCH);
+    if (none_match.size > 0) {
+        // If-Modified-Since is ignored when there is an If-None-Match
+        char tag[64];
+        return etag_listed(none_match, tag, etag(file, tag));
     }
 
-    // open file
-    if (req->line.method == REQ_METHOD_GET) {
-        ret.fd = open(req->line.uri, O_RDONLY);
-        if (ret.fd < 0) {
-            switch (errno) {
-            case EACCES:
-                fill_response_header(403, http_version_str, req, &ret, header_buffer, true);
-                break;
-            default:
-                fill_response_header(404, http_version_str, req, &ret, header_buffer, true);
+    StringView since = HttpHeaders_get(&req->headers, HDR_IF_MODIFIED_SINCE);
+    char date[64];
+    if (since.size == 0 || since.size >= sizeof(date)) {
+        return false;
+    }
+    memcpy(date, since.ptr, since.size);
+    date[since.size] = '\0';
+    struct tm tm = {};
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        // not an IMF-fixdate, no condition
+        return false;
+    }
+    return file->mtime_ns / 1000000000 <= timegm(&tm);
+}
+
+/* Where the validators start in a cached entity header, past its own
+ * Content-Type and Content-Length lines: an archive member's was built with
+ * the MIME table of wspack, not this one. NULL when it has no such lines.
+ */
+static const char* validators_of(StringView entity)
+{
+    const char* end = entity.ptr + entity.size;
+    const char* line = memchr(entity.ptr, '\n', entity.size);
+    line = line ? memchr(line + 1, '\n', end - line - 1) : NULL;
+    return line ? line + 1 : NULL;
+}
+
+// the validators and blank line that end every header with a body
+static char* put_validators(char* head_ptr, const FileInfo* file, StringView entity)
+{
+    const char* validators = entity.ptr ? validators_of(entity) : NULL;
+    if (validators) {
+        // the tail of the cached entity header
+        size_t size = entity.ptr + entity.size - validators;
+        memcpy(head_ptr, validators, size);
+        return head_ptr + size;
+    }
+    head_ptr += validator_header(file, head_ptr);
+    memcpy(head_ptr, "\r\n", 2);
+    return head_ptr + 2;
+}
+
+// "<first>-<last>/<size>"
+static char* put_content_range(char* head_ptr, const ByteRange* range, size_t size)
+{
+    head_ptr = put_decimal(head_ptr, range->start);
+    *head_ptr++ = '-';
+    head_ptr = put_decimal(head_ptr, range->start + range->size - 1);
+    *head_ptr++ = '/';
+    return put_decimal(head_ptr, size);
+}
+
+// a decimal of at most 18 digits, false if there is none
+static bool parse_position(const char** p, const char* end, uint64_t* n)
+{
+    const char* start = *p;
+    *n = 0;
+    while (*p < end && **p >= '0' && **p <= '9' && *p - start < 18) {
+        *n = *n * 10 + (**p - '0');
+        (*p)++;
+    }
+    return *p > start && (*p == end || **p < '0' || **p > '9');
+}
+
+/* Range is honoured when there is no If-Range, or it names the current
+ * version of file: the exact strong ETag or the exact Last-Modified date.
+ */
+static bool if_range_holds(const HttpRequest* req, const FileInfo* file)
+{
+    StringView if_range = HttpHeaders_get(&req->headers, HDR_IF_RANGE);
+    if (if_range.size == 0) {
+        return true;
+    }
+    if (if_range.ptr[0] == '"') {
+        char tag[64];
+        size_t tag_len = etag(file, tag);
+        return if_range.size == tag_len && memcmp(if_range.ptr, tag, tag_len) == 0;
+    }
+    char date[64];
+    if (if_range.size >= sizeof(date)) {
+        return false;
+    }
+    memcpy(date, if_range.ptr, if_range.size);
+    date[if_range.size] = '\0';
+    struct tm tm = {};
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return end != NULL && *end == '\0' && file->mtime_ns / 1000000000 == timegm(&tm);
+}
+
+int parse_ranges(const HttpRequest* req, const FileInfo* file, ByteRange ranges[WS_RANGE_MAX])
+{
+    StringView range = HttpHeaders_get(&req->headers, HDR_RANGE);
+    if (req->line.method != REQ_METHOD_GET || range.size < 6 || strncasecmp(range.ptr, "bytes=", 6) != 0 ||
+        !if_range_holds(req, file)) {
+        return 0;
+    }
+    const char* p = range.ptr + 6;
+    const char* end = range.ptr + range.size;
+    int count = 0;
+    bool listed = false;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        uint64_t first = 0;
+        uint64_t last = UINT64_MAX;
+        if (*p == '-') {
+            // suffix, the last n bytes
+            p++;
+            uint64_t n;
+            if (!parse_position(&p, end, &n)) {
+                return 0;
+            }
+            first = n < file->size ? file->size - n : 0;
+            if (n == 0) {
+                first = file->size;
             }
-            return ret;
+        } else {
+            if (!parse_position(&p, end, &first) || p == end || *p++ != '-') {
+                return 0;
+            }
+            if (p < end && *p >= '0' && *p <= '9') {
+                if (!parse_position(&p, end, &last) || last < first) {
+                    return 0;
+                }
+            }
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end && *p != ',') {
+            return 0;
+        }
+        listed = true;
+        if (first >= file->size) {
+            // unsatisfiable, the others may still be fine
+            continue;
+        } else if (count == WS_RANGE_MAX) {
+            // too many parts to be worth it, send the whole file
+            return 0;
         }
+        if (last >= file->size) {
+            last = file->size - 1;
+        }
+        ranges[count].start = first;
+        ranges[count].size = last - first + 1;
+        count++;
+    }
+    if (!listed) {
+        return 0;
     }
+    return count ? count : -1;
+}
+
+// "multipart/byteranges" answers separate their parts with this
+#define WS_BOUNDARY "nbh-byteranges-5c1e7a93f2d4"
 
-    // getting the content type of file path
-    const char* content_type = get_content_type(req->line.uri);
-    if (strlen(content_type) == 0) {
-        fill_response_header(400, http_version_str, req, &ret, header_buffer, true);
+size_t multipart_header(const HttpResponse* ret, const FileInfo* file, int part, char* buffer)
+{
+    char* head_ptr = buffer;
+    if (part == ret->range_count) {
+        memcpy(head_ptr, "\r\n--" WS_BOUNDARY "--\r\n", sizeof("\r\n--" WS_BOUNDARY "--\r\n") - 1);
+        return sizeof("\r\n--" WS_BOUNDARY "--\r\n") - 1;
     }
+    memcpy(head_ptr, "\r\n--" WS_BOUNDARY "\r\nContent-Type: ", sizeof("\r\n--" WS_BOUNDARY "\r\nContent-Type: ") - 1);
+    head_ptr += sizeof("\r\n--" WS_BOUNDARY "\r\nContent-Type: ") - 1;
+    const char* type = content_type_name(file->content_type);
+    size_t type_len = strlen(type);
+    memcpy(head_ptr, type, type_len);
+    head_ptr += type_len;
+    memcpy(head_ptr, "\r\nContent-Range: bytes ", 23);
+    head_ptr = put_content_range(head_ptr + 23, &ret->ranges[part], file->size);
+    memcpy(head_ptr, "\r\n\r\n", 4);
+    return head_ptr + 4 - buffer;
+}
 
-    // success
-    char* head_ptr = fill_response_header(200, http_version_str, req, &ret, header_buffer, false);
+// 206 for one range, the body is that slice of the file
+static void fill_single_range(const HttpRequest* req, const FileInfo* file, StringView entity, HttpResponse* ret, char* header_buffer)
+{
+    const ByteRange* range = &ret->ranges[0];
+    ret->file_offset = file->offset + range->start;
+    ret->file_size = range->size;
+    char* head_ptr = fill_response_header(206, req, ret, header_buffer, false);
+    size_t prefix_size;
+    const char* prefix = entity_prefix(file->content_type, &prefix_size);
+    memcpy(head_ptr, prefix, prefix_size);
+    head_ptr += prefix_size;
+    head_ptr = put_decimal(head_ptr, range->size);
+    memcpy(head_ptr, "\r\nContent-Range: bytes ", 23);
+    head_ptr = put_content_range(head_ptr + 23, range, file->size);
+    memcpy(head_ptr, "\r\n", 2);
+    head_ptr = put_validators(head_ptr + 2, file, entity);
+    ret->header_size = head_ptr - header_buffer;
+}
+
+// 206 multipart/byteranges, the caller sends the parts with multipart_header
+static void fill_multi_range(const HttpRequest* req, const FileInfo* file, StringView entity, HttpResponse* ret, char* header_buffer)
+{
+    size_t length = 0;
+    char part[WS_PART_HEADER_MAX];
+    for (int i = 0; i <= ret->range_count; i++) {
+        length += multipart_header(ret, file, i, part);
+        if (i < ret->range_count) {
+            length += ret->ranges[i].size;
+        }
+    }
+    ret->file_size = length;
+    char* head_ptr = fill_response_header(206, req, ret, header_buffer, false);
+    const char* type = "Content-Type: multipart/byteranges; boundary=" WS_BOUNDARY "\r\nContent-Length: ";
+    memcpy(head_ptr, type, strlen(type));
+    head_ptr = put_decimal(head_ptr + strlen(type), length);
+    memcpy(head_ptr, "\r\n", 2);
+    head_ptr = put_validators(head_ptr + 2, file, entity);
+    ret->header_size = head_ptr - header_buffer;
+}
 
-    // content type
-    head_ptr = response_push(head_ptr, "Content-Type: ");
-    head_ptr = response_push(head_ptr, content_type);
-    head_ptr = response_push_crlf(head_ptr);
+// 416, with the size the client should have asked within
+static void fill_unsatisfiable(const HttpRequest* req, const FileInfo* file, HttpResponse* ret, char* header_buffer)
+{
+    const ResponseTemplate* t = response_template(416, req);
+    char* head_ptr = fill_response_header(416, req, ret, header_buffer, false);
+    memcpy(head_ptr, "Content-Range: bytes */", 23);
+    head_ptr = put_decimal(head_ptr + 23, file->size);
+    memcpy(head_ptr, "\r\n", 2);
+    head_ptr += 2;
+    memcpy(head_ptr, t->data + t->status_size, t->size - t->status_size);
+    ret->header_size = head_ptr + t->size - t->status_size - header_buffer;
+}
 
-    // content length
-    head_ptr = response_push(head_ptr, "Content-Length: ");
+void HttpResponse_finish(HttpRequest* req, const FileInfo* file, StringView entity, HttpResponse* ret, char* header_buffer)
+{
+    if (file->err != 0) {
+        switch (file->err) {
+        case EACCES:
+            fill_response_header(403, req, ret, header_buffer, true);
+            break;
+        default:
+            fill_response_header(404, req, ret, header_buffer, true);
+        }
+        return;
+    }
+    if (file->content_type < 0) {
+        fill_response_header(400, req, ret, header_buffer, true);
+        return;
+    }
+    if (not_modified(req, file)) {
+        char* head_ptr = fill_response_header(304, req, ret, header_buffer, false);
+        ret->header_size = put_validators(head_ptr, file, entity) - header_buffer;
+        return;
+    }
+    ret->range_count = parse_ranges(req, file, ret->ranges);
+    if (ret->range_count < 0) {
+        ret->range_count = 0;
+        fill_unsatisfiable(req, file, ret, header_buffer);
+        return;
+    }
+    ret->fd = file->fd;
+    ret->file_offset = file->offset;
+    if (ret->range_count == 1) {
+        fill_single_range(req, file, entity, ret, header_buffer);
+        return;
+    } else if (ret->range_count > 1) {
+        fill_multi_range(req, file, entity, ret, header_buffer);
+        return;
+    }
+    ret->file_size = file->size;
 
-    // content length as a char*
-    static char buffer[128];
-    int snprintf_bytes = snprintf(buffer, 128, "%zu", ret.file_size);
+    // success
+    char* head_ptr = fill_response_header(200, req, ret, header_buffer, false);
+    if (entity.ptr) {
+        memcpy(head_ptr, entity.ptr, entity.size);
+        head_ptr += entity.size;
+    } else {
+        head_ptr += entity_header(file, head_ptr);
+    }
+    ret->header_size = head_ptr - header_buffer;
+}
 
-    head_ptr = response_pushn(head_ptr, buffer, snprintf_bytes);
-    head_ptr = response_push_crlf(head_ptr);
-    head_ptr = response_push_crlf(head_ptr);
+void HttpResponse_status(HttpRequest* req, uint32_t code, HttpResponse* ret, char* header_buffer)
+{
+    char* head_ptr = fill_response_header(code, req, ret, header_buffer, false);
+    ret->header_size = head_ptr - header_buffer;
+}
 
-    ret.header_size = head_ptr - header_buffer;
+HttpResponse HttpResponse_create(HttpRequest* req, char* header_buffer, size_t header_buffer_size)
+{
+    HttpResponse ret;
+    if (HttpResponse_begin(req, &ret, header_buffer)) {
+        return ret;
+    }
+    FileInfo file = file_open(req->line.uri, req->line.method == REQ_METHOD_GET);
+    HttpResponse_finish(req, &file, (StringView){}, &ret, header_buffer);
     return ret;
 }
 
-int bind_socket(const char* addr, const char* port, Address* address)
+int bind_socket(const char* addr, const char* port, bool reuseport, Address* address)
 {
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -536,6 +1455,12 @@ int bind_socket(const char* addr, const char* port, Address* address)
             close(fd);
             continue;
         }
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+            int en = errno;
+            DebugErr("setsockopt() %s\n", strerror(en));
+            close(fd);
+            continue;
+        }
         if ((bind(fd, ptr->ai_addr, ptr->ai_addrlen)) < 0) {
             int en = errno;
             DebugErr("bind() error: %s\n", strerror(en));
@@ -1,9 +1,13 @@
 #ifndef NBH_COMMON_HEADER
 #define NBH_COMMON_HEADER
 
+#include "config.h"
+
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 
 #ifndef DebugPrint
 #define DebugPrint 1
@@ -16,17 +20,14 @@
         fprintf(stdout, __VA_ARGS__);                                                                                  \
     }
 
+// default recv_buffer and the head limit of a parser fed without one
 #define WS_BUFFER_SIZE 2048
 
+// a request path with the root in front of it
 #define WS_URI_BUFFER_SIZE 1024
 
-#define ROOT_DIR "www"
-
-// URI_BUFFER_SIZE - strlen(ROOT_DIR)
-#define WS_PATH_BUFFER_SIZE 1021
-
-// 10 seconds
-#define WS_CHILD_TIMEOUT 10000
+// longest request path, leaves room for any root
+#define WS_PATH_BUFFER_SIZE (WS_URI_BUFFER_SIZE - WS_ROOT_MAX)
 
 // Request Methods
 #define REQ_METHOD_GET 1
@@ -63,8 +64,32 @@ typedef struct {
 #define REQ_CONNECTION_KEEP_ALIVE 1
 #define REQ_CONNECTION_CLOSE 2
 
+// Recognised headers, the index of their value in HttpHeaders.values
+#define HDR_HOST 0
+#define HDR_CONNECTION 1
+#define HDR_IF_NONE_MATCH 2
+#define HDR_IF_MODIFIED_SINCE 3
+#define HDR_RANGE 4
+#define HDR_ACCEPT_ENCODING 5
+#define HDR_CONTENT_LENGTH 6
+#define HDR_IF_RANGE 7
+#define HDR_UPGRADE 8
+#define HDR_HTTP2_SETTINGS 9
+#define HDR_COUNT 10
+
+// room for the values of all recognised headers of one request
+#define WS_HEADER_VALUES_SIZE 1024
+
+typedef struct {
+    uint16_t offset; // into HttpHeaders.buffer
+    uint16_t size;   // 0 when the header was not sent
+} HeaderValue;
+
 typedef struct {
     int connection;
+    HeaderValue values[HDR_COUNT];
+    uint16_t used;
+    char buffer[WS_HEADER_VALUES_SIZE];
 } HttpHeaders;
 
 typedef struct {
@@ -72,11 +97,28 @@ typedef struct {
     HttpHeaders headers;
 } HttpRequest;
 
+// most ranges a multipart/byteranges answer covers, asking for more gets the whole file
+#define WS_RANGE_MAX 8
+
+// longest multipart_header() can write, boundary and Content-Range lines around the longest MIME type
+#define WS_PART_HEADER_MAX (136 + WS_MIME_TYPE_MAX)
+
+typedef struct {
+    off_t start;
+    size_t size;
+} ByteRange;
+
 typedef struct {
     uint32_t code;
     ptrdiff_t header_size;
+    // body sent from fd, for several ranges the length of the whole multipart body
+    // and file_offset where the ranges count from
+    off_t file_offset;
     size_t file_size;
     int fd;
+    // of a 206, more than one is a multipart/byteranges body
+    int range_count;
+    ByteRange ranges[WS_RANGE_MAX];
 } HttpResponse;
 
 typedef struct {
@@ -89,8 +131,6 @@ typedef struct {
     size_t size;
 } StringView;
 
-void compute_hashes();
-
 StringView parse_word(const char* src, size_t max);
 
 size_t http_nlen(const char* src, size_t max);
@@ -103,30 +143,206 @@ size_t http_nlen(const char* src, size_t max);
  */
 HttpRequestLine HttpRequestLine_create(const char from[WS_BUFFER_SIZE]);
 
+// parses a request line of len bytes without its line ending
+HttpRequestLine HttpRequestLine_parse(const char* line, size_t len);
+
 HttpRequest HttpRequest_create(const char from[WS_BUFFER_SIZE]);
 
+// HttpParser states
+#define PARSE_INCOMPLETE 0
+#define PARSE_DONE 1
+// WS_BUFFER_SIZE bytes without the end of the head, request has the error
+#define PARSE_ERROR 2
+
+/* Resumable request head parser.
+ *
+ * Every call to HttpParser_feed passes the same buffer with more bytes
+ * appended and only the new bytes are scanned. Each line is parsed into
+ * request once, as soon as its line ending arrives.
+ */
+typedef struct {
+    int state;
+    // bytes of the buffer already looked at
+    size_t scanned;
+    // start of the line whose end has not been found yet
+    size_t line_start;
+    // request line is done, lines are headers now
+    bool in_headers;
+    // length of the head including the blank line, valid once not incomplete
+    size_t head_len;
+    // a head this long without its end is an error, WS_BUFFER_SIZE unless the caller's buffer differs
+    size_t limit;
+    HttpRequest request;
+} HttpParser;
+
+void HttpParser_init(HttpParser* p);
+
+// returns the new parser state
+int HttpParser_feed(HttpParser* p, const char* buffer, size_t len);
+
 /* Translates the extention type to mime type.
  *
  * If error will return empty ""
  */
 const char* get_content_type(const char* path);
 
-/* TODO: this should be in a configuration specifies by the server user.
- *
- * Hardcodes uri translations like / -> /index.html
- * Also adds www to the front of uri
+// index of the content type of path for content_type_name, -1 if unknown
+int content_type_id(const char* path);
+
+const char* content_type_name(int id);
+
+// ids run from 0 to content_type_count() - 1
+int content_type_count();
+
+// most statuses a response can have
+#define WS_STATUS_MAX 16
+
+// index of code among the statuses responses are built with, one that is not among them gets the last
+int status_id(uint32_t code);
+
+uint32_t status_code(int id);
+
+// ids run from 0 to status_count() - 1
+int status_count();
+
+/* Percent-decodes the path of uri in place and moves its query, without
+ * the '?', to query. False when an escape is malformed or decodes to NUL,
+ * or the path does not start with '/'.
+ */
+bool uri_decode(char uri[WS_URI_BUFFER_SIZE], char query[WS_URI_BUFFER_SIZE]);
+
+/* Applies the rewrite and redirect rules of router_active() to uri in
+ * place, e.g. / -> www/index.html with the default root.
  *
- * modifies uri in place.
+ * Returns 0 when uri is the path to serve, a 3xx status when it is the
+ * Location to redirect to, -1 when the result does not fit.
  */
 int uri_to_path(char uri[WS_URI_BUFFER_SIZE]);
 
+// content codings of precompressed sidecars, path.gz and path.br
+#define ENC_GZIP 1
+#define ENC_BR 2
+
+typedef struct {
+    int err; // errno of the failed stat() or open(), 0 on success
+    int fd;  // -1 unless opened
+    off_t offset; // where the body starts in fd, 0 unless it is an archive member
+    size_t size;
+    int64_t mtime_ns;
+    uint64_t ino;
+    uint64_t dev;
+    // content_type_id() of the path, for a sidecar that of the original
+    int content_type;
+    // ENC_* of the body when the path is a sidecar, otherwise 0
+    uint8_t encoding;
+    // ENC_* sidecars next to the path that are not older than it
+    uint8_t encodings;
+    // CLOCK_MONOTONIC ms when file_open() started looking, see MetaCache_invalidate
+    uint64_t looked_ms;
+    // reached through a symlink or outside the root, the watcher may miss its changes
+    bool untracked;
+} FileInfo;
+
 HttpResponse HttpResponse_create(HttpRequest* req, char* header_buffer, size_t header_buffer_size);
 
+/* HttpResponse_create split at the blocking filesystem calls so an event
+ * loop can run file_open() somewhere else.
+ *
+ * HttpResponse_begin returns true when the response is already complete
+ * (an error, a redirect, or the metrics with their body in ret->fd), otherwise req->line.uri now holds the path
+ * to hand to file_open() and its result goes to HttpResponse_finish.
+ */
+bool HttpResponse_begin(HttpRequest* req, HttpResponse* ret, char* header_buffer);
+
+/* stat() and optionally open() path, blocking.
+ *
+ * A path under the root, as uri_to_path() makes them, is resolved beneath
+ * a descriptor held on the root with openat2(RESOLVE_BENEATH), so neither
+ * ".." nor a symlink leads out of it; other paths are opened as they are.
+ * Either way untracked says whether a watch on the root sees it change.
+ *
+ * Also stats the sidecars of path to fill in encodings. A path that names
+ * a sidecar itself is the encoded form of the original.
+ */
+FileInfo file_open(const char* path, bool want_fd);
+
+// the root is looked for again at most this often
+#define WS_ROOT_CHECK_MS 1000
+
+/* Called from the loop, true once the root file_open() resolves beneath
+ * was replaced by another directory and is now followed. Rate limited.
+ */
+bool root_dir_check();
+
+// ENC_* codings the client takes per Accept-Encoding
+uint8_t accepted_encodings(const HttpRequest* req);
+
+/* Appends the suffix of the best sidecar in encodings to path, which has
+ * room for WS_URI_BUFFER_SIZE bytes. Returns its ENC_* or 0 when none fits.
+ */
+uint8_t sidecar_path(char* path, uint8_t encodings);
+
+/* entity is the entity_header() of file when the caller has it cached,
+ * {NULL, 0} to have it built here.
+ */
+void HttpResponse_finish(HttpRequest* req, const FileInfo* file, StringView entity, HttpResponse* ret, char* header_buffer);
+
+// longest entity_header() can write, every line but Content-Type fits in 208 bytes
+#define WS_ENTITY_HEADER_MAX (208 + WS_MIME_TYPE_MAX)
+
+/* The part of a 200 header that only depends on the file: Content-Type,
+ * Content-Length, ETag, Last-Modified, Content-Encoding and Vary when there
+ * are sidecars, and the blank line. Returns its length.
+ *
+ * file->content_type must be known.
+ */
+size_t entity_header(const FileInfo* file, char* buffer);
+
+/* True when If-None-Match, or without it If-Modified-Since, says the
+ * client already has this version of file and gets a 304.
+ */
+bool not_modified(const HttpRequest* req, const FileInfo* file);
+
+/* The satisfiable byte ranges of a GET with a Range header that If-Range
+ * does not rule out, in the order asked. 0 when the whole file should be
+ * sent, -1 when none of the ranges is satisfiable.
+ */
+int parse_ranges(const HttpRequest* req, const FileInfo* file, ByteRange ranges[WS_RANGE_MAX]);
+
+/* The delimiter and headers in front of part of a multipart/byteranges
+ * body, part == ret->range_count gives the closing delimiter. Returns its
+ * length.
+ */
+size_t multipart_header(const HttpResponse* ret, const FileInfo* file, int part, char* buffer);
+
+/* Only the status line and Connection header of a response, for when the
+ * entity header is sent from somewhere else.
+ */
+void HttpResponse_status(HttpRequest* req, uint32_t code, HttpResponse* ret, char* header_buffer);
+
 int headers_connection_parse(const char* from, size_t max_len);
 
+/* Returns the HDR_* id of a header name or -1 if it is not one we keep.
+ *
+ * Case-insensitive, backed by the perfect hash phash_gen builds.
+ */
+int header_id(const char* name, size_t len);
+
+/* Keeps the value of a header for a request that does not come through
+ * HttpParser. Returns its HDR_* id, -1 when it is not one we keep.
+ */
+int HttpHeaders_add(HttpHeaders* headers, const char* name, size_t name_len, StringView value);
+
+// value of a recognised header, size 0 when it was not sent
+StringView HttpHeaders_get(const HttpHeaders* headers, int id);
+
 struct sockaddr* Address_sockaddr(Address* a);
 
-// returns socket file descriptor and fills address with bound address.
-int bind_socket(const char* addr, const char* port, Address* address_o);
+/* returns socket file descriptor and fills address with bound address.
+ *
+ * reuseport sets SO_REUSEPORT so every worker can bind its own listener
+ * on the same port and let the kernel spread connections between them.
+ */
+int bind_socket(const char* addr, const char* port, bool reuseport, Address* address_o);
 
 #endif
@@ -0,0 +1,382 @@
+#include "config.h"
+#include "common.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const Config builtin = {
+    .workers = -1,
+    .backlog = 128,
+    .fs_threads = 0,
+    .recv_buffer = WS_BUFFER_SIZE,
+    .send_buffer = 16384,
+    .keepalive_timeout = 10000,
+    .keepalive_requests = 500,
+    .hot_cache_mb = 32,
+    .meta_entries = 4096,
+    .fd_cache_entries = 1024,
+    .meta_ttl = 1000,
+    .root = "www",
+    .metrics_path = "/metrics",
+    .mime_count = 16,
+    .mime = {
+        {"html", "text/html"},
+        {"css", "text/css"},
+        {"js", "application/javascript"},
+        {"jpg", "image/jpg"},
+        {"png", "image/png"},
+        {"gif", "image/gif"},
+        {"txt", "text/plain"},
+        {"htm", "text/html"},
+        {"ico", "image/x-icon"},
+        // not required
+        {"pdf", "application/pdf"},
+        {"json", "application/json"},
+        {"bin", "application/octect-stream"},
+        {"bmp", "image/bmp"},
+        {"csv", "image/csv"},
+        {"webp", "image/webp"},
+        {"jpeg", "image/jpg"},
+    },
+};
+
+const Config* _Atomic ws_config = &builtin;
+const Config* ws_startup = &builtin;
+
+typedef struct {
+    const char* key;
+    size_t offset;
+    int min;
+    int max;
+    bool restart;
+} IntKey;
+
+static const IntKey int_keys[] = {
+    {"workers", offsetof(Config, workers), -1, WS_MAX_WORKERS, false},
+    {"backlog", offsetof(Config, backlog), 1, 65535, false},
+    {"fs_threads", offsetof(Config, fs_threads), 0, 64, true},
+    {"recv_buffer", offsetof(Config, recv_buffer), 512, WS_RECV_BUFFER_MAX, false},
+    {"send_buffer", offsetof(Config, send_buffer), WS_SEND_BUFFER_MIN, 1 << 20, false},
+    {"keepalive_timeout", offsetof(Config, keepalive_timeout), 100, 3600 * 1000, false},
+    {"keepalive_requests", offsetof(Config, keepalive_requests), 1, 1 << 20, false},
+    {"hot_cache_mb", offsetof(Config, hot_cache_mb), 0, 1 << 16, true},
+    {"meta_entries", offsetof(Config, meta_entries), 64, 1 << 22, true},
+    {"fd_cache_entries", offsetof(Config, fd_cache_entries), 16, 1 << 16, true},
+    {"meta_ttl", offsetof(Config, meta_ttl), 0, 3600 * 1000, false},
+};
+
+#define INT_KEY_COUNT (sizeof(int_keys) / sizeof(int_keys[0]))
+
+static int* int_field(Config* config, const IntKey* k) { return (int*)((char*)config + k->offset); }
+
+static int int_value(const Config* config, const IntKey* k) { return *(const int*)((const char*)config + k->offset); }
+
+void Config_defaults(Config* config) { *config = builtin; }
+
+static const char* set_mime(Config* config, const char* value)
+{
+    size_t ext_len = strcspn(value, " \t");
+    const char* type = value + ext_len + strspn(value + ext_len, " \t");
+    size_t type_len = strlen(type);
+    if (ext_len == 0 || type_len == 0) {
+        return "expected mime <extension> <type>";
+    } else if (ext_len >= sizeof(config->mime[0].ext) || memchr(value, '.', ext_len)) {
+        return "bad extension";
+    } else if (type_len >= sizeof(config->mime[0].type) || strcspn(type, " \t") != type_len) {
+        return "bad type";
+    }
+    MimeType* m = NULL;
+    for (int i = 0; i < config->mime_count; i++) {
+        if (strlen(config->mime[i].ext) == ext_len && strncmp(config->mime[i].ext, value, ext_len) == 0) {
+            m = &config->mime[i];
+            break;
+        }
+    }
+    if (m == NULL) {
+        if (config->mime_count == WS_MIME_MAX) {
+            return "too many mime types";
+        }
+        m = &config->mime[config->mime_count++];
+        memcpy(m->ext, value, ext_len);
+        m->ext[ext_len] = '\0';
+    }
+    // zero padded so two tables compare equal byte for byte
+    memset(m->type, 0, sizeof(m->type));
+    memcpy(m->type, type, type_len);
+    return NULL;
+}
+
+// sets key to value, NULL on success or why not
+static const char* set_key(Config* config, const char* key, const char* value)
+{
+    if (strcmp(key, "mime") == 0) {
+        return set_mime(config, value);
+    } else if (strcmp(key, "root") == 0) {
+        size_t len = strlen(value);
+        while (len > 1 && value[len - 1] == '/') {
+            len--;
+        }
+        if (len == 0 || len >= WS_ROOT_MAX) {
+            return "root must be 1 to 63 characters";
+        }
+        memcpy(config->root, value, len);
+        config->root[len] = '\0';
+        return NULL;
+    } else if (strcmp(key, "routes") == 0) {
+        if (strlen(value) >= WS_ROUTES_MAX) {
+            return "routes must be shorter than 256 characters";
+        }
+        strcpy(config->routes, value);
+        return NULL;
+    } else if (strcmp(key, "access_log") == 0) {
+        if (strlen(value) >= WS_ACCESS_LOG_MAX) {
+            return "access_log must be shorter than 256 characters";
+        }
+        strcpy(config->access_log, value);
+        return NULL;
+    } else if (strcmp(key, "metrics_path") == 0) {
+        if (strlen(value) >= WS_METRICS_PATH_MAX || (value[0] && value[0] != '/')) {
+            return "metrics_path must be empty or start with / and be shorter than 64 characters";
+        }
+        strcpy(config->metrics_path, value);
+        return NULL;
+    }
+    for (size_t i = 0; i < INT_KEY_COUNT; i++) {
+        const IntKey* k = &int_keys[i];
+        if (strcmp(key, k->key) != 0) {
+            continue;
+        }
+        if (k->offset == offsetof(Config, workers) && strcmp(value, "auto") == 0) {
+            config->workers = -1;
+            return NULL;
+        }
+        char* end;
+        errno = 0;
+        long n = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0') {
+            return "not a number";
+        } else if (n < k->min || n > k->max) {
+            return "out of range";
+        }
+        *int_field(config, k) = n;
+        return NULL;
+    }
+    return "unknown key";
+}
+
+bool Config_load(Config* config, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        int en = errno;
+        DebugErr("%s: %s\n", path, strerror(en));
+        return false;
+    }
+    bool ok = true;
+    char* line = NULL;
+    size_t cap = 0;
+    for (int number = 1; ok && getline(&line, &cap, file) >= 0; number++) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char* key = line + strspn(line, " \t");
+        size_t key_len = strcspn(key, " \t");
+        if (key_len == 0) {
+            continue;
+        }
+        char* value = key + key_len + strspn(key + key_len, " \t");
+        size_t value_len = strlen(value);
+        while (value_len > 0 && isspace((unsigned char)value[value_len - 1])) {
+            value[--value_len] = '\0';
+        }
+        key[key_len] = '\0';
+        const char* why = set_key(config, key, value);
+        if (why) {
+            DebugErr("%s:%i: %s: %s\n", path, number, key, why);
+            ok = false;
+        }
+    }
+    free(line);
+    fclose(file);
+    return ok;
+}
+
+bool Config_override(Config* config, const char* key_value)
+{
+    const char* eq = strchr(key_value, '=');
+    char key[32];
+    if (eq == NULL || eq == key_value || eq - key_value >= (ptrdiff_t)sizeof(key)) {
+        DebugErr("%s: expected key=value\n", key_value);
+        return false;
+    }
+    memcpy(key, key_value, eq - key_value);
+    key[eq - key_value] = '\0';
+    const char* why = set_key(config, key, eq + 1);
+    if (why) {
+        DebugErr("%s: %s\n", key_value, why);
+    }
+    return why == NULL;
+}
+
+/* The configuration every process follows, in shared memory.
+ *
+ * Only the process that called config_start() writes it, under a seqlock
+ * like the metadata cache sets; the others copy it out when generation
+ * moves past the one they have.
+ */
+typedef struct {
+    atomic_uint seq;
+    _Atomic uint64_t generation;
+    Config config;
+} Published;
+
+static Published* published = NULL;
+static pid_t owner = -1;
+static volatile sig_atomic_t reload_requested = 0;
+static const char* source_path = NULL;
+static const char* const* source_overrides = NULL;
+static int source_count = 0;
+
+static bool build(Config* config)
+{
+    Config_defaults(config);
+    if (source_path && !Config_load(config, source_path)) {
+        return false;
+    }
+    for (int i = 0; i < source_count; i++) {
+        if (!Config_override(config, source_overrides[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void publish(const Config* config)
+{
+    atomic_fetch_add_explicit(&published->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    published->config = *config;
+    atomic_fetch_add_explicit(&published->seq, 1, memory_order_release);
+    atomic_store_explicit(&published->generation, config->generation, memory_order_release);
+}
+
+// the copy ws_config points at, freed once replaced unless it is ws_startup
+static Config* adopted = NULL;
+
+// a private copy of what was published, ws_config then points at it
+static bool adopt()
+{
+    uint64_t generation = atomic_load_explicit(&published->generation, memory_order_acquire);
+    if (generation == ws_config->generation) {
+        return false;
+    }
+    Config* copy = malloc(sizeof(Config));
+    if (copy == NULL) {
+        return false;
+    }
+    while (1) {
+        unsigned seq = atomic_load_explicit(&published->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(copy, &published->config, sizeof(Config));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&published->seq, memory_order_relaxed) == seq) {
+            break;
+        }
+    }
+    atomic_store(&ws_config, copy);
+    // only the loop reads ws_config, and it is the one calling this
+    if (adopted != ws_startup) {
+        free(adopted);
+    }
+    adopted = copy;
+    return true;
+}
+
+bool config_start(const char* path, const char* const* overrides, int override_count)
+{
+    source_path = path;
+    source_overrides = overrides;
+    source_count = override_count;
+    Config config;
+    if (!build(&config)) {
+        return false;
+    }
+    config.generation = 1;
+    published = mmap(NULL, sizeof(Published), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (published == MAP_FAILED) {
+        int en = errno;
+        DebugErr("mmap() %s\n", strerror(en));
+        published = NULL;
+        return false;
+    }
+    owner = getpid();
+    publish(&config);
+    if (!adopt()) {
+        return false;
+    }
+    ws_startup = ws_config;
+    return true;
+}
+
+void config_request_reload() { reload_requested = 1; }
+
+// settings that keep their value until a restart, the server warns when the file changed one
+static void keep_restart_settings(Config* next, const Config* now)
+{
+    for (size_t i = 0; i < INT_KEY_COUNT; i++) {
+        const IntKey* k = &int_keys[i];
+        if (k->restart && int_value(next, k) != int_value(now, k)) {
+            DebugErr("%s only changes on restart\n", k->key);
+            *int_field(next, k) = int_value(now, k);
+        }
+    }
+    if ((next->workers == 0) != (now->workers == 0)) {
+        DebugErr("workers only changes to or from 0 on restart\n");
+        next->workers = now->workers;
+    }
+    if (strcmp(next->root, now->root) != 0) {
+        DebugErr("root only changes on restart\n");
+        memcpy(next->root, now->root, sizeof(next->root));
+    }
+    if (strcmp(next->routes, now->routes) != 0) {
+        DebugErr("routes only changes on restart\n");
+        memcpy(next->routes, now->routes, sizeof(next->routes));
+    }
+    if (strcmp(next->access_log, now->access_log) != 0) {
+        DebugErr("access_log only changes on restart\n");
+        memcpy(next->access_log, now->access_log, sizeof(next->access_log));
+    }
+    if (next->mime_count != now->mime_count || memcmp(next->mime, now->mime, sizeof(next->mime)) != 0) {
+        DebugErr("mime only changes on restart\n");
+        next->mime_count = now->mime_count;
+        memcpy(next->mime, now->mime, sizeof(next->mime));
+    }
+}
+
+bool config_refresh()
+{
+    if (published == NULL) {
+        return false;
+    }
+    if (reload_requested && getpid() == owner) {
+        reload_requested = 0;
+        Config next;
+        if (build(&next)) {
+            keep_restart_settings(&next, ws_config);
+            next.generation = ws_config->generation + 1;
+            publish(&next);
+            DebugMsg("%i: configuration reloaded\n", getpid());
+        } else {
+            DebugErr("configuration not reloaded, the old one stays in effect\n");
+        }
+    }
+    return adopt();
+}
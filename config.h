@@ -0,0 +1,123 @@
+#ifndef NBH_CONFIG_HEADER
+#define NBH_CONFIG_HEADER
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// upper bound on workers
+#define WS_MAX_WORKERS 256
+
+// longest root directory including its NUL, request paths get the rest of WS_URI_BUFFER_SIZE
+#define WS_ROOT_MAX 64
+
+// longest routes file path including its NUL
+#define WS_ROUTES_MAX 256
+
+// longest access log path including its NUL
+#define WS_ACCESS_LOG_MAX 256
+
+// longest metrics path including its NUL
+#define WS_METRICS_PATH_MAX 64
+
+// most MIME types, the builtin ones included
+#define WS_MIME_MAX 64
+
+// largest recv_buffer, what an HTTP/2 session can take over after an upgrade
+#define WS_RECV_BUFFER_MAX 16384
+
+// smallest send_buffer, room for the headers of one response split into the most ranges twice over
+#define WS_SEND_BUFFER_MIN 4096
+
+// longest MIME type, its NUL included
+#define WS_MIME_TYPE_MAX 80
+
+typedef struct {
+    char ext[16];
+    char type[WS_MIME_TYPE_MAX];
+} MimeType;
+
+/* Everything tunable without recompiling.
+ *
+ * A process reads the one in effect through ws_config and never writes
+ * it: a reload builds a new one and swaps the pointer. Fields marked
+ * "restart" size or key state that outlives a reload and keep the value
+ * the server started with.
+ */
+typedef struct {
+    // bumped every time a new configuration is published
+    uint64_t generation;
+    // worker processes, -1 for one per online core, 0 serves from the parent (restart when 0)
+    int workers;
+    // listen() backlog of every worker
+    int backlog;
+    // threads per worker running stat()/open() (restart)
+    int fs_threads;
+    // bytes a request head may take, for new connections
+    int recv_buffer;
+    // bytes of queued response headers per connection, for new connections
+    int send_buffer;
+    // ms an idle connection is kept open
+    int keepalive_timeout;
+    // requests answered on one connection before it is closed
+    int keepalive_requests;
+    // MiB of small bodies each worker keeps in memory, 0 for none (restart)
+    int hot_cache_mb;
+    // entries of the metadata cache shared by all workers (restart)
+    int meta_entries;
+    // open descriptors each worker caches (restart)
+    int fd_cache_entries;
+    // ms a cached stat() result is trusted while the watcher does not run
+    int meta_ttl;
+    // directory the request paths are looked up in (restart)
+    char root[WS_ROOT_MAX];
+    // file of rewrite and redirect rules, see router.h, empty for the builtin ones only (restart)
+    char routes[WS_ROUTES_MAX];
+    // path the metrics are served on instead of a file, see metrics.h, empty for none
+    char metrics_path[WS_METRICS_PATH_MAX];
+    // file the logger appends a binary record of every response to, see accesslog.h, empty for none (restart)
+    char access_log[WS_ACCESS_LOG_MAX];
+    // extension to Content-Type, its index is the content type id (restart)
+    int mime_count;
+    MimeType mime[WS_MIME_MAX];
+} Config;
+
+// the configuration in effect, the compiled in defaults until config_start()
+extern const Config* _Atomic ws_config;
+
+/* The configuration config_start() built, never freed. Its restart settings
+ * are the ones in effect, code that may run off the loop, like file_open()
+ * on an fs pool thread, reads them here rather than from ws_config.
+ */
+extern const Config* ws_startup;
+
+void Config_defaults(Config* config);
+
+/* Applies the file at path on top of config.
+ *
+ * One "key value" per line, # starts a comment. The keys are the field
+ * names above, "mime ext type" maps an extension, replacing the builtin
+ * type for it. Returns false after printing file:line and why.
+ */
+bool Config_load(Config* config, const char* path);
+
+// applies one "key=value", as given on the command line; false after printing why
+bool Config_override(Config* config, const char* key_value);
+
+/* Builds the configuration from the defaults, the file at path (may be
+ * NULL) and the overrides, each "key=value", and makes it ws_config for
+ * this process and every process it forks. The overrides and path are kept
+ * for reloads. Returns false after printing why.
+ */
+bool config_start(const char* path, const char* const* overrides, int override_count);
+
+// async signal safe, the file is read again by the next config_refresh() of this process
+void config_request_reload();
+
+/* Called from the loop of every process. The process that called
+ * config_start() first re-reads the file if a reload was asked for and
+ * publishes it when valid, then any process picks up what was published
+ * since its last call. True when ws_config changed.
+ */
+bool config_refresh();
+
+#endif
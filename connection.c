@@ -0,0 +1,577 @@
+#include "connection.h"
+#include "h2.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+_Static_assert(WS_SEND_BUFFER_MIN >= WS_HEADER_MAX, "send_buffer must fit the headers of a response");
+
+Connection* Connection_create(int fd, FileCache* files, HotCache* hot)
+{
+    const Config* config = ws_config;
+    Connection* conn = calloc(1, sizeof(Connection) + config->recv_buffer + config->send_buffer);
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->recv_buff = (char*)(conn + 1);
+    conn->recv_size = config->recv_buffer;
+    conn->send_buff = conn->recv_buff + conn->recv_size;
+    conn->send_size = config->send_buffer;
+    HttpParser_init(&conn->parser);
+    conn->parser.limit = conn->recv_size;
+    conn->fd = fd;
+    conn->files = files;
+    conn->hot = hot;
+    conn->state = CONN_READING;
+    conn->deficit = WS_STREAM_QUANTUM;
+    conn->response.fd = -1;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    if (accesslog_on()) {
+        accesslog_peer(&conn->log, fd);
+    }
+    return conn;
+}
+
+void ConnectionList_push(ConnectionList* list, Connection* conn)
+{
+    conn->last_active = now_ms();
+    conn->prev = list->tail;
+    conn->next = NULL;
+    if (list->tail) {
+        list->tail->next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+    conn->listed = true;
+}
+
+void ConnectionList_unlink(ConnectionList* list, Connection* conn)
+{
+    if (!conn->listed) {
+        return;
+    }
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        list->head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        list->tail = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->listed = false;
+}
+
+void ConnectionList_touch(ConnectionList* list, Connection* conn)
+{
+    ConnectionList_unlink(list, conn);
+    ConnectionList_push(list, conn);
+}
+
+// gives back the fd of a response, to the file cache if it came from there
+static void release_file(Connection* conn, int fd, CachedFile* file)
+{
+    if (file) {
+        FileCache_release(conn->files, file);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static PendingResponse* Connection_at(Connection* conn, unsigned i)
+{
+    return &conn->queue[(conn->queue_head + i) % WS_PIPELINE_DEPTH];
+}
+
+static void release_body(Connection* conn, PendingResponse* pending)
+{
+    if (!pending->shared_fd) {
+        release_file(conn, pending->fd, pending->file);
+    }
+    if (pending->entry) {
+        HotCache_release(conn->hot, pending->entry);
+    }
+}
+
+void Connection_destroy(Connection* conn)
+{
+    release_file(conn, conn->response.fd, conn->file);
+    for (unsigned i = 0; i < conn->queue_len; i++) {
+        release_body(conn, Connection_at(conn, i));
+    }
+    for (unsigned i = 0; i < conn->zc_len; i++) {
+        // the kernel keeps its own page references, unmapping is safe
+        HotCache_release(conn->hot, conn->zc_holds[i].entry);
+    }
+    if (conn->h2) {
+        H2Session_destroy(conn->h2, conn);
+    }
+    if (conn->tls) {
+        Tls_destroy(conn->tls);
+    }
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    free(conn);
+}
+
+static PendingResponse* Connection_front(Connection* conn)
+{
+    return conn->queue_len > 0 ? &conn->queue[conn->queue_head] : NULL;
+}
+
+bool Connection_request_ready(Connection* conn)
+{
+    if (conn->last_queued || conn->queue_len > WS_PIPELINE_DEPTH - WS_RESPONSE_SLOTS ||
+        conn->send_size - conn->send_len < WS_HEADER_MAX) {
+        // wait for the queue to drain before taking on more
+        return false;
+    }
+    return HttpParser_feed(&conn->parser, conn->recv_buff, conn->recv_len) != PARSE_INCOMPLETE;
+}
+
+static void log_response(Connection* conn)
+{
+    const char* connect_str = "none";
+    if (conn->request.headers.connection == REQ_CONNECTION_KEEP_ALIVE) {
+        connect_str = "keep-alive";
+    } else if (conn->request.headers.connection == REQ_CONNECTION_CLOSE) {
+        connect_str = "close";
+    }
+    DebugMsg(
+        "%i: %s%i%s %-48s Connection: %s\n",
+        getpid(),
+        conn->response.code < 400 ? "\e[32m" : "\e[31m",
+        conn->response.code,
+        "\e[0m",
+        conn->request.line.uri,
+        connect_str
+    );
+}
+
+// appends an entry without a body whose header is the next header_size bytes at send_buff + send_len
+static PendingResponse* push_pending(Connection* conn, size_t header_size)
+{
+    PendingResponse* pending = Connection_at(conn, conn->queue_len);
+    conn->queue_len++;
+    pending->code = conn->response.code;
+    pending->header_offset = conn->send_len;
+    pending->header_size = header_size;
+    pending->entry = NULL;
+    pending->mem = NULL;
+    pending->mem_size = 0;
+    pending->mem_sent = 0;
+    pending->fd = -1;
+    pending->file = NULL;
+    pending->shared_fd = false;
+    pending->body_offset = 0;
+    pending->body_remaining = 0;
+    pending->advised = -1;
+    pending->last = false;
+    pending->opens = false;
+    pending->ends = false;
+    pending->started_ns = conn->started_ns;
+    pending->content_type = conn->content_type;
+    conn->send_len += header_size;
+    return pending;
+}
+
+// the last entry of the response is queued, bytes is what all its entries send
+static void response_queued(Connection* conn, PendingResponse* pending, size_t bytes)
+{
+    if (accesslog_on()) {
+        pending->log = conn->log;
+        pending->log.bytes = bytes;
+        pending->log.first_byte_us = 0;
+    }
+    conn->entry = NULL;
+    conn->response.fd = -1;
+    conn->file = NULL;
+    conn->requests++;
+    pending->ends = true;
+    pending->last =
+        conn->request.headers.connection != REQ_CONNECTION_KEEP_ALIVE || conn->requests >= (size_t)ws_config->keepalive_requests;
+    conn->last_queued = pending->last;
+}
+
+// the response in conn->response is complete, its header at send_buff + send_len
+static void queue_response(Connection* conn)
+{
+    log_response(conn);
+
+    PendingResponse* pending = push_pending(conn, conn->response.header_size);
+    pending->opens = true;
+    if (conn->entry) {
+        pending->entry = conn->entry;
+        pending->mem = HotEntry_data(conn->entry);
+        pending->mem_size = HotEntry_size(conn->entry);
+    } else if ((conn->response.code == 200 || conn->response.code == 206) && conn->request.line.method == REQ_METHOD_GET) {
+        pending->fd = conn->response.fd;
+        pending->file = conn->file;
+        pending->body_offset = conn->response.file_offset;
+        pending->body_remaining = conn->response.file_size;
+    }
+    response_queued(conn, pending, pending->header_size + pending->mem_size + pending->body_remaining);
+}
+
+/* A multipart/byteranges response, its header at send_buff + send_len.
+ *
+ * The first part header goes right after it, every part is sent from the
+ * same fd which the entry of the last part releases.
+ */
+static void queue_parts(Connection* conn, const FileInfo* file)
+{
+    log_response(conn);
+
+    HttpResponse* response = &conn->response;
+    PendingResponse* pending = NULL;
+    size_t bytes = 0;
+    for (int i = 0; i <= response->range_count; i++) {
+        size_t header_size = i == 0 ? response->header_size : 0;
+        header_size += multipart_header(response, file, i, conn->send_buff + conn->send_len + header_size);
+        pending = push_pending(conn, header_size);
+        pending->opens = i == 0;
+        if (i < response->range_count) {
+            pending->fd = response->fd;
+            pending->shared_fd = i < response->range_count - 1;
+            pending->file = pending->shared_fd ? NULL : conn->file;
+            pending->body_offset = response->file_offset + response->ranges[i].start;
+            pending->body_remaining = response->ranges[i].size;
+        }
+        bytes += pending->header_size + pending->body_remaining;
+    }
+    response_queued(conn, pending, bytes);
+}
+
+// a GET whose body is in the hot cache is answered without the file
+static bool serve_hot(Connection* conn, const FileInfo* file)
+{
+    if (conn->hot == NULL || conn->request.line.method != REQ_METHOD_GET || file->err != 0 ||
+        file->content_type < 0 || file->size > WS_HOT_MAX_FILE || HttpHeaders_get(&conn->request.headers, HDR_RANGE).size ||
+        not_modified(&conn->request, file)) {
+        return false;
+    }
+    conn->entry = HotCache_get(conn->hot, conn->job.path, file);
+    if (conn->entry == NULL) {
+        conn->entry = HotCache_admit(conn->hot, conn->job.path, file);
+    }
+    if (conn->entry == NULL) {
+        return false;
+    }
+    release_file(conn, file->fd, conn->file);
+    conn->file = NULL;
+    // the entity header is at the start of the entry
+    HttpResponse_status(&conn->request, 200, &conn->response, conn->send_buff + conn->send_len);
+    queue_response(conn);
+    return true;
+}
+
+static void finish_response(Connection* conn, const FileInfo* file)
+{
+    conn->content_type = file->err == 0 ? file->content_type : -1;
+    if (serve_hot(conn, file)) {
+        return;
+    }
+    StringView entity = {};
+    if (conn->file && file->err == 0) {
+        entity = CachedFile_entity(conn->file);
+    }
+    HttpResponse_finish(&conn->request, file, entity, &conn->response, conn->send_buff + conn->send_len);
+    if (conn->response.fd < 0 && file->fd >= 0) {
+        // error response after a successful open
+        release_file(conn, file->fd, conn->file);
+        conn->file = NULL;
+    }
+    if (conn->response.range_count > 1) {
+        queue_parts(conn, file);
+        return;
+    }
+    queue_response(conn);
+}
+
+/* Switches conn->job over to the sidecar of file the client takes, giving
+ * back what came with file. False when the original is sent.
+ */
+static bool use_sidecar(Connection* conn, const FileInfo* file)
+{
+    uint8_t available = file->err == 0 ? conn->accept & file->encodings : 0;
+    // negotiated once per request
+    conn->accept = 0;
+    if (available == 0 || sidecar_path(conn->request.line.uri, available) == 0) {
+        return false;
+    }
+    release_file(conn, file->fd, conn->file);
+    conn->file = NULL;
+    return true;
+}
+
+// queues the response straight from the file cache, true when conn->job has to be run instead
+static bool respond_cached(Connection* conn)
+{
+    FileInfo file;
+    if (conn->files == NULL || !FileCache_get(conn->files, conn->job.path, conn->job.want_fd, &file, &conn->file)) {
+        return true;
+    }
+    if (use_sidecar(conn, &file)) {
+        return respond_cached(conn);
+    }
+    finish_response(conn, &file);
+    return false;
+}
+
+bool Connection_begin_response(Connection* conn)
+{
+    if (conn->h2c && H2Session_start(conn)) {
+        return false;
+    }
+    conn->request = conn->parser.request;
+    conn->started_ns = metrics_clock();
+    conn->content_type = -1;
+    if (accesslog_on()) {
+        accesslog_request(&conn->log, &conn->request);
+    }
+
+    // keep whatever the client sent after this request's head
+    size_t head_len = conn->parser.head_len;
+    memmove(conn->recv_buff, conn->recv_buff + head_len, conn->recv_len - head_len);
+    conn->recv_len -= head_len;
+    HttpParser_init(&conn->parser);
+    conn->parser.limit = conn->recv_size;
+
+    if (HttpResponse_begin(&conn->request, &conn->response, conn->send_buff + conn->send_len)) {
+        queue_response(conn);
+        return false;
+    }
+    conn->job.path = conn->request.line.uri;
+    conn->job.want_fd = conn->request.line.method == REQ_METHOD_GET;
+    conn->job.owner = conn;
+    conn->accept = accepted_encodings(&conn->request);
+    return respond_cached(conn);
+}
+
+bool Connection_complete_response(Connection* conn, const FileInfo* file)
+{
+    if (conn->files) {
+        FileCache_put(conn->files, conn->job.path, file, &conn->file);
+    }
+    if (use_sidecar(conn, file)) {
+        return respond_cached(conn);
+    }
+    finish_response(conn, file);
+    return false;
+}
+
+void Connection_respond(Connection* conn)
+{
+    if (Connection_begin_response(conn)) {
+        FileInfo file;
+        do {
+            file = file_open(conn->job.path, conn->job.want_fd);
+        } while (Connection_complete_response(conn, &file));
+    }
+}
+
+int Connection_gather(Connection* conn, struct iovec* iov, int max, PendingResponse** body)
+{
+    *body = NULL;
+    int n = 0;
+    size_t cursor = conn->header_sent;
+    for (unsigned i = 0; i < conn->queue_len; i++) {
+        PendingResponse* pending = Connection_at(conn, i);
+        size_t end = pending->header_offset + pending->header_size;
+        if (cursor < end) {
+            char* from = conn->send_buff + cursor;
+            if (n > 0 && (char*)iov[n - 1].iov_base + iov[n - 1].iov_len == from) {
+                // headers without a memory body in between are contiguous
+                iov[n - 1].iov_len += end - cursor;
+            } else if (n < max) {
+                iov[n].iov_base = from;
+                iov[n].iov_len = end - cursor;
+                n++;
+            } else {
+                break;
+            }
+            cursor = end;
+        }
+        if (pending->mem_sent < pending->mem_size) {
+            if (n == max) {
+                break;
+            }
+            iov[n].iov_base = (char*)pending->mem + pending->mem_sent;
+            iov[n].iov_len = pending->mem_size - pending->mem_sent;
+            n++;
+        }
+        if (pending->body_remaining > 0) {
+            *body = pending;
+            break;
+        }
+    }
+    return n;
+}
+
+int Connection_zerocopy_find(Connection* conn, const struct iovec* iov, int iovcnt, HotEntry** entry)
+{
+    if (conn->zc_copied || conn->zc_len == WS_ZEROCOPY_HOLDS) {
+        return iovcnt;
+    }
+    for (unsigned i = 0; i < conn->queue_len; i++) {
+        PendingResponse* pending = Connection_at(conn, i);
+        if (pending->entry && pending->mem_size - pending->mem_sent >= WS_ZEROCOPY_MIN) {
+            const char* from = (const char*)pending->mem + pending->mem_sent;
+            for (int k = 0; k < iovcnt; k++) {
+                if (iov[k].iov_base == from) {
+                    *entry = pending->entry;
+                    return k;
+                }
+            }
+            return iovcnt;
+        }
+        if (pending->body_remaining > 0) {
+            break;
+        }
+    }
+    return iovcnt;
+}
+
+void Connection_zerocopy_hold(Connection* conn, HotEntry* entry)
+{
+    HotCache_retain(conn->hot, entry);
+    conn->zc_holds[conn->zc_len].id = conn->zc_next++;
+    conn->zc_holds[conn->zc_len].entry = entry;
+    conn->zc_len++;
+}
+
+void Connection_zerocopy_done(Connection* conn, uint32_t lo, uint32_t hi)
+{
+    unsigned kept = 0;
+    for (unsigned i = 0; i < conn->zc_len; i++) {
+        ZeroCopyHold* hold = &conn->zc_holds[i];
+        // unsigned differences so the range may wrap around
+        if (hold->id - lo <= hi - lo) {
+            HotCache_release(conn->hot, hold->entry);
+        } else {
+            conn->zc_holds[kept++] = *hold;
+        }
+    }
+    conn->zc_len = kept;
+}
+
+// index of the entry that ends the response entry i belongs to
+static unsigned last_entry(Connection* conn, unsigned i)
+{
+    while (!Connection_at(conn, i)->ends) {
+        i++;
+    }
+    return i;
+}
+
+void Connection_sent(Connection* conn, size_t n)
+{
+    uint64_t now = 0;
+    for (unsigned i = 0; n > 0 && i < conn->queue_len; i++) {
+        PendingResponse* pending = Connection_at(conn, i);
+        size_t end = pending->header_offset + pending->header_size;
+        if (conn->header_sent < end) {
+            if (pending->opens && conn->header_sent == pending->header_offset) {
+                // one clock read for every response this write started
+                now = now ? now : metrics_clock();
+                metrics_first_byte(pending->code, pending->content_type, now - pending->started_ns);
+                if (accesslog_on()) {
+                    Connection_at(conn, last_entry(conn, i))->log.first_byte_us = (now - pending->started_ns) / 1000;
+                }
+            }
+            size_t k = n < end - conn->header_sent ? n : end - conn->header_sent;
+            conn->header_sent += k;
+            n -= k;
+        }
+        if (pending->mem_sent < pending->mem_size) {
+            size_t k = n < pending->mem_size - pending->mem_sent ? n : pending->mem_size - pending->mem_sent;
+            pending->mem_sent += k;
+            n -= k;
+        }
+        if (pending->body_remaining > 0) {
+            break;
+        }
+    }
+}
+
+PendingResponse* Connection_body(Connection* conn)
+{
+    for (unsigned i = 0; i < conn->queue_len; i++) {
+        PendingResponse* pending = Connection_at(conn, i);
+        if (conn->header_sent < pending->header_offset + pending->header_size || pending->mem_sent < pending->mem_size) {
+            return NULL;
+        } else if (pending->body_remaining > 0) {
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+void Connection_readahead(PendingResponse* body)
+{
+    off_t end = body->body_offset + body->body_remaining;
+    if (body->advised < 0) {
+        if (body->body_remaining < WS_STREAM_MIN) {
+            // the page cache readahead copes with small files
+            body->advised = end;
+            return;
+        }
+        posix_fadvise(body->fd, body->body_offset, body->body_remaining, POSIX_FADV_SEQUENTIAL);
+        body->advised = body->body_offset;
+    }
+    if (body->advised >= end || body->advised - body->body_offset >= WS_READAHEAD / 2) {
+        return;
+    }
+    off_t len = end - body->advised < WS_READAHEAD ? end - body->advised : WS_READAHEAD;
+    posix_fadvise(body->fd, body->advised, len, POSIX_FADV_WILLNEED);
+    body->advised += len;
+}
+
+void Connection_finish_responses(Connection* conn)
+{
+    uint64_t now = 0;
+    PendingResponse* front;
+    while ((front = Connection_front(conn)) != NULL) {
+        if (conn->header_sent < front->header_offset + front->header_size || front->mem_sent < front->mem_size ||
+            front->body_remaining > 0) {
+            return;
+        }
+        if (front->ends) {
+            now = now ? now : metrics_clock();
+            metrics_done(front->code, front->content_type, now - front->started_ns);
+            accesslog_append(&front->log, front->code, now - front->started_ns);
+        }
+        release_body(conn, front);
+        conn->queue_head = (conn->queue_head + 1) % WS_PIPELINE_DEPTH;
+        conn->queue_len--;
+        if (conn->queue_len == 0) {
+            conn->send_len = 0;
+            conn->header_sent = 0;
+        }
+        if (front->last) {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+    }
+}
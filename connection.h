@@ -0,0 +1,268 @@
+#ifndef NBH_CONNECTION_HEADER
+#define NBH_CONNECTION_HEADER
+
+#include "accesslog.h"
+#include "common.h"
+#include "file_cache.h"
+#include "fs_pool.h"
+#include "hot_cache.h"
+#include "tls.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// queue entries on one connection, a multipart/byteranges answer takes one per part plus one
+#define WS_PIPELINE_DEPTH 24
+
+// queue entries and send_buff room needed to take on one more response
+#define WS_RESPONSE_SLOTS (WS_RANGE_MAX + 1)
+#define WS_HEADER_MAX (512 + WS_RESPONSE_SLOTS * WS_PART_HEADER_MAX)
+
+// enough for a header and a body per queued response
+#define WS_IOV_MAX (2 * WS_PIPELINE_DEPTH)
+
+// file body bytes a connection may send per turn before others get theirs
+#define WS_STREAM_QUANTUM (256 * 1024)
+
+// file bodies at least this big get sequential readahead hints
+#define WS_STREAM_MIN (256 * 1024)
+
+// how far ahead of the send position readahead is asked for
+#define WS_READAHEAD (1024 * 1024)
+
+// hot bodies at least this big go out with MSG_ZEROCOPY when it is on
+#define WS_ZEROCOPY_MIN (16 * 1024)
+
+// zerocopy sends per connection the kernel may still be reading from
+#define WS_ZEROCOPY_HOLDS 16
+
+// Connection states
+#define CONN_READING 1
+#define CONN_CLOSING 3
+// waiting on the fs pool for stat()/open()
+#define CONN_PARKED 4
+// TLS handshake still running
+#define CONN_HANDSHAKE 5
+// switched to HTTP/2, conn->h2 runs the socket
+#define CONN_H2 6
+
+/* A response waiting to go out, its header lives in send_buff.
+ *
+ * After the header comes either a memory body, the rest of the header and
+ * the body out of the hot cache, or a file body sent from fd.
+ *
+ * A multipart/byteranges answer is queued as one entry per part, each with
+ * its part header and slice of the file, and one for the closing delimiter.
+ */
+typedef struct {
+    uint32_t code;
+    size_t header_offset;
+    size_t header_size;
+    HotEntry* entry; // NULL unless there is a memory body
+    const char* mem;
+    size_t mem_size;
+    size_t mem_sent;
+    int fd; // -1 unless there is a file body
+    CachedFile* file; // reference fd came with, NULL if the fd is ours
+    bool shared_fd; // a later part of the same response releases fd
+    off_t body_offset;
+    size_t body_remaining;
+    // readahead was asked for up to here, -1 before the body started
+    off_t advised;
+    // connection closes once this response is out
+    bool last;
+    // the first and the last entry of its response record its times, see metrics.h
+    bool opens;
+    bool ends;
+    uint64_t started_ns;
+    int content_type;
+    // what the access log gets once the last entry is out, kept in that one only
+    AccessRecord log;
+} PendingResponse;
+
+/* Per client state for the event driven engines.
+ *
+ * The engines own the socket io, this struct only holds what is needed to
+ * resume a request/response at any byte boundary.
+ *
+ * Pipelined requests are all parsed as soon as they arrive and their
+ * responses queued in order. The headers sit back to back in send_buff so
+ * every header up to the next file body goes out in one write.
+ */
+// a hot entry kept mapped until the zerocopy send with this id completes
+typedef struct {
+    uint32_t id;
+    HotEntry* entry;
+} ZeroCopyHold;
+
+typedef struct Connection {
+    int fd;
+    // NULL for plaintext connections
+    Tls* tls;
+    int state;
+
+    // recv_buffer and send_buffer bytes right after the struct, sized when the connection was accepted
+    char* recv_buff;
+    size_t recv_size;
+    size_t recv_len;
+    HttpParser parser;
+
+    // the response being built, queued once its file is known
+    HttpRequest request;
+    HttpResponse response;
+    FsJob job;
+    // reference the file of the response being built came with
+    CachedFile* file;
+    FileCache* files;
+    // ENC_* codings still to negotiate for the response being built
+    uint8_t accept;
+    // metrics_clock() when its request was taken, content_type_id() of what it sends or -1
+    uint64_t started_ns;
+    int content_type;
+    // the peer and request line of the response being built, while access logging is on
+    AccessRecord log;
+    // hot cache entry the response being built is served from
+    HotEntry* entry;
+    HotCache* hot;
+
+    PendingResponse queue[WS_PIPELINE_DEPTH];
+    unsigned queue_head;
+    unsigned queue_len;
+    // a response with last set is queued, nothing after it is parsed
+    bool last_queued;
+
+    char* send_buff;
+    size_t send_size;
+    // bytes of send_buff holding headers, and how many of them went out
+    size_t send_len;
+    size_t header_sent;
+
+    size_t requests;
+    uint64_t last_active;
+
+    // io_uring engine only, body is spliced file -> pipe -> socket
+    struct iovec iov[WS_IOV_MAX];
+    struct msghdr msg;
+    int pipe_fds[2];
+    size_t pipe_bytes;
+    int inflight;
+    bool failed;
+
+    // epoll engine only, file body bytes left in this turn
+    size_t deficit;
+    // in the round robin of connections waiting for their next turn
+    struct Connection* run_next;
+    bool scheduled;
+    // MSG_ZEROCOPY sends not yet reported done, ids count up from 0
+    ZeroCopyHold zc_holds[WS_ZEROCOPY_HOLDS];
+    unsigned zc_len;
+    uint32_t zc_next;
+    // the kernel copied anyway, e.g. over loopback, so stop asking
+    bool zc_copied;
+    // may switch to cleartext HTTP/2, and the session once it did
+    bool h2c;
+    struct H2Session* h2;
+
+    // intrusive idle list, oldest activity first
+    struct Connection* prev;
+    struct Connection* next;
+    bool listed;
+} Connection;
+
+typedef struct {
+    Connection* head;
+    Connection* tail;
+} ConnectionList;
+
+uint64_t now_ms();
+
+/* files may be NULL, every request then does its own stat()/open().
+ * hot may be NULL, every body is then sent from its file.
+ */
+Connection* Connection_create(int fd, FileCache* files, HotCache* hot);
+
+// appends to the tail and stamps last_active
+void ConnectionList_push(ConnectionList* list, Connection* conn);
+
+// no-op if conn is not in the list
+void ConnectionList_unlink(ConnectionList* list, Connection* conn);
+
+// moves conn to the tail, call on any io activity
+void ConnectionList_touch(ConnectionList* list, Connection* conn);
+
+// closes the socket and any file still attached to the response
+void Connection_destroy(Connection* conn);
+
+/* Feeds bytes received since the last call to the parser.
+ *
+ * True once recv_buff holds a whole request head, or can not take more
+ * bytes, and there is room to queue its response.
+ */
+bool Connection_request_ready(Connection* conn);
+
+/* Builds and queues the response for the request the parser finished.
+ *
+ * The request's bytes are dropped from recv_buff so the parser can start
+ * on the next one.
+ */
+void Connection_respond(Connection* conn);
+
+/* Connection_respond split around file_open().
+ *
+ * Connection_begin_response returns true when conn->job has to be run,
+ * either inline or on an FsPool, and its result passed on to
+ * Connection_complete_response. Otherwise the response is already queued,
+ * possibly straight from the file cache.
+ */
+bool Connection_begin_response(Connection* conn);
+
+/* Takes the result of conn->job. Returns true when the job has to be run
+ * again, it now names a precompressed sidecar the client takes.
+ */
+bool Connection_complete_response(Connection* conn, const FileInfo* file);
+
+/* Fills iov with the unsent headers and memory bodies of the queued
+ * responses, up to and including the header of the first one with a file
+ * body, and returns the iovec count. body is set to that response, or NULL
+ * when no file body follows the gathered bytes.
+ *
+ * 0 when the front response only has its file body left.
+ */
+int Connection_gather(Connection* conn, struct iovec* iov, int max, PendingResponse** body);
+
+/* Hints the kernel to read body ahead of where it is being sent from,
+ * call before each send of it.
+ */
+void Connection_readahead(PendingResponse* body);
+
+/* Finds the memory body worth sending with MSG_ZEROCOPY among the
+ * gathered iovecs. Returns its index, or iovcnt when there is none or no
+ * room to hold on to another one.
+ *
+ * The zerocopy send must carry iov[index] alone: headers live in send_buff,
+ * which is reused as soon as they count as sent.
+ */
+int Connection_zerocopy_find(Connection* conn, const struct iovec* iov, int iovcnt, HotEntry** entry);
+
+// call after a MSG_ZEROCOPY send of entry that sent at least a byte
+void Connection_zerocopy_hold(Connection* conn, HotEntry* entry);
+
+// the kernel is done with the zerocopy sends lo to hi
+void Connection_zerocopy_done(Connection* conn, uint32_t lo, uint32_t hi);
+
+// n bytes of the gathered iovecs were written
+void Connection_sent(Connection* conn, size_t n);
+
+// the first response with only its file body left to send, else NULL
+PendingResponse* Connection_body(Connection* conn);
+
+/* Retires the responses at the front of the queue that are fully sent.
+ *
+ * Moves the connection into CONN_CLOSING after the last response of a
+ * non keep-alive connection.
+ */
+void Connection_finish_responses(Connection* conn);
+
+#endif
@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+
+#include "epoll_loop.h"
+#include "connection.h"
+#include "h2.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define EPOLL_MAX_EVENTS 256
+
+// how often idle connections are checked for keepalive_timeout
+#define EPOLL_TICK 1000
+
+// fs pool stats are printed at most this often while it is busy
+#define FS_POOL_REPORT_MS 10000
+
+typedef struct {
+    int epfd;
+    int sfd;
+    ConnectionList idle;
+    FsPool* pool;
+    FileCache* files;
+    HotCache* hot;
+    uint64_t last_report;
+    uint64_t reported_submitted;
+    // SO_ZEROCOPY is set on every connection
+    bool zerocopy;
+    TlsContext* tls;
+    // connections that used up their turn with file body left to send
+    Connection* run_head;
+    Connection* run_tail;
+    // accept() ran out of descriptors, the backlog gets no new edge so it is retried every tick
+    bool accept_stalled;
+} Loop;
+
+// an epoll_event with this data.ptr is the fs pool eventfd
+static char pool_marker;
+
+static void schedule(Loop* loop, Connection* conn)
+{
+    if (conn->scheduled) {
+        return;
+    }
+    conn->run_next = NULL;
+    if (loop->run_tail) {
+        loop->run_tail->run_next = conn;
+    } else {
+        loop->run_head = conn;
+    }
+    loop->run_tail = conn;
+    conn->scheduled = true;
+}
+
+static void unschedule(Loop* loop, Connection* conn)
+{
+    if (!conn->scheduled) {
+        return;
+    }
+    Connection* prev = NULL;
+    for (Connection* c = loop->run_head; c != conn; c = c->run_next) {
+        prev = c;
+    }
+    if (prev) {
+        prev->run_next = conn->run_next;
+    } else {
+        loop->run_head = conn->run_next;
+    }
+    if (loop->run_tail == conn) {
+        loop->run_tail = prev;
+    }
+    conn->scheduled = false;
+}
+
+static void close_connection(Loop* loop, Connection* conn)
+{
+    ConnectionList_unlink(&loop->idle, conn);
+    unschedule(loop, conn);
+    if (conn->state == CONN_PARKED) {
+        // the pool still points at conn->job, finish closing once it is back
+        conn->failed = true;
+        return;
+    }
+    // closing the fd removes it from the epoll set
+    Connection_destroy(conn);
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// returns -1 if the connection should be closed, 0 when recv would block
+static int conn_read(Connection* conn)
+{
+    while (conn->recv_len < conn->recv_size) {
+        char* buf = conn->recv_buff + conn->recv_len;
+        size_t room = conn->recv_size - conn->recv_len;
+        ssize_t rv = conn->tls ? Tls_recv(conn->tls, buf, room) : recv(conn->fd, buf, room, 0);
+        if (rv < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            int en = errno;
+            DebugErr("recv() %s\n", strerror(en));
+            return -1;
+        } else if (rv == 0) {
+            // client has closed the connection, answer what it already sent
+            return Connection_request_ready(conn) ? 0 : -1;
+        }
+        conn->recv_len += rv;
+    }
+    return 0;
+}
+
+/* Returns -1 on error, 0 when send would block, 1 once the queue is empty
+ * and 2 when the connection used up its turn.
+ *
+ * Only file body bytes count against conn->deficit, headers and small
+ * memory bodies always go out.
+ */
+static int conn_write(Loop* loop, Connection* conn)
+{
+    // without kTLS the bytes go through OpenSSL instead of straight to the socket
+    Tls* user_tls = conn->tls && !Tls_kernel_send(conn->tls) ? conn->tls : NULL;
+    while (conn->queue_len > 0) {
+        struct iovec iov[WS_IOV_MAX];
+        PendingResponse* body;
+        int iovcnt = Connection_gather(conn, iov, WS_IOV_MAX, &body);
+        if (iovcnt > 0) {
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+            int flags = MSG_NOSIGNAL;
+            HotEntry* entry = NULL;
+            if (loop->zerocopy) {
+                int zc = Connection_zerocopy_find(conn, iov, iovcnt, &entry);
+                if (zc == 0) {
+                    msg.msg_iovlen = 1;
+                    flags |= MSG_ZEROCOPY;
+                } else {
+                    // what comes before it is copied as usual
+                    msg.msg_iovlen = zc;
+                    entry = NULL;
+                }
+            }
+            if (body || (int)msg.msg_iovlen < iovcnt) {
+                // hold the tail back to share a segment with what follows
+                flags |= MSG_MORE;
+            }
+            ssize_t rv = user_tls ? Tls_sendv(user_tls, iov, msg.msg_iovlen) : sendmsg(conn->fd, &msg, flags);
+            if (rv > 0 && entry) {
+                Connection_zerocopy_hold(conn, entry);
+            }
+            if (rv < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                } else if (errno == EINTR) {
+                    continue;
+                }
+                int en = errno;
+                DebugErr("sendmsg() %s\n", strerror(en));
+                return -1;
+            }
+            Connection_sent(conn, rv);
+            if ((int)msg.msg_iovlen < iovcnt) {
+                continue;
+            }
+        }
+
+        while ((body = Connection_body(conn)) != NULL) {
+            if (conn->deficit == 0) {
+                return 2;
+            }
+            Connection_readahead(body);
+            size_t len = body->body_remaining < conn->deficit ? body->body_remaining : conn->deficit;
+            ssize_t rv = user_tls ? Tls_sendfile(user_tls, body->fd, &body->body_offset, len)
+                                  : sendfile(conn->fd, body->fd, &body->body_offset, len);
+            if (rv < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                } else if (errno == EINTR) {
+                    continue;
+                }
+                int en = errno;
+                DebugErr("sendfile() %s\n", strerror(en));
+                return -1;
+            } else if (rv == 0) {
+                // file shrank underneath us, the length promised can not be met
+                return -1;
+            }
+            body->body_remaining -= rv;
+            conn->deficit -= rv;
+        }
+        Connection_finish_responses(conn);
+        if (conn->state == CONN_CLOSING) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/* Runs conn->job until the response is queued, on the pool if there is
+ * room. False when the connection was parked waiting for the pool.
+ */
+static bool run_job(Loop* loop, Connection* conn)
+{
+    while (1) {
+        if (loop->pool && FsPool_submit(loop->pool, &conn->job)) {
+            conn->state = CONN_PARKED;
+            return false;
+        }
+        if (loop->pool) {
+            FsPool_count_inline(loop->pool);
+        }
+        FileInfo file = file_open(conn->job.path, conn->job.want_fd);
+        if (!Connection_complete_response(conn, &file)) {
+            return true;
+        }
+    }
+}
+
+/* Runs the connection state machine until it would block.
+ *
+ * Edge triggered epoll only reports a transition once so every readable or
+ * writable event has to be drained here. Everything already received is
+ * parsed and queued before writing, and more is only read once the queue
+ * is empty.
+ */
+static void conn_drive(Loop* loop, Connection* conn)
+{
+    ConnectionList_touch(&loop->idle, conn);
+    while (1) {
+        switch (conn->state) {
+        case CONN_READING:
+            while (Connection_request_ready(conn)) {
+                if (Connection_begin_response(conn) && !run_job(loop, conn)) {
+                    return;
+                }
+            }
+            if (conn->state == CONN_H2) {
+                break;
+            }
+            if (conn->queue_len > 0) {
+                int rv = conn_write(loop, conn);
+                if (rv < 0) {
+                    close_connection(loop, conn);
+                    return;
+                } else if (rv == 2) {
+                    // let the others have their turn first
+                    schedule(loop, conn);
+                    return;
+                }
+                // a fresh turn once the socket is writable again
+                conn->deficit = WS_STREAM_QUANTUM;
+                if (rv == 0) {
+                    return;
+                }
+                break;
+            }
+            if (conn_read(conn) < 0) {
+                close_connection(loop, conn);
+                return;
+            }
+            if (!Connection_request_ready(conn)) {
+                return;
+            }
+            break;
+
+        case CONN_HANDSHAKE: {
+            int rv = Tls_handshake(conn->tls);
+            if (rv < 0) {
+                close_connection(loop, conn);
+                return;
+            } else if (rv == 0) {
+                return;
+            }
+            conn->state = CONN_READING;
+            break;
+        }
+
+        case CONN_H2: {
+            int rv = H2Session_drive(conn);
+            if (rv < 0) {
+                close_connection(loop, conn);
+            } else if (rv == 2) {
+                schedule(loop, conn);
+            } else {
+                conn->deficit = WS_STREAM_QUANTUM;
+            }
+            return;
+        }
+
+        case CONN_PARKED:
+            return;
+
+        case CONN_CLOSING:
+        default:
+            close_connection(loop, conn);
+            return;
+        }
+    }
+}
+
+/* Reads zerocopy completions off the error queue, -1 when the socket has
+ * a real error instead.
+ */
+static int reap_zerocopy(Connection* conn)
+{
+    while (1) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                return -1;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                conn->zc_copied = true;
+            }
+            Connection_zerocopy_done(conn, err->ee_info, err->ee_data);
+        }
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void accept_all(Loop* loop)
+{
+    while (1) {
+        int cfd = accept4(loop->sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                loop->accept_stalled = false;
+                return;
+            }
+            int en = errno;
+            bool stalled = en == EMFILE || en == ENFILE || en == ENOBUFS || en == ENOMEM;
+            if (!loop->accept_stalled || !stalled) {
+                DebugErr("accept() %s\n", strerror(en));
+            }
+            loop->accept_stalled = stalled;
+            return;
+        }
+        loop->accept_stalled = false;
+
+        int one = 1;
+        if (loop->zerocopy && setsockopt(cfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            int en = errno;
+            DebugErr("setsockopt(SO_ZEROCOPY) %s, sending with copies\n", strerror(en));
+            loop->zerocopy = false;
+        }
+
+        Connection* conn = Connection_create(cfd, loop->files, loop->hot);
+        if (conn == NULL) {
+            DebugErr("Connection_create() out of memory\n");
+            close(cfd);
+            continue;
+        }
+        if (loop->tls) {
+            conn->tls = Tls_create(loop->tls, cfd);
+            if (conn->tls == NULL) {
+                DebugErr("Tls_create() failed\n");
+                Connection_destroy(conn);
+                continue;
+            }
+            conn->state = CONN_HANDSHAKE;
+        } else {
+            conn->h2c = true;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+            int en = errno;
+            DebugErr("epoll_ctl() %s\n", strerror(en));
+            Connection_destroy(conn);
+            continue;
+        }
+        ConnectionList_push(&loop->idle, conn);
+        // the request may already be waiting
+        conn_drive(loop, conn);
+    }
+}
+
+static void drain_pool(Loop* loop)
+{
+    FsJob* job;
+    while ((job = FsPool_complete(loop->pool)) != NULL) {
+        Connection* conn = job->owner;
+        if (conn->failed) {
+            if (job->result.fd >= 0) {
+                close(job->result.fd);
+            }
+            conn->state = CONN_CLOSING;
+            close_connection(loop, conn);
+            continue;
+        }
+        conn->state = CONN_READING;
+        if (Connection_complete_response(conn, &job->result) && !run_job(loop, conn)) {
+            // parked again, for the sidecar
+            continue;
+        }
+        conn_drive(loop, conn);
+    }
+}
+
+static void report_pool(Loop* loop)
+{
+    uint64_t now = now_ms();
+    if (now - loop->last_report < FS_POOL_REPORT_MS) {
+        return;
+    }
+    loop->last_report = now;
+
+    FsPoolStats stats;
+    FsPool_stats(loop->pool, &stats);
+    if (stats.submitted == loop->reported_submitted) {
+        return;
+    }
+    loop->reported_submitted = stats.submitted;
+    DebugMsg(
+        "%i: fs pool jobs=%lu inline=%lu depth=%lu max_depth=%lu avg_wait=%luus max_wait=%luus\n",
+        getpid(),
+        stats.submitted,
+        stats.inline_fallbacks,
+        stats.depth,
+        stats.max_depth,
+        stats.completed ? stats.wait_ns_total / stats.completed / 1000 : 0,
+        stats.wait_ns_max / 1000
+    );
+}
+
+/* One round of the deficit round robin: every connection that was waiting
+ * for its turn gets another quantum of file body to send.
+ */
+static void run_round(Loop* loop)
+{
+    Connection* tail = loop->run_tail;
+    Connection* conn;
+    do {
+        conn = loop->run_head;
+        loop->run_head = conn->run_next;
+        if (loop->run_head == NULL) {
+            loop->run_tail = NULL;
+        }
+        conn->scheduled = false;
+        conn->deficit += WS_STREAM_QUANTUM;
+        conn_drive(loop, conn);
+    } while (conn != tail && loop->run_head);
+}
+
+static void close_idle(Loop* loop)
+{
+    uint64_t now = now_ms();
+    while (loop->idle.head && now - loop->idle.head->last_active >= (uint64_t)ws_config->keepalive_timeout) {
+        close_connection(loop, loop->idle.head);
+    }
+}
+
+int epoll_loop_run(int sfd, int fs_threads, MetaCache* meta, Archive* archive, size_t hot_budget, bool zerocopy,
+                   TlsContext* tls)
+{
+    // only hot cache bodies are sent with MSG_ZEROCOPY, kTLS sockets refuse it
+    Loop loop = {.sfd = sfd, .zerocopy = zerocopy && hot_budget > 0 && tls == NULL, .tls = tls};
+
+    if (meta) {
+        loop.files = FileCache_create(meta, ws_config->fd_cache_entries);
+        if (loop.files == NULL) {
+            DebugErr("FileCache_create() failed, files are not cached\n");
+        }
+    }
+    if (archive) {
+        if (loop.files) {
+            FileCache_use_archive(loop.files, archive);
+        }
+        Archive_release(archive);
+        if (loop.files == NULL) {
+            DebugErr("no file cache to serve the archive from\n");
+            return -1;
+        }
+    }
+    if (hot_budget > 0) {
+        loop.hot = HotCache_create(hot_budget);
+        if (loop.hot == NULL) {
+            DebugErr("HotCache_create() failed, bodies are not cached\n");
+        }
+    }
+
+    if (set_nonblocking(sfd) < 0) {
+        int en = errno;
+        DebugErr("fcntl() %s\n", strerror(en));
+        return -1;
+    }
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        int en = errno;
+        DebugErr("epoll_create1() %s\n", strerror(en));
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // NULL marks the listener
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        int en = errno;
+        DebugErr("epoll_ctl() %s\n", strerror(en));
+        close(loop.epfd);
+        return -1;
+    }
+
+    if (fs_threads > 0) {
+        loop.pool = FsPool_create(fs_threads, FS_POOL_CAPACITY);
+        if (loop.pool == NULL) {
+            DebugErr("FsPool_create() failed, running stat()/open() inline\n");
+        } else {
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = &pool_marker;
+            if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, FsPool_eventfd(loop.pool), &ev) < 0) {
+                int en = errno;
+                DebugErr("epoll_ctl() %s\n", strerror(en));
+                close(loop.epfd);
+                return -1;
+            }
+        }
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        // only poll while connections are waiting for their turn
+        int n = epoll_wait(loop.epfd, events, EPOLL_MAX_EVENTS, loop.run_head ? 0 : EPOLL_TICK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int en = errno;
+            DebugErr("epoll_wait() %s\n", strerror(en));
+            close(loop.epfd);
+            return -1;
+        }
+        bool pool_done = false;
+        for (int i = 0; i < n; i++) {
+            Connection* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_all(&loop);
+            } else if (events[i].data.ptr == &pool_marker) {
+                pool_done = true;
+            } else if (events[i].events & EPOLLERR && (!loop.zerocopy || reap_zerocopy(conn) < 0)) {
+                close_connection(&loop, conn);
+            } else {
+                conn_drive(&loop, conn);
+            }
+        }
+        // only after the batch, draining may free connections later events of it still point at
+        if (pool_done) {
+            drain_pool(&loop);
+        }
+        if (loop.run_head) {
+            run_round(&loop);
+        }
+        if (config_refresh()) {
+            listen(sfd, ws_config->backlog);
+        }
+        close_idle(&loop);
+        if (loop.accept_stalled) {
+            accept_all(&loop);
+        }
+        if (root_dir_check() && meta) {
+            // whatever was looked up in the old root is wrong now
+            MetaCache_flush(meta);
+        }
+        if (loop.files) {
+            FileCache_check_archive(loop.files);
+        }
+        if (loop.pool) {
+            report_pool(&loop);
+            FsPoolStats pool_stats;
+            FsPool_stats(loop.pool, &pool_stats);
+            metrics_fs_pool(&pool_stats);
+        }
+        if (loop.hot) {
+            HotCache_report(loop.hot);
+            HotCacheStats hot_stats;
+            HotCache_stats(loop.hot, &hot_stats);
+            metrics_hot_cache(&hot_stats);
+        }
+    }
+}
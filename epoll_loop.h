@@ -0,0 +1,30 @@
+#ifndef NBH_EPOLL_LOOP_HEADER
+#define NBH_EPOLL_LOOP_HEADER
+
+#include "file_cache.h"
+#include "hot_cache.h"
+#include "tls.h"
+
+// bound on stat()/open() jobs queued at once, more run inline
+#define FS_POOL_CAPACITY 1024
+
+#include <stdbool.h>
+
+/* Single process edge triggered epoll engine.
+ *
+ * Takes ownership of a listening socket, makes it non-blocking and serves
+ * every connection accepted on it. Only returns on a fatal error.
+ *
+ * With fs_threads > 0 stat()/open() run on an FsPool and the connection
+ * is parked until the result comes back. With meta set open files are
+ * cached on top of it and only a miss goes to file_open(). With archive set
+ * every file comes out of it instead, the loop takes over that reference
+ * and meta is still needed. With hot_budget > 0
+ * small popular files are served from a HotCache of that many bytes, with
+ * zerocopy set big enough ones go out with MSG_ZEROCOPY. With tls set every
+ * connection speaks TLS.
+ */
+int epoll_loop_run(int sfd, int fs_threads, MetaCache* meta, Archive* archive, size_t hot_budget, bool zerocopy,
+                   TlsContext* tls);
+
+#endif
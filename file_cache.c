@@ -0,0 +1,526 @@
+#include "file_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define META_WAYS 8
+#define FD_WAYS 4
+
+/* A writer inside a set is never interrupted, but a process can still be
+ * killed there and leave the set locked for good. Readers and writers give
+ * up after this many tries, a read counts as a miss and a write is skipped.
+ */
+#define META_TRIES 4096
+
+typedef struct {
+    uint64_t hash; // 0 marks an empty way
+    uint64_t checked;
+    _Atomic uint64_t used;
+    FileInfo info; // fd is always -1 here
+    uint16_t path_len;
+    char path[WS_CACHE_PATH_MAX];
+} MetaEntry;
+
+typedef struct {
+    // odd while a writer is inside the set
+    _Alignas(64) atomic_uint seq;
+    atomic_flag lock;
+    // when an entry of the set was last invalidated, under lock
+    uint64_t invalidated;
+    MetaEntry ways[META_WAYS];
+} MetaSet;
+
+struct MetaCache {
+    size_t mask;
+    atomic_bool watched;
+    // entries checked before this are gone
+    _Atomic uint64_t flushed;
+    _Atomic uint64_t invalidations;
+    _Atomic uint64_t flushes;
+    MetaSet sets[];
+};
+
+struct CachedFile {
+    uint64_t hash; // 0 marks an empty slot
+    uint64_t used;
+    int refs;
+    // the path now names another file, close once unreferenced
+    bool stale;
+    // the archive info.fd belongs to, NULL when the fd is this entry's own
+    Archive* archive;
+    FileInfo info;
+    uint16_t path_len;
+    char path[WS_CACHE_PATH_MAX];
+    uint16_t entity_size;
+    char entity[WS_ENTITY_HEADER_MAX];
+};
+
+struct FileCache {
+    MetaCache* meta;
+    size_t mask;
+    CachedFile* files;
+    Archive* archive;
+    uint64_t archive_checked;
+};
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a, never 0 so 0 can mark empty slots
+static uint64_t path_hash(const char* path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)path[i];
+        h *= 0x100000001b3ull;
+    }
+    return h ? h : 1;
+}
+
+static size_t sets_for(size_t entries, size_t ways)
+{
+    size_t sets = 1;
+    while (sets * ways < entries) {
+        sets <<= 1;
+    }
+    return sets;
+}
+
+MetaCache* MetaCache_create(size_t entries)
+{
+    size_t sets = sets_for(entries, META_WAYS);
+    size_t size = sizeof(MetaCache) + sets * sizeof(MetaSet);
+    // anonymous shared memory is zeroed, every way starts out empty
+    MetaCache* meta = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (meta == MAP_FAILED) {
+        return NULL;
+    }
+    meta->mask = sets - 1;
+    return meta;
+}
+
+static bool MetaCache_get(MetaCache* meta, uint64_t hash, const char* path, size_t len, FileInfo* info, uint64_t* checked)
+{
+    uint64_t flushed = atomic_load_explicit(&meta->flushed, memory_order_acquire);
+    MetaSet* set = &meta->sets[hash & meta->mask];
+    for (int tries = 0; tries < META_TRIES; tries++) {
+        unsigned seq = atomic_load_explicit(&set->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        MetaEntry* found = NULL;
+        for (int i = 0; i < META_WAYS; i++) {
+            MetaEntry* e = &set->ways[i];
+            if (e->hash == hash && e->checked > flushed && e->path_len == len && memcmp(e->path, path, len) == 0) {
+                *info = e->info;
+                *checked = e->checked;
+                found = e;
+                break;
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&set->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        if (found) {
+            atomic_store_explicit(&found->used, now_ms(), memory_order_relaxed);
+        }
+        return found != NULL;
+    }
+    return false;
+}
+
+/* Enters set with every signal blocked, so a SIGINT from the parent can not
+ * end the process inside it. False when it stayed locked, see META_TRIES.
+ */
+static bool MetaSet_lock(MetaSet* set, sigset_t* saved)
+{
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, saved);
+    for (int tries = 0; atomic_flag_test_and_set_explicit(&set->lock, memory_order_acquire); tries++) {
+        if (tries == META_TRIES) {
+            pthread_sigmask(SIG_SETMASK, saved, NULL);
+            return false;
+        }
+    }
+    atomic_fetch_add_explicit(&set->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return true;
+}
+
+static void MetaSet_unlock(MetaSet* set, const sigset_t* saved)
+{
+    atomic_fetch_add_explicit(&set->seq, 1, memory_order_release);
+    atomic_flag_clear_explicit(&set->lock, memory_order_release);
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
+static void MetaCache_put(MetaCache* meta, uint64_t hash, const char* path, size_t len, const FileInfo* info)
+{
+    MetaSet* set = &meta->sets[hash & meta->mask];
+    sigset_t saved;
+    if (!MetaSet_lock(set, &saved)) {
+        return;
+    }
+    if (info->looked_ms <= set->invalidated || info->looked_ms <= atomic_load(&meta->flushed)) {
+        // may predate a change the watcher already reported
+        MetaSet_unlock(set, &saved);
+        return;
+    }
+
+    // the same path, else an empty way, else the least recently used
+    MetaEntry* victim = &set->ways[0];
+    for (int i = 0; i < META_WAYS; i++) {
+        MetaEntry* e = &set->ways[i];
+        if (e->hash == hash && e->path_len == len && memcmp(e->path, path, len) == 0) {
+            victim = e;
+            break;
+        } else if (victim->hash != 0 && (e->hash == 0 || e->used < victim->used)) {
+            victim = e;
+        }
+    }
+    uint64_t now = now_ms();
+    victim->hash = hash;
+    victim->checked = now;
+    atomic_store_explicit(&victim->used, now, memory_order_relaxed);
+    victim->info = *info;
+    victim->info.fd = -1;
+    victim->path_len = len;
+    memcpy(victim->path, path, len);
+    MetaSet_unlock(set, &saved);
+}
+
+void MetaCache_invalidate(MetaCache* meta, const char* path, size_t len)
+{
+    uint64_t hash = path_hash(path, len);
+    MetaSet* set = &meta->sets[hash & meta->mask];
+    sigset_t saved;
+    if (!MetaSet_lock(set, &saved)) {
+        // the change must not be missed, drop everything instead
+        MetaCache_flush(meta);
+        return;
+    }
+    for (int i = 0; i < META_WAYS; i++) {
+        MetaEntry* e = &set->ways[i];
+        if (e->hash == hash && e->path_len == len && memcmp(e->path, path, len) == 0) {
+            e->hash = 0;
+        }
+    }
+    set->invalidated = now_ms();
+    MetaSet_unlock(set, &saved);
+    atomic_fetch_add_explicit(&meta->invalidations, 1, memory_order_relaxed);
+}
+
+void MetaCache_flush(MetaCache* meta)
+{
+    atomic_store_explicit(&meta->flushed, now_ms(), memory_order_release);
+    atomic_fetch_add_explicit(&meta->flushes, 1, memory_order_relaxed);
+}
+
+void MetaCache_set_watched(MetaCache* meta, bool watched) { atomic_store(&meta->watched, watched); }
+
+void MetaCache_stats(const MetaCache* meta, MetaCacheStats* stats)
+{
+    stats->invalidations = atomic_load_explicit(&meta->invalidations, memory_order_relaxed);
+    stats->flushes = atomic_load_explicit(&meta->flushes, memory_order_relaxed);
+    stats->watched = atomic_load_explicit(&meta->watched, memory_order_relaxed);
+}
+
+FileCache* FileCache_create(MetaCache* meta, size_t entries)
+{
+    FileCache* cache = calloc(1, sizeof(FileCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    size_t sets = sets_for(entries, FD_WAYS);
+    cache->files = calloc(sets * FD_WAYS, sizeof(CachedFile));
+    if (cache->files == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->meta = meta;
+    cache->mask = sets - 1;
+    return cache;
+}
+
+static void CachedFile_drop(CachedFile* file)
+{
+    if (file->archive) {
+        Archive_release(file->archive);
+        file->archive = NULL;
+    } else {
+        close(file->info.fd);
+    }
+    file->hash = 0;
+}
+
+void FileCache_destroy(FileCache* cache)
+{
+    for (size_t i = 0; i < (cache->mask + 1) * FD_WAYS; i++) {
+        if (cache->files[i].hash != 0) {
+            CachedFile_drop(&cache->files[i]);
+        }
+    }
+    if (cache->archive) {
+        Archive_release(cache->archive);
+    }
+    free(cache->files);
+    free(cache);
+}
+
+static CachedFile* FileCache_set(FileCache* cache, uint64_t hash) { return &cache->files[(hash & cache->mask) * FD_WAYS]; }
+
+// an empty way of set, else the least recently used one nothing sends from, NULL when there is none
+static CachedFile* victim_way(CachedFile* set)
+{
+    CachedFile* victim = NULL;
+    for (int i = 0; i < FD_WAYS; i++) {
+        CachedFile* f = &set[i];
+        if (f->hash == 0) {
+            return f;
+        } else if (f->refs == 0 && (victim == NULL || f->used < victim->used)) {
+            victim = f;
+        }
+    }
+    return victim;
+}
+
+/* Length of path if it can be cached: short enough and in the one form the
+ * watcher names it by, without empty, . or .. segments. Otherwise 0.
+ */
+static size_t cacheable(const char* path)
+{
+    size_t len = strnlen(path, WS_CACHE_PATH_MAX);
+    if (len == WS_CACHE_PATH_MAX) {
+        return 0;
+    }
+    for (const char* p = path; (p = strchr(p, '/')) != NULL; p++) {
+        size_t segment = strcspn(p + 1, "/");
+        if (segment == 0 || (segment <= 2 && strspn(p + 1, ".") == segment)) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+static bool same_file(const FileInfo* a, const FileInfo* b)
+{
+    return a->ino == b->ino && a->dev == b->dev && a->size == b->size && a->mtime_ns == b->mtime_ns;
+}
+
+/* FileCache_get for a cache serving an archive, always a hit. Members get
+ * an entry like opened files so their references keep the archive alive.
+ */
+static bool archive_get(FileCache* cache, const char* path, bool want_fd, FileInfo* file, CachedFile** ref)
+{
+    size_t len = strnlen(path, WS_PATH_BUFFER_SIZE);
+    StringView entity;
+    if (!Archive_lookup(cache->archive, path, len, file, &entity)) {
+        *file = (FileInfo){.err = ENOENT, .fd = -1, .content_type = content_type_id(path)};
+        return true;
+    }
+    if (!want_fd) {
+        file->fd = -1;
+        return true;
+    }
+
+    uint64_t hash = path_hash(path, len);
+    CachedFile* set = FileCache_set(cache, hash);
+    for (int i = 0; i < FD_WAYS; i++) {
+        CachedFile* f = &set[i];
+        if (f->hash == hash && !f->stale && f->path_len == len && memcmp(f->path, path, len) == 0) {
+            f->refs++;
+            f->used = now_ms();
+            *file = f->info;
+            *ref = f;
+            return true;
+        }
+    }
+    CachedFile* victim = len < WS_CACHE_PATH_MAX ? victim_way(set) : NULL;
+    if (victim == NULL) {
+        // the caller gets a descriptor of its own to close
+        file->fd = fcntl(Archive_fd(cache->archive), F_DUPFD_CLOEXEC, 0);
+        if (file->fd < 0) {
+            file->err = errno;
+        }
+        return true;
+    }
+    if (victim->hash != 0) {
+        CachedFile_drop(victim);
+    }
+    Archive_retain(cache->archive);
+    victim->archive = cache->archive;
+    victim->hash = hash;
+    victim->used = now_ms();
+    victim->refs = 1;
+    victim->stale = false;
+    victim->info = *file;
+    victim->path_len = len;
+    memcpy(victim->path, path, len);
+    victim->entity_size = entity.size;
+    memcpy(victim->entity, entity.ptr, entity.size);
+    *ref = victim;
+    return true;
+}
+
+bool FileCache_get(FileCache* cache, const char* path, bool want_fd, FileInfo* file, CachedFile** ref)
+{
+    *ref = NULL;
+    if (cache->archive) {
+        return archive_get(cache, path, want_fd, file, ref);
+    }
+    size_t len = cacheable(path);
+    if (len == 0) {
+        return false;
+    }
+    uint64_t hash = path_hash(path, len);
+    uint64_t checked;
+    uint64_t now = now_ms();
+    if (!MetaCache_get(cache->meta, hash, path, len, file, &checked)) {
+        return false;
+    }
+    // the watcher only reports the path a change happened under, not the symlinks leading to it
+    bool watched = atomic_load_explicit(&cache->meta->watched, memory_order_relaxed) && !file->untracked;
+    if (!watched && now - checked >= (uint64_t)ws_config->meta_ttl) {
+        return false;
+    }
+    if (!want_fd || file->err != 0) {
+        return true;
+    }
+
+    CachedFile* set = FileCache_set(cache, hash);
+    for (int i = 0; i < FD_WAYS; i++) {
+        CachedFile* f = &set[i];
+        if (f->hash == hash && !f->stale && f->path_len == len && memcmp(f->path, path, len) == 0) {
+            if (!same_file(&f->info, file)) {
+                // changed since it was opened, file_open gets the new one
+                return false;
+            }
+            f->refs++;
+            f->used = now;
+            *file = f->info;
+            *ref = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* True when err says the path is not there to serve until something
+ * changes on disk, which the watcher or meta_ttl catches. Running out of
+ * descriptors or memory and I/O errors pass, so they are never cached.
+ */
+static bool lasting_miss(int err)
+{
+    // ELOOP and EXDEV are what openat2() answers for a path leading out of the root
+    return err == ENOENT || err == ENOTDIR || err == EACCES || err == ELOOP || err == EXDEV;
+}
+
+void FileCache_put(FileCache* cache, const char* path, const FileInfo* file, CachedFile** ref)
+{
+    *ref = NULL;
+    size_t len = cacheable(path);
+    if (len == 0 || (file->err != 0 && !lasting_miss(file->err))) {
+        return;
+    }
+    uint64_t hash = path_hash(path, len);
+    MetaCache_put(cache->meta, hash, path, len, file);
+    if (file->fd < 0) {
+        return;
+    }
+
+    CachedFile* set = FileCache_set(cache, hash);
+    for (int i = 0; i < FD_WAYS; i++) {
+        CachedFile* f = &set[i];
+        if (f->hash == hash && !f->stale && f->path_len == len && memcmp(f->path, path, len) == 0) {
+            // an older open of the same path
+            if (f->refs > 0) {
+                f->stale = true;
+            } else {
+                CachedFile_drop(f);
+            }
+        }
+    }
+    CachedFile* victim = victim_way(set);
+    if (victim == NULL) {
+        // every way is being sent from, leave this one uncached
+        return;
+    }
+    if (victim->hash != 0) {
+        CachedFile_drop(victim);
+    }
+    victim->hash = hash;
+    victim->used = now_ms();
+    victim->refs = 1;
+    victim->stale = false;
+    victim->info = *file;
+    victim->path_len = len;
+    memcpy(victim->path, path, len);
+    victim->entity_size = file->content_type < 0 ? 0 : entity_header(file, victim->entity);
+    *ref = victim;
+}
+
+StringView CachedFile_entity(const CachedFile* ref)
+{
+    StringView entity = {ref->entity, ref->entity_size};
+    return entity;
+}
+
+void FileCache_release(FileCache* cache, CachedFile* ref)
+{
+    (void)cache;
+    ref->refs--;
+    if (ref->refs == 0 && ref->stale) {
+        CachedFile_drop(ref);
+    }
+}
+
+void FileCache_use_archive(FileCache* cache, Archive* archive)
+{
+    Archive_retain(archive);
+    if (cache->archive) {
+        for (size_t i = 0; i < (cache->mask + 1) * FD_WAYS; i++) {
+            CachedFile* f = &cache->files[i];
+            if (f->hash == 0 || f->archive != cache->archive) {
+                continue;
+            } else if (f->refs > 0) {
+                f->stale = true;
+            } else {
+                CachedFile_drop(f);
+            }
+        }
+        Archive_release(cache->archive);
+    }
+    cache->archive = archive;
+    cache->archive_checked = now_ms();
+}
+
+void FileCache_check_archive(FileCache* cache)
+{
+    uint64_t now = now_ms();
+    if (cache->archive == NULL || now - cache->archive_checked < WS_ARCHIVE_CHECK_MS) {
+        return;
+    }
+    cache->archive_checked = now;
+    Archive* next = Archive_reopen(cache->archive);
+    if (next) {
+        DebugMsg("%i: serving the new archive\n", getpid());
+        FileCache_use_archive(cache, next);
+        Archive_release(next);
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef NBH_FILE_CACHE_HEADER
+#define NBH_FILE_CACHE_HEADER
+
+#include "archive.h"
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// longer paths are never cached
+#define WS_CACHE_PATH_MAX 128
+
+/* stat() results keyed by path, in memory shared by all workers.
+ *
+ * Create it before forking. It is set associative with LRU eviction inside
+ * each set, readers never block: every set is a seqlock and a read that
+ * raced a writer is simply retried, a set left locked by a writer that was
+ * killed inside it only turns its lookups into misses. Lookups that failed because the file
+ * is missing or forbidden are cached too so a 404 costs no syscall either.
+ */
+typedef struct MetaCache MetaCache;
+
+MetaCache* MetaCache_create(size_t entries);
+
+/* Drops the entry of path after it changed on disk.
+ *
+ * A lookup whose file_open() started before this (FileInfo.looked_ms) may
+ * have seen the old file, so until the set is invalidated again it is not
+ * cached either.
+ */
+void MetaCache_invalidate(MetaCache* meta, const char* path, size_t len);
+
+// drops every entry, for changes that can not be pinned to one path
+void MetaCache_flush(MetaCache* meta);
+
+/* While set, entries are trusted until invalidated rather than for
+ * the meta_ttl of the configuration, except FileInfo.untracked ones. Only
+ * set while something invalidates every change.
+ */
+void MetaCache_set_watched(MetaCache* meta, bool watched);
+
+typedef struct {
+    uint64_t invalidations;
+    uint64_t flushes;
+    bool watched;
+} MetaCacheStats;
+
+void MetaCache_stats(const MetaCache* meta, MetaCacheStats* stats);
+
+/* Per worker cache of open descriptors on top of a MetaCache.
+ *
+ * Only ever used from the thread running the event loop. Every fd handed
+ * out is a reference that must be given back with FileCache_release, the
+ * fd is only closed once it is evicted or the file changed and no response
+ * still sends from it.
+ */
+typedef struct FileCache FileCache;
+typedef struct CachedFile CachedFile;
+
+FileCache* FileCache_create(MetaCache* meta, size_t entries);
+
+// closes every cached fd, no reference may still be held
+void FileCache_destroy(FileCache* cache);
+
+/* Looks up what file_open(path, want_fd) would return.
+ *
+ * True on a hit, file is filled in and ref is the reference to release if
+ * file->fd >= 0. False when the caller has to run file_open itself and pass
+ * the result to FileCache_put.
+ */
+bool FileCache_get(FileCache* cache, const char* path, bool want_fd, FileInfo* file, CachedFile** ref);
+
+/* Records the result of file_open(path, ...).
+ *
+ * The cache takes over file->fd and sets ref to the reference the caller
+ * now holds, or NULL when it could not be cached and the caller still owns
+ * the fd. Of the failures only a missing or forbidden file is cached, one
+ * that may pass, like EMFILE or EIO, is looked up again next time.
+ */
+void FileCache_put(FileCache* cache, const char* path, const FileInfo* file, CachedFile** ref);
+
+void FileCache_release(FileCache* cache, CachedFile* ref);
+
+/* Answers every lookup from archive from now on, the filesystem and the
+ * MetaCache are no longer asked. Takes a reference to archive, responses
+ * still sending from the one it replaces keep that alive.
+ */
+void FileCache_use_archive(FileCache* cache, Archive* archive);
+
+// switches to an archive renamed over the one in use, looks at most every WS_ARCHIVE_CHECK_MS
+void FileCache_check_archive(FileCache* cache);
+
+// entity_header() of the file, built once when it was cached, size 0 if the type is unknown
+StringView CachedFile_entity(const CachedFile* ref);
+
+#endif
@@ -0,0 +1,245 @@
+#include "fs_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// bounded multi producer multi consumer queue, Vyukov style
+typedef struct {
+    atomic_size_t seq;
+    FsJob* job;
+} Cell;
+
+typedef struct {
+    Cell* cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} JobQueue;
+
+struct FsPool {
+    JobQueue submit;
+    JobQueue done;
+    sem_t pending;
+    int efd;
+    atomic_bool notified;
+
+    // written by the submitting thread only
+    uint64_t submitted;
+    uint64_t inline_fallbacks;
+    uint64_t max_depth;
+
+    atomic_uint_fast64_t completed;
+    atomic_uint_fast64_t wait_ns_total;
+    atomic_uint_fast64_t wait_ns_max;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int JobQueue_init(JobQueue* q, size_t capacity)
+{
+    q->cells = calloc(capacity, sizeof(Cell));
+    if (q->cells == NULL) {
+        return -1;
+    }
+    q->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&q->cells[i].seq, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 0;
+}
+
+static bool JobQueue_push(JobQueue* q, FsJob* job)
+{
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    Cell* cell;
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed
+                )) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->job = job;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static FsJob* JobQueue_pop(JobQueue* q)
+{
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    Cell* cell;
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed
+                )) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL; // empty
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    FsJob* job = cell->job;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return job;
+}
+
+static size_t JobQueue_depth(JobQueue* q)
+{
+    return atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed) -
+           atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+}
+
+static void record_wait(FsPool* pool, uint64_t wait)
+{
+    atomic_fetch_add_explicit(&pool->wait_ns_total, wait, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&pool->wait_ns_max, memory_order_relaxed);
+    while (wait > max &&
+           !atomic_compare_exchange_weak_explicit(&pool->wait_ns_max, &max, wait, memory_order_relaxed, memory_order_relaxed)
+    ) {
+    }
+}
+
+static void* fs_thread(void* arg)
+{
+    FsPool* pool = arg;
+    while (1) {
+        if (sem_wait(&pool->pending) < 0) {
+            continue; // EINTR
+        }
+        FsJob* job = JobQueue_pop(&pool->submit);
+        if (job == NULL) {
+            continue;
+        }
+        record_wait(pool, now_ns() - job->submitted_ns);
+
+        job->result = file_open(job->path, job->want_fd);
+
+        // done has the same capacity as submit so this can not fail
+        JobQueue_push(&pool->done, job);
+        atomic_fetch_add_explicit(&pool->completed, 1, memory_order_relaxed);
+        if (!atomic_exchange(&pool->notified, true)) {
+            uint64_t one = 1;
+            ssize_t rv = write(pool->efd, &one, sizeof(one));
+            (void)rv;
+        }
+    }
+    return NULL;
+}
+
+FsPool* FsPool_create(int threads, size_t capacity)
+{
+    size_t cap = 2;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    FsPool* pool = calloc(1, sizeof(FsPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    if (JobQueue_init(&pool->submit, cap) < 0 || JobQueue_init(&pool->done, cap) < 0) {
+        goto fail;
+    }
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->efd < 0) {
+        goto fail;
+    }
+    sem_init(&pool->pending, 0, 0);
+    atomic_init(&pool->notified, false);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        int rv = pthread_create(&tid, NULL, fs_thread, pool);
+        if (rv != 0) {
+            DebugErr("pthread_create() %s\n", strerror(rv));
+            if (i == 0) {
+                close(pool->efd);
+                goto fail;
+            }
+            break;
+        }
+        pthread_detach(tid);
+    }
+    return pool;
+
+fail:
+    free(pool->submit.cells);
+    free(pool->done.cells);
+    free(pool);
+    return NULL;
+}
+
+int FsPool_eventfd(const FsPool* pool) { return pool->efd; }
+
+bool FsPool_submit(FsPool* pool, FsJob* job)
+{
+    // a job can be on both queues at once, never hand out more than done holds
+    size_t depth = JobQueue_depth(&pool->submit) + JobQueue_depth(&pool->done);
+    if (depth > pool->submit.mask) {
+        return false;
+    }
+    job->submitted_ns = now_ns();
+    if (!JobQueue_push(&pool->submit, job)) {
+        return false;
+    }
+    pool->submitted++;
+    if (depth + 1 > pool->max_depth) {
+        pool->max_depth = depth + 1;
+    }
+    sem_post(&pool->pending);
+    return true;
+}
+
+FsJob* FsPool_complete(FsPool* pool)
+{
+    if (atomic_exchange(&pool->notified, false)) {
+        // cleared before draining so a push racing with us writes again
+        uint64_t count;
+        ssize_t rv = read(pool->efd, &count, sizeof(count));
+        (void)rv;
+    }
+    return JobQueue_pop(&pool->done);
+}
+
+void FsPool_count_inline(FsPool* pool) { pool->inline_fallbacks++; }
+
+void FsPool_stats(FsPool* pool, FsPoolStats* stats)
+{
+    stats->submitted = pool->submitted;
+    stats->completed = atomic_load_explicit(&pool->completed, memory_order_relaxed);
+    stats->inline_fallbacks = pool->inline_fallbacks;
+    stats->depth = JobQueue_depth(&pool->submit);
+    stats->max_depth = pool->max_depth;
+    stats->wait_ns_total = atomic_load_explicit(&pool->wait_ns_total, memory_order_relaxed);
+    stats->wait_ns_max = atomic_load_explicit(&pool->wait_ns_max, memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+#ifndef NBH_FS_POOL_HEADER
+#define NBH_FS_POOL_HEADER
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* One blocking stat()/open() handed to the pool.
+ *
+ * The submitter owns the memory and must keep path alive until the job
+ * comes back out of FsPool_complete.
+ */
+typedef struct {
+    const char* path;
+    bool want_fd;
+    FileInfo result;
+    void* owner;
+    uint64_t submitted_ns;
+} FsJob;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t completed;
+    // jobs run by the caller because the queue was full
+    uint64_t inline_fallbacks;
+    uint64_t depth;
+    uint64_t max_depth;
+    // time from FsPool_submit until a thread picked the job up
+    uint64_t wait_ns_total;
+    uint64_t wait_ns_max;
+} FsPoolStats;
+
+typedef struct FsPool FsPool;
+
+/* Starts threads that run file_open() for submitted jobs.
+ *
+ * capacity is rounded up to a power of two and bounds both queues.
+ */
+FsPool* FsPool_create(int threads, size_t capacity);
+
+// becomes readable when finished jobs are waiting, see FsPool_complete
+int FsPool_eventfd(const FsPool* pool);
+
+// lock-free, returns false when the queue is full and the job was not taken
+bool FsPool_submit(FsPool* pool, FsJob* job);
+
+// call after the eventfd fires, drains one finished job per call or NULL
+FsJob* FsPool_complete(FsPool* pool);
+
+// the caller ran a job itself because FsPool_submit returned false
+void FsPool_count_inline(FsPool* pool);
+
+void FsPool_stats(FsPool* pool, FsPoolStats* stats);
+
+#endif
@@ -0,0 +1,1033 @@
+#define _GNU_SOURCE
+
+#include "h2.h"
+#include "hpack.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+
+// the part of the preface that is a request line to HttpParser
+#define H2_PREFACE_LINE "PRI * HTTP/2.0\r\n"
+#define H2_PREFACE_LINE_SIZE 16
+
+#define FRAME_HEADER 9
+
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define ERR_NO_ERROR 0x0
+#define ERR_PROTOCOL 0x1
+#define ERR_INTERNAL 0x2
+#define ERR_FLOW_CONTROL 0x3
+#define ERR_FRAME_SIZE 0x6
+#define ERR_REFUSED_STREAM 0x7
+#define ERR_COMPRESSION 0x9
+
+#define WINDOW_DEFAULT 65535
+#define WINDOW_MAX 0x7fffffff
+
+// free room in out before an incoming frame is taken, enough for everything it can be answered with
+#define OUT_RESERVE 2048
+
+// kept free behind copied DATA for the RST_STREAM that may end its stream
+#define OUT_MARGIN 64
+
+// the HTTP/1 form of one response header, error body or a Location up to a whole uri included
+#define TEXT_MAX 2048
+
+// error pages are smaller than this
+#define SMALL_BODY_MAX 256
+
+typedef struct {
+    uint32_t id; // 0 for a free slot
+    int64_t window;
+    // the client sent END_STREAM
+    bool remote_closed;
+
+    // body still to send, from fd when from_file, otherwise from small
+    bool from_file;
+    // DATA is copied into out rather than sent with sendfile()
+    bool copy;
+    int fd;
+    CachedFile* file;
+    off_t offset;
+    size_t remaining;
+    // for metrics_done(), code 0 until the stream was answered
+    uint32_t code;
+    int content_type;
+    uint64_t started_ns;
+    char small[SMALL_BODY_MAX];
+    // while access logging is on, filled in when the stream is answered
+    AccessRecord log;
+} H2Stream;
+
+// what the fields of one header block said, turned into an HttpRequest
+typedef struct {
+    HttpRequest request;
+    char method[16];
+    size_t method_len;
+    char path[WS_URI_BUFFER_SIZE];
+    size_t path_len;
+    bool path_long;
+    // unknown or misplaced pseudo header
+    bool malformed;
+    bool regular_seen;
+} RequestFields;
+
+struct H2Session {
+    H2Stream streams[H2_MAX_STREAMS];
+    unsigned open;
+    // where the round robin between streams with DATA picks up
+    unsigned next;
+    // highest stream the client opened
+    uint32_t last_stream;
+    // connection flow control window and what the peer gives each stream
+    int64_t window;
+    int64_t initial_window;
+    uint32_t max_frame;
+    bool preface;
+    // no new streams, the connection goes once the open ones are done
+    bool goaway;
+    // a GOAWAY with an error is queued, the connection goes once it is out
+    bool failed;
+
+    // header block being collected across CONTINUATION frames, 0 when none
+    uint32_t block_stream;
+    bool block_end_stream;
+    size_t block_len;
+    uint8_t block[H2_BLOCK_MAX];
+    HpackDecoder hpack;
+    RequestFields fields;
+
+    size_t in_len;
+    uint8_t in[FRAME_HEADER + H2_FRAME_MAX];
+
+    size_t out_len;
+    size_t out_sent;
+    uint8_t out[H2_OUT_SIZE];
+    // DATA payload sent with sendfile() once out is, nothing is added to out meanwhile
+    int tail_fd;
+    off_t tail_offset;
+    size_t tail_len;
+    // stream whose body ends with the tail
+    H2Stream* tail_end;
+};
+
+static uint32_t read_u32(const uint8_t* p) { return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static void put_frame_header(uint8_t* p, uint32_t len, uint8_t type, uint8_t flags, uint32_t id)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, id);
+}
+
+// out always has room for the control frames, see OUT_RESERVE and OUT_MARGIN
+static void queue_frame(H2Session* h2, uint8_t type, uint8_t flags, uint32_t id, const void* payload, uint32_t len)
+{
+    put_frame_header(h2->out + h2->out_len, len, type, flags, id);
+    memcpy(h2->out + h2->out_len + FRAME_HEADER, payload, len);
+    h2->out_len += FRAME_HEADER + len;
+}
+
+static void queue_u32(H2Session* h2, uint8_t type, uint32_t id, uint32_t value)
+{
+    uint8_t payload[4];
+    put_u32(payload, value);
+    queue_frame(h2, type, 0, id, payload, 4);
+}
+
+static void connection_error(H2Session* h2, uint32_t code)
+{
+    if (h2->failed) {
+        return;
+    }
+    uint8_t payload[8];
+    put_u32(payload, h2->last_stream);
+    put_u32(payload + 4, code);
+    queue_frame(h2, FRAME_GOAWAY, 0, 0, payload, 8);
+    DebugErr("%i: HTTP/2 connection error %u\n", getpid(), code);
+    h2->failed = true;
+    h2->goaway = true;
+}
+
+static H2Stream* find_stream(H2Session* h2, uint32_t id)
+{
+    for (unsigned i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h2->streams[i].id == id) {
+            return &h2->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void release_file(Connection* conn, int fd, CachedFile* file)
+{
+    if (file) {
+        FileCache_release(conn->files, file);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// frees the slot of s, telling the client to stop sending when it has not finished
+static void stream_done(H2Session* h2, Connection* conn, H2Stream* s)
+{
+    if (!s->remote_closed) {
+        queue_u32(h2, FRAME_RST_STREAM, s->id, ERR_NO_ERROR);
+    }
+    if (s->from_file) {
+        release_file(conn, s->fd, s->file);
+    }
+    if (s->code) {
+        uint64_t duration = metrics_clock() - s->started_ns;
+        metrics_done(s->code, s->content_type, duration);
+        accesslog_append(&s->log, s->code, duration);
+    }
+    s->id = 0;
+    h2->open--;
+}
+
+static void reset_stream(H2Session* h2, Connection* conn, H2Stream* s, uint32_t code)
+{
+    queue_u32(h2, FRAME_RST_STREAM, s->id, code);
+    s->remote_closed = true;
+    stream_done(h2, conn, s);
+}
+
+static bool name_is(const char* name, size_t len, const char* literal)
+{
+    return len == strlen(literal) && memcmp(name, literal, len) == 0;
+}
+
+static void request_field(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    RequestFields* f = ctx;
+    StringView v = {value, value_len};
+    if (name_len > 0 && name[0] == ':') {
+        if (f->regular_seen) {
+            f->malformed = true;
+        } else if (name_is(name, name_len, ":method")) {
+            if (value_len >= sizeof(f->method) || value_len == 0) {
+                f->malformed = true;
+                return;
+            }
+            memcpy(f->method, value, value_len);
+            f->method_len = value_len;
+        } else if (name_is(name, name_len, ":path")) {
+            if (value_len >= sizeof(f->path)) {
+                f->path_long = true;
+                return;
+            }
+            memcpy(f->path, value, value_len);
+            f->path_len = value_len;
+        } else if (name_is(name, name_len, ":authority")) {
+            HttpHeaders_add(&f->request.headers, "host", 4, v);
+        } else if (!name_is(name, name_len, ":scheme")) {
+            f->malformed = true;
+        }
+        return;
+    }
+    f->regular_seen = true;
+    if (name_is(name, name_len, "range") && memchr(value, ',', value_len)) {
+        // one range at most, several would need a multipart body
+        return;
+    }
+    HttpHeaders_add(&f->request.headers, name, name_len, v);
+}
+
+// the request line HttpResponse_begin expects from the pseudo headers
+static void fields_to_line(RequestFields* f)
+{
+    if (f->path_long) {
+        f->request.line.method = REQ_ERROR_URI_SIZE;
+        return;
+    }
+    char line[sizeof(f->method) + sizeof(f->path) + 16];
+    int n = snprintf(line, sizeof(line), "%.*s %.*s HTTP/1.1", (int)f->method_len, f->method, (int)f->path_len,
+                     f->path);
+    f->request.line = HttpRequestLine_parse(line, n);
+    f->request.headers.connection = REQ_CONNECTION_KEEP_ALIVE;
+}
+
+// file_open() through the file cache, switching to a sidecar the client takes
+static FileInfo stream_file(Connection* conn, HttpRequest* req, CachedFile** ref)
+{
+    bool want_fd = req->line.method == REQ_METHOD_GET;
+    uint8_t accept = accepted_encodings(req);
+    while (true) {
+        FileInfo file;
+        *ref = NULL;
+        if (conn->files == NULL || !FileCache_get(conn->files, req->line.uri, want_fd, &file, ref)) {
+            file = file_open(req->line.uri, want_fd);
+            if (conn->files) {
+                FileCache_put(conn->files, req->line.uri, &file, ref);
+            }
+        }
+        uint8_t available = file.err == 0 ? accept & file.encodings : 0;
+        accept = 0;
+        if (available == 0 || sidecar_path(req->line.uri, available) == 0) {
+            return file;
+        }
+        release_file(conn, file.fd, *ref);
+    }
+}
+
+/* Re-encodes the header lines of an HTTP/1 response head as a header
+ * block, leaving out the ones HTTP/2 forbids. Returns its length, 0 when
+ * it does not fit.
+ */
+static size_t encode_head(const char* text, size_t head_len, uint32_t code, uint8_t* out, size_t room)
+{
+    size_t n = hpack_encode_status(out, room, code);
+    if (n == 0) {
+        return 0;
+    }
+    const char* end = text + head_len;
+    const char* line = memchr(text, '\n', head_len) + 1;
+    while (line < end) {
+        const char* eol = memchr(line, '\r', end - line);
+        const char* colon = memchr(line, ':', eol - line);
+        if (colon == NULL || colon - line > 64) {
+            return 0;
+        }
+        char name[64];
+        size_t name_len = colon - line;
+        for (size_t i = 0; i < name_len; i++) {
+            name[i] = line[i] >= 'A' && line[i] <= 'Z' ? line[i] + 32 : line[i];
+        }
+        const char* value = colon + 1;
+        while (value < eol && *value == ' ') {
+            value++;
+        }
+        line = eol + 2;
+        if (name_is(name, name_len, "connection") || name_is(name, name_len, "keep-alive")) {
+            continue;
+        }
+        size_t k = hpack_encode_field(out + n, room - n, name, name_len, value, eol - value);
+        if (k == 0) {
+            return 0;
+        }
+        n += k;
+    }
+    return n;
+}
+
+// answers the request in h2->fields on s with a HEADERS frame and sets up its body
+static void respond(H2Session* h2, Connection* conn, H2Stream* s)
+{
+    HttpRequest* req = &h2->fields.request;
+    HttpResponse resp;
+    char text[TEXT_MAX];
+    CachedFile* ref = NULL;
+    uint64_t started = metrics_clock();
+    int content_type = -1;
+    if (accesslog_on()) {
+        s->log = conn->log;
+        accesslog_request(&s->log, req);
+        s->log.version = REQ_VERSION_2_0;
+    }
+    if (!HttpResponse_begin(req, &resp, text)) {
+        FileInfo file = stream_file(conn, req, &ref);
+        content_type = file.err == 0 ? file.content_type : -1;
+        StringView entity = {};
+        if (ref && file.err == 0) {
+            entity = CachedFile_entity(ref);
+        }
+        HttpResponse_finish(req, &file, entity, &resp, text);
+        if (resp.fd < 0 && file.fd >= 0) {
+            release_file(conn, file.fd, ref);
+            ref = NULL;
+        }
+    }
+    DebugMsg("%i: %s%i%s %-48s Stream: %u\n", getpid(), resp.code < 400 ? "\e[32m" : "\e[31m", resp.code, "\e[0m",
+             req->line.uri, s->id);
+
+    const char* blank = memmem(text, resp.header_size, "\r\n\r\n", 4);
+    size_t head_len = blank - text + 2;
+    size_t body_start = head_len + 2;
+
+    s->from_file = resp.fd >= 0;
+    s->fd = resp.fd;
+    s->file = ref;
+    if (s->from_file) {
+        s->offset = resp.file_offset;
+        s->remaining = resp.file_size;
+        s->copy = resp.file_size <= H2_COPY_MAX;
+    } else {
+        s->offset = 0;
+        s->remaining = resp.header_size - body_start;
+        s->copy = true;
+        if (s->remaining > sizeof(s->small)) {
+            s->remaining = 0;
+        }
+        memcpy(s->small, text + body_start, s->remaining);
+    }
+
+    uint8_t* frame = h2->out + h2->out_len;
+    size_t room = H2_OUT_SIZE - h2->out_len - FRAME_HEADER;
+    size_t n = encode_head(text, head_len, resp.code, frame + FRAME_HEADER, room < h2->max_frame ? room : h2->max_frame);
+    if (n == 0) {
+        reset_stream(h2, conn, s, ERR_INTERNAL);
+        return;
+    }
+    bool end = s->remaining == 0;
+    put_frame_header(frame, n, FRAME_HEADERS, FLAG_END_HEADERS | (end ? FLAG_END_STREAM : 0), s->id);
+    h2->out_len += FRAME_HEADER + n;
+    s->code = resp.code;
+    s->content_type = content_type;
+    s->started_ns = started;
+    uint64_t first_byte = metrics_clock() - started;
+    metrics_first_byte(resp.code, content_type, first_byte);
+    if (accesslog_on()) {
+        s->log.bytes = FRAME_HEADER + n + s->remaining;
+        s->log.first_byte_us = first_byte / 1000;
+    }
+    if (end) {
+        stream_done(h2, conn, s);
+    }
+}
+
+static int apply_setting(H2Session* h2, uint16_t key, uint32_t value)
+{
+    switch (key) {
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+        if (value > WINDOW_MAX) {
+            connection_error(h2, ERR_FLOW_CONTROL);
+            return -1;
+        }
+        // applies to the windows of open streams too
+        for (unsigned i = 0; i < H2_MAX_STREAMS; i++) {
+            h2->streams[i].window += (int64_t)value - h2->initial_window;
+        }
+        h2->initial_window = value;
+        break;
+    case SETTINGS_MAX_FRAME_SIZE:
+        if (value < 16384 || value > 16777215) {
+            connection_error(h2, ERR_PROTOCOL);
+            return -1;
+        }
+        h2->max_frame = value < H2_FRAME_MAX ? value : H2_FRAME_MAX;
+        break;
+    }
+    return 0;
+}
+
+static int apply_settings(H2Session* h2, const uint8_t* payload, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        if (apply_setting(h2, payload[i] << 8 | payload[i + 1], read_u32(payload + i + 2)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void open_stream(H2Session* h2, Connection* conn, uint32_t id, bool end_stream)
+{
+    if (id <= h2->last_stream) {
+        // streams are opened in order and never reopened
+        connection_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    h2->last_stream = id;
+    if (h2->goaway) {
+        return;
+    }
+    H2Stream* s = find_stream(h2, 0);
+    if (s == NULL) {
+        queue_u32(h2, FRAME_RST_STREAM, id, ERR_REFUSED_STREAM);
+        return;
+    }
+    memset(s, 0, offsetof(H2Stream, small));
+    s->id = id;
+    s->window = h2->initial_window;
+    s->remote_closed = end_stream;
+    s->fd = -1;
+    h2->open++;
+
+    RequestFields* f = &h2->fields;
+    if (f->malformed || f->method_len == 0 || (f->path_len == 0 && !f->path_long)) {
+        reset_stream(h2, conn, s, ERR_PROTOCOL);
+        return;
+    }
+    fields_to_line(f);
+    respond(h2, conn, s);
+}
+
+// the header block in h2->block is complete
+static void end_block(H2Session* h2, Connection* conn)
+{
+    uint32_t id = h2->block_stream;
+    h2->block_stream = 0;
+    RequestFields* f = &h2->fields;
+    memset(&f->request.headers, 0, offsetof(HttpHeaders, buffer));
+    f->method_len = 0;
+    f->path_len = 0;
+    f->path_long = false;
+    f->malformed = false;
+    f->regular_seen = false;
+    if (HpackDecoder_decode(&h2->hpack, h2->block, h2->block_len, request_field, f) < 0) {
+        connection_error(h2, ERR_COMPRESSION);
+        return;
+    }
+    H2Stream* s = find_stream(h2, id);
+    if (s) {
+        // trailers, nothing in them matters to a GET
+        s->remote_closed |= h2->block_end_stream;
+        return;
+    }
+    open_stream(h2, conn, id, h2->block_end_stream);
+}
+
+// strips padding and the priority fields off a DATA or HEADERS payload, false when they do not fit
+static bool unpad(uint8_t flags, bool priority, const uint8_t** payload, uint32_t* len)
+{
+    size_t pad = 0;
+    size_t skip = 0;
+    if (flags & FLAG_PADDED) {
+        if (*len < 1) {
+            return false;
+        }
+        pad = (*payload)[0];
+        skip = 1;
+    }
+    if (priority && (flags & FLAG_PRIORITY)) {
+        skip += 5;
+    }
+    if (skip + pad > *len) {
+        return false;
+    }
+    *payload += skip;
+    *len -= skip + pad;
+    return true;
+}
+
+static void append_block(H2Session* h2, Connection* conn, uint8_t flags, const uint8_t* payload, uint32_t len)
+{
+    if (h2->block_len + len > sizeof(h2->block)) {
+        connection_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    memcpy(h2->block + h2->block_len, payload, len);
+    h2->block_len += len;
+    if (flags & FLAG_END_HEADERS) {
+        end_block(h2, conn);
+    }
+}
+
+static void on_frame(H2Session* h2, Connection* conn, uint8_t type, uint8_t flags, uint32_t id,
+                     const uint8_t* payload, uint32_t len)
+{
+    if (h2->block_stream != 0 && (type != FRAME_CONTINUATION || id != h2->block_stream)) {
+        // nothing may come between the frames of a header block
+        connection_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    H2Stream* s = id != 0 ? find_stream(h2, id) : NULL;
+    switch (type) {
+    case FRAME_DATA:
+        if (id == 0 || id > h2->last_stream) {
+            connection_error(h2, ERR_PROTOCOL);
+            return;
+        }
+        if (len > 0) {
+            // request bodies are dropped, all the client is owed is its window back
+            queue_u32(h2, FRAME_WINDOW_UPDATE, 0, len);
+        }
+        if (s && (flags & FLAG_END_STREAM)) {
+            s->remote_closed = true;
+        }
+        break;
+    case FRAME_HEADERS:
+        if (id == 0 || id % 2 == 0 || !unpad(flags, true, &payload, &len)) {
+            connection_error(h2, ERR_PROTOCOL);
+            return;
+        }
+        h2->block_stream = id;
+        h2->block_end_stream = flags & FLAG_END_STREAM;
+        h2->block_len = 0;
+        append_block(h2, conn, flags, payload, len);
+        break;
+    case FRAME_CONTINUATION:
+        if (h2->block_stream == 0) {
+            connection_error(h2, ERR_PROTOCOL);
+            return;
+        }
+        append_block(h2, conn, flags, payload, len);
+        break;
+    case FRAME_PRIORITY:
+        // every stream gets the same share
+        if (id == 0) {
+            connection_error(h2, ERR_PROTOCOL);
+        }
+        break;
+    case FRAME_RST_STREAM:
+        if (id == 0 || len != 4) {
+            connection_error(h2, id == 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE);
+            return;
+        }
+        if (s) {
+            s->remote_closed = true;
+            stream_done(h2, conn, s);
+        }
+        break;
+    case FRAME_SETTINGS:
+        if (id != 0 || (flags & FLAG_ACK ? len != 0 : len % 6 != 0)) {
+            connection_error(h2, id != 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE);
+            return;
+        }
+        if (!(flags & FLAG_ACK) && apply_settings(h2, payload, len) == 0) {
+            queue_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        }
+        break;
+    case FRAME_PUSH_PROMISE:
+        connection_error(h2, ERR_PROTOCOL);
+        break;
+    case FRAME_PING:
+        if (id != 0 || len != 8) {
+            connection_error(h2, id != 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE);
+            return;
+        }
+        if (!(flags & FLAG_ACK)) {
+            queue_frame(h2, FRAME_PING, FLAG_ACK, 0, payload, 8);
+        }
+        break;
+    case FRAME_GOAWAY:
+        h2->goaway = true;
+        break;
+    case FRAME_WINDOW_UPDATE: {
+        if (len != 4) {
+            connection_error(h2, ERR_FRAME_SIZE);
+            return;
+        }
+        uint32_t increment = read_u32(payload) & 0x7fffffff;
+        if (id == 0) {
+            h2->window += increment;
+            if (increment == 0 || h2->window > WINDOW_MAX) {
+                connection_error(h2, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+            }
+        } else if (s) {
+            s->window += increment;
+            if (increment == 0 || s->window > WINDOW_MAX) {
+                reset_stream(h2, conn, s, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+            }
+        }
+        break;
+    }
+    default:
+        // unknown frame types are ignored
+        break;
+    }
+}
+
+// takes the complete frames in h2->in while out has room for their answers, true when any was taken
+static bool take_frames(H2Session* h2, Connection* conn)
+{
+    size_t pos = 0;
+    bool progress = false;
+    while (!h2->failed && h2->tail_len == 0 && H2_OUT_SIZE - h2->out_len >= OUT_RESERVE) {
+        const uint8_t* f = h2->in + pos;
+        size_t avail = h2->in_len - pos;
+        if (!h2->preface) {
+            if (avail < H2_PREFACE_SIZE) {
+                break;
+            }
+            if (memcmp(f, H2_PREFACE, H2_PREFACE_SIZE) != 0) {
+                connection_error(h2, ERR_PROTOCOL);
+                break;
+            }
+            h2->preface = true;
+            pos += H2_PREFACE_SIZE;
+            progress = true;
+            continue;
+        }
+        if (avail < FRAME_HEADER) {
+            break;
+        }
+        uint32_t len = f[0] << 16 | f[1] << 8 | f[2];
+        if (len > H2_FRAME_MAX) {
+            connection_error(h2, ERR_FRAME_SIZE);
+            break;
+        }
+        if (avail < FRAME_HEADER + len) {
+            break;
+        }
+        on_frame(h2, conn, f[3], f[4], read_u32(f + 5) & 0x7fffffff, f + FRAME_HEADER, len);
+        pos += FRAME_HEADER + len;
+        progress = true;
+    }
+    memmove(h2->in, h2->in + pos, h2->in_len - pos);
+    h2->in_len -= pos;
+    return progress;
+}
+
+static bool sendable(const H2Session* h2, const H2Stream* s)
+{
+    return s->id != 0 && s->remaining > 0 && s->window > 0 && h2->window > 0;
+}
+
+static bool has_data(const H2Session* h2)
+{
+    for (unsigned i = 0; i < H2_MAX_STREAMS; i++) {
+        if (sendable(h2, &h2->streams[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Adds DATA frames to out, one per stream in turn, until out or a flow
+ * control window is full, conn->deficit is spent or a frame needs its
+ * payload sent with sendfile().
+ */
+static void produce(H2Session* h2, Connection* conn)
+{
+    // after a 101 the body of stream 1 waits for the client preface, some clients only buffer so much behind it
+    while (h2->preface && h2->tail_len == 0 && conn->deficit > 0) {
+        H2Stream* s = NULL;
+        for (unsigned i = 0; i < H2_MAX_STREAMS && s == NULL; i++) {
+            unsigned k = (h2->next + i) % H2_MAX_STREAMS;
+            if (sendable(h2, &h2->streams[k])) {
+                s = &h2->streams[k];
+                h2->next = (k + 1) % H2_MAX_STREAMS;
+            }
+        }
+        size_t room = H2_OUT_SIZE - h2->out_len;
+        if (s == NULL || room < FRAME_HEADER + OUT_MARGIN + (s->copy ? 512 : 0)) {
+            return;
+        }
+        size_t len = s->remaining;
+        len = len < h2->max_frame ? len : h2->max_frame;
+        len = len < (size_t)h2->window ? len : (size_t)h2->window;
+        len = len < (size_t)s->window ? len : (size_t)s->window;
+        len = len < conn->deficit ? len : conn->deficit;
+        if (s->copy && len > room - FRAME_HEADER - OUT_MARGIN) {
+            len = room - FRAME_HEADER - OUT_MARGIN;
+        }
+        uint8_t* frame = h2->out + h2->out_len;
+        if (s->copy && s->from_file) {
+            ssize_t rv = pread(s->fd, frame + FRAME_HEADER, len, s->offset);
+            if (rv <= 0) {
+                DebugErr("%i: pread() for stream %u failed\n", getpid(), s->id);
+                reset_stream(h2, conn, s, ERR_INTERNAL);
+                continue;
+            }
+            len = rv;
+        } else if (s->copy) {
+            memcpy(frame + FRAME_HEADER, s->small + s->offset, len);
+        }
+        bool end = s->remaining == len;
+        put_frame_header(frame, len, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id);
+        h2->out_len += FRAME_HEADER;
+        if (s->copy) {
+            h2->out_len += len;
+        } else {
+            h2->tail_fd = s->fd;
+            h2->tail_offset = s->offset;
+            h2->tail_len = len;
+        }
+        s->offset += len;
+        s->remaining -= len;
+        s->window -= len;
+        h2->window -= len;
+        conn->deficit -= len;
+        if (end && s->copy) {
+            stream_done(h2, conn, s);
+        } else if (end) {
+            h2->tail_end = s;
+        }
+    }
+}
+
+// 1 once out and the tail are sent, 0 when the socket is full, -1 on failure
+static int flush(H2Session* h2, Connection* conn)
+{
+    while (h2->out_sent < h2->out_len) {
+        int flags = MSG_NOSIGNAL | (h2->tail_len > 0 ? MSG_MORE : 0);
+        ssize_t rv = send(conn->fd, h2->out + h2->out_sent, h2->out_len - h2->out_sent, flags);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                int en = errno;
+                DebugErr("%i: send() %s\n", getpid(), strerror(en));
+                return -1;
+            }
+            // make room for more frames behind what is left
+            memmove(h2->out, h2->out + h2->out_sent, h2->out_len - h2->out_sent);
+            h2->out_len -= h2->out_sent;
+            h2->out_sent = 0;
+            return 0;
+        }
+        h2->out_sent += rv;
+    }
+    h2->out_len = 0;
+    h2->out_sent = 0;
+    while (h2->tail_len > 0) {
+        ssize_t rv = sendfile(conn->fd, h2->tail_fd, &h2->tail_offset, h2->tail_len);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            int en = errno;
+            DebugErr("%i: sendfile() %s\n", getpid(), strerror(en));
+            return -1;
+        } else if (rv == 0) {
+            // the file shrank, the frame can not be completed
+            return -1;
+        }
+        h2->tail_len -= rv;
+    }
+    if (h2->tail_end) {
+        stream_done(h2, conn, h2->tail_end);
+        h2->tail_end = NULL;
+    }
+    return 1;
+}
+
+// 1 when bytes came in, 0 when there were none or in is full, -1 once the peer is gone
+static int fill(H2Session* h2, Connection* conn)
+{
+    int got = 0;
+    while (h2->in_len < sizeof(h2->in)) {
+        ssize_t rv = recv(conn->fd, h2->in + h2->in_len, sizeof(h2->in) - h2->in_len, 0);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return got;
+            }
+            int en = errno;
+            DebugErr("%i: recv() %s\n", getpid(), strerror(en));
+            return -1;
+        } else if (rv == 0) {
+            return -1;
+        }
+        h2->in_len += rv;
+        got = 1;
+    }
+    return got;
+}
+
+static int base64url_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    } else if (c == '-' || c == '+') {
+        return 62;
+    } else if (c == '_' || c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+// applies the SETTINGS payload an upgrade request carries in HTTP2-Settings
+static int upgrade_settings(H2Session* h2, StringView value)
+{
+    uint8_t payload[96];
+    size_t len = 0;
+    uint32_t bits = 0;
+    int count = 0;
+    for (size_t i = 0; i < value.size && value.ptr[i] != '='; i++) {
+        int v = base64url_value(value.ptr[i]);
+        if (v < 0) {
+            return -1;
+        }
+        bits = bits << 6 | v;
+        count += 6;
+        if (count >= 8) {
+            if (len == sizeof(payload)) {
+                return -1;
+            }
+            count -= 8;
+            payload[len++] = bits >> count;
+        }
+    }
+    if (len % 6 != 0) {
+        return -1;
+    }
+    return apply_settings(h2, payload, len);
+}
+
+static bool has_token(StringView list, const char* token)
+{
+    size_t len = strlen(token);
+    for (size_t i = 0; i + len <= list.size; i++) {
+        bool start = i == 0 || list.ptr[i - 1] == ',' || list.ptr[i - 1] == ' ';
+        bool end = i + len == list.size || list.ptr[i + len] == ',' || list.ptr[i + len] == ' ';
+        if (start && end && strncasecmp(list.ptr + i, token, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// an HTTP/1.1 GET or HEAD without a body asking for h2c
+static bool wants_upgrade(const HttpRequest* req)
+{
+    const HttpHeaders* h = &req->headers;
+    return req->line.version == REQ_VERSION_1_1 &&
+           (req->line.method == REQ_METHOD_GET || req->line.method == REQ_METHOD_HEAD) &&
+           has_token(HttpHeaders_get(h, HDR_UPGRADE), "h2c") && HttpHeaders_get(h, HDR_HTTP2_SETTINGS).size > 0 &&
+           HttpHeaders_get(h, HDR_CONTENT_LENGTH).size == 0;
+}
+
+bool H2Session_start(Connection* conn)
+{
+    if (!conn->h2c || conn->queue_len > 0) {
+        return false;
+    }
+    HttpRequest* req = &conn->parser.request;
+    bool prior = conn->requests == 0 && conn->recv_len >= H2_PREFACE_LINE_SIZE &&
+                 memcmp(conn->recv_buff, H2_PREFACE_LINE, H2_PREFACE_LINE_SIZE) == 0;
+    if (!prior && !wants_upgrade(req)) {
+        return false;
+    }
+    H2Session* h2 = malloc(sizeof(H2Session));
+    if (h2 == NULL) {
+        return false;
+    }
+    memset(h2, 0, offsetof(H2Session, block));
+    HpackDecoder_init(&h2->hpack);
+    h2->window = WINDOW_DEFAULT;
+    h2->initial_window = WINDOW_DEFAULT;
+    h2->max_frame = H2_FRAME_MAX;
+    h2->in_len = 0;
+    h2->out_len = 0;
+    h2->out_sent = 0;
+    h2->tail_fd = -1;
+    h2->tail_len = 0;
+    h2->tail_end = NULL;
+
+    size_t consumed = 0;
+    if (!prior) {
+        if (upgrade_settings(h2, HttpHeaders_get(&req->headers, HDR_HTTP2_SETTINGS)) < 0) {
+            // answered as HTTP/1.1
+            free(h2);
+            return false;
+        }
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        memcpy(h2->out, switching, sizeof(switching) - 1);
+        h2->out_len = sizeof(switching) - 1;
+        consumed = conn->parser.head_len;
+        h2->fields.request = *req;
+    }
+    uint8_t settings[6] = {0, SETTINGS_MAX_CONCURRENT_STREAMS};
+    put_u32(settings + 2, H2_MAX_STREAMS);
+    queue_frame(h2, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    // the preface, or what followed the upgrade request, is read again as frames
+    _Static_assert(WS_RECV_BUFFER_MAX <= FRAME_HEADER + H2_FRAME_MAX, "recv_buffer must fit in h2->in");
+    memcpy(h2->in, conn->recv_buff + consumed, conn->recv_len - consumed);
+    h2->in_len = conn->recv_len - consumed;
+    conn->recv_len = 0;
+    HttpParser_init(&conn->parser);
+    conn->parser.limit = conn->recv_size;
+    conn->h2 = h2;
+    conn->state = CONN_H2;
+    DebugMsg("%i: HTTP/2 %s\n", getpid(), prior ? "with prior knowledge" : "upgrade");
+
+    if (!prior) {
+        // the upgrade request is stream 1, already half closed
+        RequestFields* f = &h2->fields;
+        f->malformed = false;
+        f->method_len = 0;
+        f->path_len = 0;
+        f->path_long = false;
+        H2Stream* s = &h2->streams[0];
+        memset(s, 0, offsetof(H2Stream, small));
+        s->id = 1;
+        s->window = h2->initial_window;
+        s->remote_closed = true;
+        s->fd = -1;
+        h2->open = 1;
+        h2->last_stream = 1;
+        respond(h2, conn, s);
+    }
+    return true;
+}
+
+int H2Session_drive(Connection* conn)
+{
+    H2Session* h2 = conn->h2;
+    while (true) {
+        bool progress = take_frames(h2, conn);
+        produce(h2, conn);
+        int sent = flush(h2, conn);
+        if (sent < 0) {
+            return -1;
+        } else if (sent > 0 && (h2->failed || (h2->goaway && h2->open == 0))) {
+            return -1;
+        } else if (sent > 0 && conn->deficit == 0 && has_data(h2)) {
+            return 2;
+        }
+        int got = fill(h2, conn);
+        if (got < 0) {
+            return -1;
+        }
+        if (!progress && got == 0 && (sent == 0 || !has_data(h2))) {
+            return 0;
+        }
+    }
+}
+
+void H2Session_destroy(H2Session* h2, Connection* conn)
+{
+    for (unsigned i = 0; i < H2_MAX_STREAMS; i++) {
+        H2Stream* s = &h2->streams[i];
+        if (s->id != 0 && s->from_file) {
+            release_file(conn, s->fd, s->file);
+        }
+    }
+    free(h2);
+}
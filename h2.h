@@ -0,0 +1,52 @@
+#ifndef NBH_H2_HEADER
+#define NBH_H2_HEADER
+
+#include "connection.h"
+
+#include <stdbool.h>
+
+// SETTINGS_MAX_CONCURRENT_STREAMS, streams past it are refused
+#define H2_MAX_STREAMS 32
+
+// largest frame payload sent or taken, the protocol default
+#define H2_FRAME_MAX 16384
+
+// largest request header block, HEADERS plus its CONTINUATIONs
+#define H2_BLOCK_MAX 16384
+
+// frames waiting to be written
+#define H2_OUT_SIZE (64 * 1024)
+
+// bodies up to this size are copied into DATA frames, bigger ones follow their frame header with sendfile()
+#define H2_COPY_MAX (64 * 1024)
+
+/* Cleartext HTTP/2 (h2c) for epoll engine connections.
+ *
+ * A connection switches over when it starts with the client preface (prior
+ * knowledge) or sends an HTTP/1.1 request with Upgrade: h2c. Every stream's
+ * request is turned into an HttpRequest and answered by the same code as
+ * HTTP/1, the header lines of that answer are re-encoded with HPACK and its
+ * body goes out as DATA frames inside the peer's flow control windows,
+ * round robin between the streams.
+ *
+ * Files are looked up inline, through the file cache when there is one.
+ * A Range asking for more than one range gets the whole file.
+ */
+typedef struct H2Session H2Session;
+
+/* Called with the request head the parser just finished. Switches conn to
+ * HTTP/2 and returns true when the head is the client preface or asks for
+ * the upgrade, conn->state is then CONN_H2.
+ */
+bool H2Session_start(Connection* conn);
+
+/* Runs the session until the socket would block. Returns -1 when the
+ * connection should be closed, 0 when waiting on the socket and 2 when it
+ * used up conn->deficit with DATA left to send.
+ */
+int H2Session_drive(Connection* conn);
+
+// gives back the files of open streams
+void H2Session_destroy(H2Session* h2, Connection* conn);
+
+#endif
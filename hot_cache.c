@@ -0,0 +1,287 @@
+#include "hot_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOT_BUCKETS 1024
+
+// frequency counters, halved every HOT_SKETCH_AGE misses so old popularity fades
+#define HOT_SKETCH 4096
+#define HOT_SKETCH_AGE (4 * HOT_SKETCH)
+
+struct HotEntry {
+    HotEntry* next; // hash chain
+    HotEntry* prev_used;
+    HotEntry* next_used;
+    uint64_t hash;
+
+    // the file the body was read from
+    uint64_t ino;
+    uint64_t dev;
+    int64_t mtime_ns;
+    size_t file_size;
+
+    char* data;
+    size_t size;
+    size_t map_size;
+    int refs;
+    // out of the cache, unmapped once the last reference is gone
+    bool evicted;
+    char path[];
+};
+
+struct HotCache {
+    HotEntry* buckets[HOT_BUCKETS];
+    // least recently used first
+    HotEntry* oldest;
+    HotEntry* newest;
+    uint8_t sketch[HOT_SKETCH];
+    unsigned sketch_count;
+    size_t budget;
+    size_t page_size;
+    HotCacheStats stats;
+    uint64_t last_report;
+    uint64_t reported_requests;
+};
+
+static uint64_t path_hash(const char* path)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+HotCache* HotCache_create(size_t budget)
+{
+    HotCache* cache = calloc(1, sizeof(HotCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->budget = budget;
+    cache->page_size = sysconf(_SC_PAGESIZE);
+    return cache;
+}
+
+static void lru_unlink(HotCache* cache, HotEntry* e)
+{
+    if (e->prev_used) {
+        e->prev_used->next_used = e->next_used;
+    } else {
+        cache->oldest = e->next_used;
+    }
+    if (e->next_used) {
+        e->next_used->prev_used = e->prev_used;
+    } else {
+        cache->newest = e->prev_used;
+    }
+    e->prev_used = NULL;
+    e->next_used = NULL;
+}
+
+static void lru_push(HotCache* cache, HotEntry* e)
+{
+    e->prev_used = cache->newest;
+    e->next_used = NULL;
+    if (cache->newest) {
+        cache->newest->next_used = e;
+    } else {
+        cache->oldest = e;
+    }
+    cache->newest = e;
+}
+
+static void HotEntry_free(HotEntry* e)
+{
+    munmap(e->data, e->map_size);
+    free(e);
+}
+
+static void evict(HotCache* cache, HotEntry* e)
+{
+    HotEntry** link = &cache->buckets[e->hash % HOT_BUCKETS];
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    lru_unlink(cache, e);
+    cache->stats.bytes -= e->map_size;
+    cache->stats.entries--;
+    cache->stats.evicted++;
+    if (e->refs == 0) {
+        HotEntry_free(e);
+    } else {
+        e->evicted = true;
+    }
+}
+
+void HotCache_destroy(HotCache* cache)
+{
+    while (cache->oldest) {
+        evict(cache, cache->oldest);
+    }
+    free(cache);
+}
+
+HotEntry* HotCache_get(HotCache* cache, const char* path, const FileInfo* file)
+{
+    uint64_t hash = path_hash(path);
+    HotEntry* e = cache->buckets[hash % HOT_BUCKETS];
+    while (e && (e->hash != hash || strcmp(e->path, path) != 0)) {
+        e = e->next;
+    }
+    if (e && (e->ino != file->ino || e->dev != file->dev || e->mtime_ns != file->mtime_ns ||
+              e->file_size != file->size)) {
+        // changed on disk since it was read
+        evict(cache, e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+    lru_unlink(cache, e);
+    lru_push(cache, e);
+    e->refs++;
+    cache->stats.hits++;
+    return e;
+}
+
+// true once the file has been asked for often enough lately
+static bool count_request(HotCache* cache, uint64_t hash)
+{
+    uint8_t* count = &cache->sketch[hash % HOT_SKETCH];
+    if (*count < UINT8_MAX) {
+        (*count)++;
+    }
+    if (++cache->sketch_count >= HOT_SKETCH_AGE) {
+        for (size_t i = 0; i < HOT_SKETCH; i++) {
+            cache->sketch[i] >>= 1;
+        }
+        cache->sketch_count = 0;
+    }
+    return *count >= WS_HOT_ADMIT;
+}
+
+HotEntry* HotCache_admit(HotCache* cache, const char* path, const FileInfo* file)
+{
+    if (file->fd < 0 || file->size > WS_HOT_MAX_FILE) {
+        return NULL;
+    }
+    uint64_t hash = path_hash(path);
+    if (!count_request(cache, hash)) {
+        return NULL;
+    }
+
+    char header[WS_ENTITY_HEADER_MAX];
+    size_t header_size = entity_header(file, header);
+    size_t size = header_size + file->size;
+    size_t map_size = (size + cache->page_size - 1) & ~(cache->page_size - 1);
+    if (map_size > cache->budget) {
+        return NULL;
+    }
+
+    char* data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(data, header, header_size);
+    size_t done = 0;
+    while (done < file->size) {
+        ssize_t rv = pread(file->fd, data + header_size + done, file->size - done, file->offset + done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        } else if (rv <= 0) {
+            // shrank or unreadable, leave it to sendfile()
+            munmap(data, map_size);
+            return NULL;
+        }
+        done += rv;
+    }
+    mprotect(data, map_size, PROT_READ);
+
+    size_t path_len = strlen(path);
+    HotEntry* e = malloc(sizeof(HotEntry) + path_len + 1);
+    if (e == NULL) {
+        munmap(data, map_size);
+        return NULL;
+    }
+    while (cache->oldest && cache->stats.bytes + map_size > cache->budget) {
+        evict(cache, cache->oldest);
+    }
+
+    e->hash = hash;
+    e->ino = file->ino;
+    e->dev = file->dev;
+    e->mtime_ns = file->mtime_ns;
+    e->file_size = file->size;
+    e->data = data;
+    e->size = size;
+    e->map_size = map_size;
+    e->refs = 1;
+    e->evicted = false;
+    memcpy(e->path, path, path_len + 1);
+
+    e->next = cache->buckets[hash % HOT_BUCKETS];
+    cache->buckets[hash % HOT_BUCKETS] = e;
+    lru_push(cache, e);
+    cache->stats.bytes += map_size;
+    cache->stats.entries++;
+    cache->stats.admitted++;
+    return e;
+}
+
+void HotCache_retain(HotCache* cache, HotEntry* entry)
+{
+    (void)cache;
+    entry->refs++;
+}
+
+void HotCache_release(HotCache* cache, HotEntry* entry)
+{
+    (void)cache;
+    entry->refs--;
+    if (entry->refs == 0 && entry->evicted) {
+        HotEntry_free(entry);
+    }
+}
+
+const char* HotEntry_data(const HotEntry* entry) { return entry->data; }
+
+size_t HotEntry_size(const HotEntry* entry) { return entry->size; }
+
+void HotCache_stats(const HotCache* cache, HotCacheStats* stats) { *stats = cache->stats; }
+
+void HotCache_report(HotCache* cache)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (now - cache->last_report < WS_HOT_REPORT_MS) {
+        return;
+    }
+    cache->last_report = now;
+
+    HotCacheStats* stats = &cache->stats;
+    if (stats->hits + stats->misses == cache->reported_requests) {
+        return;
+    }
+    cache->reported_requests = stats->hits + stats->misses;
+    DebugMsg(
+        "%i: hot cache hits=%lu misses=%lu admitted=%lu evicted=%lu entries=%zu bytes=%zu\n",
+        getpid(),
+        stats->hits,
+        stats->misses,
+        stats->admitted,
+        stats->evicted,
+        stats->entries,
+        stats->bytes
+    );
+}
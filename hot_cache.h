@@ -0,0 +1,71 @@
+#ifndef NBH_HOT_CACHE_HEADER
+#define NBH_HOT_CACHE_HEADER
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// bigger files are never cached and keep going out with sendfile()
+#define WS_HOT_MAX_FILE 65536
+
+// misses a file needs before it is read into the cache
+#define WS_HOT_ADMIT 2
+
+// stats are printed at most this often while the cache is in use
+#define WS_HOT_REPORT_MS 10000
+
+/* Per worker cache of small, frequently requested file bodies.
+ *
+ * Each entry is an anonymous mapping holding the entity header followed by
+ * the body, so a hit goes out as the status line plus one contiguous
+ * buffer in a single writev. Entries are keyed by path and checked against
+ * the inode, size and mtime of the FileInfo the caller looked up, so a
+ * changed file is never served from here.
+ *
+ * Only used from the thread running the event loop. Every entry handed out
+ * is a reference that must be given back with HotCache_release.
+ */
+typedef struct HotCache HotCache;
+typedef struct HotEntry HotEntry;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted;
+    uint64_t evicted;
+    size_t bytes;
+    size_t entries;
+} HotCacheStats;
+
+HotCache* HotCache_create(size_t budget);
+
+// unmaps every entry, no reference may still be held
+void HotCache_destroy(HotCache* cache);
+
+// the entry for path if it still matches file, NULL on a miss
+HotEntry* HotCache_get(HotCache* cache, const char* path, const FileInfo* file);
+
+/* Called after a miss with file->fd open.
+ *
+ * Counts the request and once the file is hot enough, and fits, reads it
+ * into a new entry. Returns that entry or NULL when it was not admitted.
+ */
+HotEntry* HotCache_admit(HotCache* cache, const char* path, const FileInfo* file);
+
+// another reference to an entry the caller already holds one of
+void HotCache_retain(HotCache* cache, HotEntry* entry);
+
+void HotCache_release(HotCache* cache, HotEntry* entry);
+
+// entity header and body, back to back
+const char* HotEntry_data(const HotEntry* entry);
+size_t HotEntry_size(const HotEntry* entry);
+
+void HotCache_stats(const HotCache* cache, HotCacheStats* stats);
+
+// prints the stats in debug builds, called from the event loop tick
+void HotCache_report(HotCache* cache);
+
+#endif
@@ -0,0 +1,416 @@
+#include "hpack.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define STATIC_COUNT 61
+
+// RFC 7541 appendix A, index 1 first
+static const char* static_table[STATIC_COUNT][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+
+/* Code lengths of RFC 7541 appendix B, EOS last. The code is canonical:
+ * codes are handed out in order of length then symbol, so the lengths are
+ * all it takes to rebuild it.
+ */
+static const uint8_t huffman_lengths[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// per code length, the first code, how many codes and where their symbols start in huffman_symbols
+static uint32_t huffman_first[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_index[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_symbols[HUFFMAN_SYMBOLS];
+
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init()
+{
+    for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        huffman_count[huffman_lengths[s]]++;
+    }
+    uint32_t code = 0;
+    uint16_t index = 0;
+    for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+        huffman_first[bits] = code;
+        huffman_index[bits] = index;
+        code = (code + huffman_count[bits]) << 1;
+        index += huffman_count[bits];
+    }
+    uint16_t next[HUFFMAN_MAX_BITS + 1];
+    memcpy(next, huffman_index, sizeof(next));
+    for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        huffman_symbols[next[huffman_lengths[s]]++] = s;
+    }
+}
+
+// -1 on a bad code, EOS, padding that is not a prefix of EOS or no room
+static int huffman_decode(const uint8_t* src, size_t len, char* dst, size_t room)
+{
+    pthread_once(&huffman_once, huffman_init);
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = code << 1 | ((src[i] >> b) & 1);
+            bits++;
+            if (code - huffman_first[bits] < huffman_count[bits]) {
+                uint16_t symbol = huffman_symbols[huffman_index[bits] + code - huffman_first[bits]];
+                if (symbol == HUFFMAN_EOS || n == room) {
+                    return -1;
+                }
+                dst[n++] = symbol;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX_BITS) {
+                return -1;
+            }
+        }
+    }
+    // at most 7 bits of padding, all ones
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+    return n;
+}
+
+static int decode_int(const uint8_t** p, const uint8_t* end, int prefix, uint32_t* value)
+{
+    if (*p == end) {
+        return -1;
+    }
+    uint32_t max = (1u << prefix) - 1;
+    uint64_t v = *(*p)++ & max;
+    if (v == max) {
+        int shift = 0;
+        uint8_t b;
+        do {
+            // nothing this side needs is anywhere near 2^28
+            if (*p == end || shift > 21) {
+                return -1;
+            }
+            b = *(*p)++;
+            v += (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+    *value = v;
+    return 0;
+}
+
+/* A string literal, raw ones are pointed to where they are, Huffman coded
+ * ones are decoded into buf.
+ */
+static int decode_string(const uint8_t** p, const uint8_t* end, char* buf, const char** str, size_t* len)
+{
+    if (*p == end) {
+        return -1;
+    }
+    bool huffman = **p & 0x80;
+    uint32_t size;
+    if (decode_int(p, end, 7, &size) < 0 || size > (size_t)(end - *p)) {
+        return -1;
+    }
+    if (huffman) {
+        int n = huffman_decode(*p, size, buf, HPACK_STRING_MAX);
+        if (n < 0) {
+            return -1;
+        }
+        *str = buf;
+        *len = n;
+    } else {
+        if (size > HPACK_STRING_MAX) {
+            return -1;
+        }
+        *str = (const char*)*p;
+        *len = size;
+    }
+    *p += size;
+    return 0;
+}
+
+void HpackDecoder_init(HpackDecoder* d)
+{
+    d->count = 0;
+    d->size = 0;
+    d->used = 0;
+    d->max_size = HPACK_TABLE_SIZE;
+}
+
+static void evict_oldest(HpackDecoder* d)
+{
+    HpackEntry* oldest = &d->entries[0];
+    size_t bytes = oldest->name_len + oldest->value_len;
+    memmove(d->data, d->data + bytes, d->used - bytes);
+    d->used -= bytes;
+    d->size -= bytes + HPACK_ENTRY_OVERHEAD;
+    d->count--;
+    for (unsigned i = 0; i < d->count; i++) {
+        d->entries[i] = d->entries[i + 1];
+        d->entries[i].offset -= bytes;
+    }
+}
+
+// name and value must not point into the table, adding may evict what they name
+static void insert(HpackDecoder* d, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    while (d->count > 0 && d->size + size > d->max_size) {
+        evict_oldest(d);
+    }
+    if (size > d->max_size) {
+        // too big for the table, which is now empty
+        return;
+    }
+    HpackEntry* e = &d->entries[d->count++];
+    e->offset = d->used;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    memcpy(d->data + d->used, name, name_len);
+    memcpy(d->data + d->used + name_len, value, value_len);
+    d->used += name_len + value_len;
+    d->size += size;
+}
+
+// looks up index, 1 based, static entries first and then the newest dynamic one
+static int lookup(const HpackDecoder* d, uint32_t index, const char** name, size_t* name_len, const char** value, size_t* value_len)
+{
+    if (index == 0) {
+        return -1;
+    } else if (index <= STATIC_COUNT) {
+        *name = static_table[index - 1][0];
+        *name_len = strlen(*name);
+        *value = static_table[index - 1][1];
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= d->count) {
+        return -1;
+    }
+    const HpackEntry* e = &d->entries[d->count - 1 - index];
+    *name = d->data + e->offset;
+    *name_len = e->name_len;
+    *value = d->data + e->offset + e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+
+int HpackDecoder_decode(HpackDecoder* d, const uint8_t* block, size_t len, HpackField field, void* ctx)
+{
+    char name_buf[HPACK_STRING_MAX];
+    char value_buf[HPACK_STRING_MAX];
+    const uint8_t* p = block;
+    const uint8_t* end = block + len;
+    while (p < end) {
+        const char* name;
+        const char* value;
+        size_t name_len, value_len;
+        uint32_t index;
+        uint8_t first = *p;
+
+        if (first & 0x80) {
+            // indexed field
+            if (decode_int(&p, end, 7, &index) < 0 || lookup(d, index, &name, &name_len, &value, &value_len) < 0) {
+                return -1;
+            }
+            field(ctx, name, name_len, value, value_len);
+            continue;
+        } else if ((first & 0xe0) == 0x20) {
+            // dynamic table size update
+            if (decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            d->max_size = index;
+            while (d->size > d->max_size) {
+                evict_oldest(d);
+            }
+            continue;
+        }
+
+        // a literal, with incremental indexing, without or never indexed
+        bool indexing = (first & 0xc0) == 0x40;
+        if (decode_int(&p, end, indexing ? 6 : 4, &index) < 0) {
+            return -1;
+        }
+        if (index == 0) {
+            if (decode_string(&p, end, name_buf, &name, &name_len) < 0) {
+                return -1;
+            }
+        } else if (lookup(d, index, &name, &name_len, &value, &value_len) < 0) {
+            return -1;
+        }
+        if (index > STATIC_COUNT) {
+            // adding the field may evict the entry it names
+            memcpy(name_buf, name, name_len);
+            name = name_buf;
+        }
+        if (decode_string(&p, end, value_buf, &value, &value_len) < 0) {
+            return -1;
+        }
+        if (indexing) {
+            insert(d, name, name_len, value, value_len);
+        }
+        field(ctx, name, name_len, value, value_len);
+    }
+    return 0;
+}
+
+static size_t encode_int(uint8_t* out, size_t room, int prefix, uint8_t flags, uint32_t value)
+{
+    uint32_t max = (1u << prefix) - 1;
+    if (room == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[0] = flags | value;
+        return 1;
+    }
+    out[0] = flags | max;
+    value -= max;
+    size_t n = 1;
+    while (1) {
+        if (n == room) {
+            return 0;
+        }
+        if (value < 0x80) {
+            out[n++] = value;
+            return n;
+        }
+        out[n++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+}
+
+// a raw string literal
+static size_t encode_string(uint8_t* out, size_t room, const char* s, size_t len)
+{
+    size_t n = encode_int(out, room, 7, 0, len);
+    if (n == 0 || room - n < len) {
+        return 0;
+    }
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+// the :status values of static table entries 8 to 14
+static const unsigned static_statuses[] = {200, 204, 206, 304, 400, 404, 500};
+
+size_t hpack_encode_status(uint8_t* out, size_t room, unsigned code)
+{
+    for (int i = 0; i < 7; i++) {
+        if (static_statuses[i] == code) {
+            return encode_int(out, room, 7, 0x80, 8 + i);
+        }
+    }
+    char digits[3] = {'0' + code / 100 % 10, '0' + code / 10 % 10, '0' + code % 10};
+    // literal without indexing, name :status
+    size_t n = encode_int(out, room, 4, 0x00, 8);
+    size_t m = n ? encode_string(out + n, room - n, digits, 3) : 0;
+    return m ? n + m : 0;
+}
+
+size_t hpack_encode_field(uint8_t* out, size_t room, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    uint32_t index = 0;
+    for (int i = 14; i < STATIC_COUNT; i++) {
+        if (strlen(static_table[i][0]) == name_len && memcmp(static_table[i][0], name, name_len) == 0) {
+            index = i + 1;
+            break;
+        }
+    }
+    // literal without indexing
+    size_t n = encode_int(out, room, 4, 0x00, index);
+    if (n > 0 && index == 0) {
+        size_t m = encode_string(out + n, room - n, name, name_len);
+        n = m ? n + m : 0;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    size_t m = encode_string(out + n, room - n, value, value_len);
+    return m ? n + m : 0;
+}
@@ -0,0 +1,59 @@
+#ifndef NBH_HPACK_HEADER
+#define NBH_HPACK_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SETTINGS_HEADER_TABLE_SIZE, the default, never raised
+#define HPACK_TABLE_SIZE 4096
+
+// every entry costs 32 bytes on top of its name and value
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+// longest name or value a decoded field may have
+#define HPACK_STRING_MAX 4096
+
+typedef struct {
+    uint16_t offset; // into HpackDecoder.data, name then value
+    uint16_t name_len;
+    uint16_t value_len;
+} HpackEntry;
+
+/* The dynamic table of one direction of an HTTP/2 connection (RFC 7541).
+ *
+ * Entries are kept oldest first and their bytes back to back in data, so
+ * evicting the oldest is a memmove of what is left.
+ */
+typedef struct {
+    HpackEntry entries[HPACK_MAX_ENTRIES];
+    unsigned count;
+    // sum of name, value and overhead of every entry
+    size_t size;
+    size_t max_size;
+    size_t used;
+    char data[HPACK_TABLE_SIZE];
+} HpackDecoder;
+
+void HpackDecoder_init(HpackDecoder* d);
+
+// called once per decoded field, the strings only live until it returns
+typedef void (*HpackField)(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len);
+
+/* Decodes one complete header block. Returns 0, or -1 on a compression
+ * error after which the table is out of step with the peer and the
+ * connection has to go.
+ */
+int HpackDecoder_decode(HpackDecoder* d, const uint8_t* block, size_t len, HpackField field, void* ctx);
+
+/* The encoder never adds to the peer's dynamic table, every field is either
+ * a static table index or a literal without indexing. Both return the
+ * bytes written, 0 when they do not fit in room.
+ */
+size_t hpack_encode_status(uint8_t* out, size_t room, unsigned code);
+
+// name must be lower case
+size_t hpack_encode_field(uint8_t* out, size_t room, const char* name, size_t name_len, const char* value, size_t value_len);
+
+#endif
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// content types are counted one up, 0 is a response without one
+#define TYPE_SLOTS (WS_MIME_MAX + 1)
+
+enum { HOT_HITS, HOT_MISSES, HOT_ADMITTED, HOT_EVICTED, HOT_BYTES, HOT_ENTRIES, HOT_STATS };
+
+enum { META_INVALIDATIONS, META_FLUSHES, META_WATCHED, META_STATS };
+
+enum { POOL_JOBS, POOL_INLINE, POOL_DEPTH, POOL_MAX_DEPTH, POOL_WAIT_NS, POOL_WAIT_MAX_NS, POOL_STATS };
+
+typedef struct {
+    const char* name;
+    const char* help;
+    // counters add up, gauges too unless the largest one is wanted
+    bool counter;
+    bool largest;
+    // ns, shown in seconds
+    bool ns;
+} Stat;
+
+static const Stat hot_stats[HOT_STATS] = {
+    [HOT_HITS] = {"ws_hot_cache_hits_total", "Responses sent from the hot cache.", true},
+    [HOT_MISSES] = {"ws_hot_cache_misses_total", "Responses the hot cache had no body for.", true},
+    [HOT_ADMITTED] = {"ws_hot_cache_admitted_total", "Bodies read into the hot cache.", true},
+    [HOT_EVICTED] = {"ws_hot_cache_evicted_total", "Bodies evicted from the hot cache.", true},
+    [HOT_BYTES] = {"ws_hot_cache_bytes", "Bytes held by the hot caches."},
+    [HOT_ENTRIES] = {"ws_hot_cache_entries", "Bodies held by the hot caches."},
+};
+
+static const Stat meta_stats[META_STATS] = {
+    [META_INVALIDATIONS] = {"ws_meta_cache_invalidations_total", "Paths the watcher invalidated.", true},
+    [META_FLUSHES] = {"ws_meta_cache_flushes_total", "Times the whole metadata cache was dropped.", true},
+    [META_WATCHED] = {"ws_meta_cache_watched", "1 while entries are trusted until invalidated rather than for meta_ttl."},
+};
+
+static const Stat pool_stats[POOL_STATS] = {
+    [POOL_JOBS] = {"ws_fs_pool_jobs_total", "Lookups handed to the fs pool.", true},
+    [POOL_INLINE] = {"ws_fs_pool_inline_total", "Lookups run on the event loop because the fs pool was full.", true},
+    [POOL_DEPTH] = {"ws_fs_pool_depth", "Lookups waiting for an fs pool thread."},
+    [POOL_MAX_DEPTH] = {"ws_fs_pool_max_depth", "Most lookups ever waiting for the fs pool of a worker.", false, true},
+    [POOL_WAIT_NS] = {"ws_fs_pool_wait_seconds_total", "Time lookups waited for an fs pool thread.", true, false, true},
+    [POOL_WAIT_MAX_NS] = {"ws_fs_pool_wait_max_seconds", "Longest a lookup waited for an fs pool thread.", false, true,
+                          true},
+};
+
+typedef struct {
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+} Histogram;
+
+typedef struct {
+    _Alignas(64) atomic_bool used;
+    _Atomic uint64_t responses[WS_STATUS_MAX][TYPE_SLOTS];
+    Histogram first_byte[WS_STATUS_MAX];
+    Histogram done[WS_STATUS_MAX];
+    Histogram first_byte_by_type[TYPE_SLOTS];
+    Histogram done_by_type[TYPE_SLOTS];
+    // as the worker last published them, they start over when it is respawned
+    _Atomic uint64_t hot[HOT_STATS];
+    _Atomic uint64_t pool[POOL_STATS];
+} Slot;
+
+// one per worker and one for the parent, untouched pages of the slots never in use cost nothing
+#define SLOT_COUNT (WS_MAX_WORKERS + 1)
+
+static Slot* slots = NULL;
+static Slot* own = NULL;
+static const MetaCache* meta_cache = NULL;
+
+bool metrics_start()
+{
+    void* mem = mmap(NULL, SLOT_COUNT * sizeof(Slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+    if (mem == MAP_FAILED) {
+        int en = errno;
+        DebugErr("metrics mmap() %s\n", strerror(en));
+        return false;
+    }
+    slots = mem;
+    return true;
+}
+
+void metrics_worker(int slot)
+{
+    if (slots == NULL || slot < 0 || slot >= SLOT_COUNT) {
+        return;
+    }
+    own = &slots[slot];
+    atomic_store(&own->used, true);
+}
+
+void metrics_meta_cache(const MetaCache* meta) { meta_cache = meta; }
+
+static void publish(_Atomic uint64_t* to, const uint64_t* from, int count)
+{
+    for (int i = 0; i < count; i++) {
+        atomic_store_explicit(&to[i], from[i], memory_order_relaxed);
+    }
+}
+
+void metrics_hot_cache(const HotCacheStats* stats)
+{
+    if (own == NULL) {
+        return;
+    }
+    uint64_t values[HOT_STATS] = {
+        [HOT_HITS] = stats->hits,
+        [HOT_MISSES] = stats->misses,
+        [HOT_ADMITTED] = stats->admitted,
+        [HOT_EVICTED] = stats->evicted,
+        [HOT_BYTES] = stats->bytes,
+        [HOT_ENTRIES] = stats->entries,
+    };
+    publish(own->hot, values, HOT_STATS);
+}
+
+void metrics_fs_pool(const FsPoolStats* stats)
+{
+    if (own == NULL) {
+        return;
+    }
+    uint64_t values[POOL_STATS] = {
+        [POOL_JOBS] = stats->submitted,
+        [POOL_INLINE] = stats->inline_fallbacks,
+        [POOL_DEPTH] = stats->depth,
+        [POOL_MAX_DEPTH] = stats->max_depth,
+        [POOL_WAIT_NS] = stats->wait_ns_total,
+        [POOL_WAIT_MAX_NS] = stats->wait_ns_max,
+    };
+    publish(own->pool, values, POOL_STATS);
+}
+
+uint64_t metrics_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int metrics_bucket(uint64_t ns)
+{
+    // bounds are inclusive, as Prometheus has them
+    uint64_t v = ns ? ns - 1 : 0;
+    if (v < (1ull << METRICS_MIN_SHIFT)) {
+        return 0;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= METRICS_MIN_SHIFT + METRICS_OCTAVES) {
+        return METRICS_BUCKETS - 1;
+    }
+    return 1 + 2 * (msb - METRICS_MIN_SHIFT) + (int)((v >> (msb - 1)) & 1);
+}
+
+uint64_t metrics_bucket_bound(int bucket)
+{
+    if (bucket == 0) {
+        return 1ull << METRICS_MIN_SHIFT;
+    } else if (bucket >= METRICS_BUCKETS - 1) {
+        return 0;
+    }
+    int msb = METRICS_MIN_SHIFT + (bucket - 1) / 2;
+    // the lower half of the octave ends at 1.5 times its start
+    return (uint64_t)(3 + (bucket - 1) % 2) << (msb - 1);
+}
+
+// only this process writes the slot, a plain add that a scrape reads whole
+static inline void bump(_Atomic uint64_t* counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void observe(Histogram* h, uint64_t ns)
+{
+    bump(&h->buckets[metrics_bucket(ns)], 1);
+    bump(&h->sum_ns, ns);
+}
+
+static int type_slot(int content_type) { return content_type >= 0 && content_type < WS_MIME_MAX ? content_type + 1 : 0; }
+
+void metrics_first_byte(uint32_t code, int content_type, uint64_t ns)
+{
+    if (own == NULL) {
+        return;
+    }
+    observe(&own->first_byte[status_id(code)], ns);
+    observe(&own->first_byte_by_type[type_slot(content_type)], ns);
+}
+
+void metrics_done(uint32_t code, int content_type, uint64_t ns)
+{
+    if (own == NULL) {
+        return;
+    }
+    int s = status_id(code);
+    int t = type_slot(content_type);
+    bump(&own->responses[s][t], 1);
+    observe(&own->done[s], ns);
+    observe(&own->done_by_type[t], ns);
+}
+
+// what a scrape adds up, plain counters
+typedef struct {
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+} Totals;
+
+typedef struct {
+    uint64_t responses[WS_STATUS_MAX][TYPE_SLOTS];
+    Totals first_byte[WS_STATUS_MAX];
+    Totals done[WS_STATUS_MAX];
+    Totals first_byte_by_type[TYPE_SLOTS];
+    Totals done_by_type[TYPE_SLOTS];
+    uint64_t hot[HOT_STATS];
+    uint64_t pool[POOL_STATS];
+} Sums;
+
+static void add_histograms(Totals* to, Histogram* from, int count)
+{
+    for (int i = 0; i < count; i++) {
+        to[i].sum_ns += atomic_load_explicit(&from[i].sum_ns, memory_order_relaxed);
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            to[i].buckets[b] += atomic_load_explicit(&from[i].buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+static void add_stats(uint64_t* to, _Atomic uint64_t* from, const Stat* stats, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint64_t value = atomic_load_explicit(&from[i], memory_order_relaxed);
+        if (!stats[i].largest) {
+            to[i] += value;
+        } else if (value > to[i]) {
+            to[i] = value;
+        }
+    }
+}
+
+static void sum_slots(Sums* sums)
+{
+    for (int i = 0; slots && i < SLOT_COUNT; i++) {
+        Slot* slot = &slots[i];
+        if (!atomic_load(&slot->used)) {
+            continue;
+        }
+        for (int s = 0; s < WS_STATUS_MAX; s++) {
+            for (int t = 0; t < TYPE_SLOTS; t++) {
+                sums->responses[s][t] += atomic_load_explicit(&slot->responses[s][t], memory_order_relaxed);
+            }
+        }
+        add_histograms(sums->first_byte, slot->first_byte, WS_STATUS_MAX);
+        add_histograms(sums->done, slot->done, WS_STATUS_MAX);
+        add_histograms(sums->first_byte_by_type, slot->first_byte_by_type, TYPE_SLOTS);
+        add_histograms(sums->done_by_type, slot->done_by_type, TYPE_SLOTS);
+        add_stats(sums->hot, slot->hot, hot_stats, HOT_STATS);
+        add_stats(sums->pool, slot->pool, pool_stats, POOL_STATS);
+    }
+}
+
+// the content type as a label value, quotes and backslashes escaped
+static void put_type(FILE* out, int t)
+{
+    const char* name = t == 0 ? "none" : content_type_name(t - 1);
+    for (; *name; name++) {
+        if (*name == '"' || *name == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*name, out);
+    }
+}
+
+static void put_label(FILE* out, bool by_type, int i)
+{
+    if (by_type) {
+        fputs("type=\"", out);
+        put_type(out, i);
+    } else {
+        fprintf(out, "code=\"%u", status_code(i));
+    }
+    fputc('"', out);
+}
+
+// one histogram family, the series that never saw a response are left out
+static void put_histograms(FILE* out, const char* name, const char* help, const Totals* h, int count, bool by_type)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < count; i++) {
+        uint64_t seen = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            seen += h[i].buckets[b];
+        }
+        if (seen == 0) {
+            continue;
+        }
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += h[i].buckets[b];
+            fprintf(out, "%s_bucket{", name);
+            put_label(out, by_type, i);
+            uint64_t bound = metrics_bucket_bound(b);
+            if (bound) {
+                fprintf(out, ",le=\"%.9g\"} %lu\n", bound / 1e9, cumulative);
+            } else {
+                fprintf(out, ",le=\"+Inf\"} %lu\n", cumulative);
+            }
+        }
+        fprintf(out, "%s_sum{", name);
+        put_label(out, by_type, i);
+        fprintf(out, "} %.9f\n%s_count{", h[i].sum_ns / 1e9, name);
+        put_label(out, by_type, i);
+        fprintf(out, "} %lu\n", seen);
+    }
+}
+
+static void put_stat(FILE* out, const Stat* stat, uint64_t value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", stat->name, stat->help, stat->name, stat->counter ? "counter" : "gauge");
+    if (stat->ns) {
+        fprintf(out, "%s %.9f\n", stat->name, value / 1e9);
+    } else {
+        fprintf(out, "%s %lu\n", stat->name, value);
+    }
+}
+
+static void put_stats(FILE* out, const uint64_t* values, const Stat* stats, int count)
+{
+    for (int i = 0; i < count; i++) {
+        put_stat(out, &stats[i], values[i]);
+    }
+}
+
+static void render(FILE* out, const Sums* sums)
+{
+    int statuses = status_count();
+    int types = content_type_count() + 1;
+    fputs("# HELP ws_responses_total Responses sent, by status code and content type.\n"
+          "# TYPE ws_responses_total counter\n",
+          out);
+    for (int s = 0; s < statuses; s++) {
+        for (int t = 0; t < types; t++) {
+            if (sums->responses[s][t]) {
+                fprintf(out, "ws_responses_total{code=\"%u\",type=\"", status_code(s));
+                put_type(out, t);
+                fprintf(out, "\"} %lu\n", sums->responses[s][t]);
+            }
+        }
+    }
+    put_histograms(out, "ws_first_byte_seconds", "Time to the first byte of the response, by status code.",
+                   sums->first_byte, statuses, false);
+    put_histograms(out, "ws_response_seconds", "Time to the last byte of the response, by status code.", sums->done,
+                   statuses, false);
+    put_histograms(out, "ws_first_byte_by_type_seconds", "Time to the first byte of the response, by content type.",
+                   sums->first_byte_by_type, types, true);
+    put_histograms(out, "ws_response_by_type_seconds", "Time to the last byte of the response, by content type.",
+                   sums->done_by_type, types, true);
+    put_stats(out, sums->hot, hot_stats, HOT_STATS);
+    put_stats(out, sums->pool, pool_stats, POOL_STATS);
+    if (meta_cache) {
+        MetaCacheStats meta;
+        MetaCache_stats(meta_cache, &meta);
+        uint64_t values[META_STATS] = {
+            [META_INVALIDATIONS] = meta.invalidations,
+            [META_FLUSHES] = meta.flushes,
+            [META_WATCHED] = meta.watched,
+        };
+        put_stats(out, values, meta_stats, META_STATS);
+    }
+}
+
+int metrics_body()
+{
+    Sums* sums = calloc(1, sizeof(Sums));
+    char* text = NULL;
+    size_t len = 0;
+    FILE* out = sums ? open_memstream(&text, &len) : NULL;
+    if (out == NULL) {
+        DebugErr("metrics_body() out of memory\n");
+        free(sums);
+        return -1;
+    }
+    sum_slots(sums);
+    render(out, sums);
+    free(sums);
+    if (fclose(out) != 0) {
+        DebugErr("metrics_body() out of memory\n");
+        free(text);
+        return -1;
+    }
+
+    int fd = memfd_create("metrics", MFD_CLOEXEC);
+    ssize_t written = fd < 0 ? -1 : write(fd, text, len);
+    int en = errno;
+    free(text);
+    if (written != (ssize_t)len) {
+        DebugErr("metrics_body() %s\n", strerror(written < 0 ? en : EIO));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
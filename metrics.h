@@ -0,0 +1,72 @@
+#ifndef NBH_METRICS_HEADER
+#define NBH_METRICS_HEADER
+
+#include "file_cache.h"
+#include "fs_pool.h"
+#include "hot_cache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Latency histograms are log-linear like HDR histograms: one bucket below
+ * 2^METRICS_MIN_SHIFT ns, two per power of two above it up to
+ * 2^(METRICS_MIN_SHIFT + METRICS_OCTAVES) ns, about 69 s, and one for the
+ * rest. Every bound is within 50% of the next, a value is off by at most 25%.
+ */
+#define METRICS_MIN_SHIFT 10
+#define METRICS_OCTAVES 26
+#define METRICS_BUCKETS (2 + 2 * METRICS_OCTAVES)
+
+/* Per worker counters in shared memory, served in the Prometheus text
+ * format on the metrics_path of the configuration.
+ *
+ * Every worker owns a slot it alone writes, so recording is a few plain
+ * adds with no locked instruction or shared cache line; a scrape sums the
+ * slots. Counts survive a worker being respawned into the same slot.
+ *
+ * Responses are broken down by status code and content type. The time to
+ * first byte runs from taking the request to handing the first byte of
+ * its header to the socket, or for HTTP/2 to the session; the duration to
+ * the last byte of the body.
+ *
+ * The counters of the hot cache and fs pool of each worker are published
+ * into its slot from the event loop and summed up the same way, those of
+ * the shared MetaCache are read as they are.
+ */
+
+/* Maps the slots before forking so every worker shares them. Until then,
+ * or when it failed, nothing is recorded. Returns false after printing why.
+ */
+bool metrics_start();
+
+// this process records into slot, 0 to WS_MAX_WORKERS, the last one for serving from the parent
+void metrics_worker(int slot);
+
+// the cache whose invalidations a scrape reports, set before forking
+void metrics_meta_cache(const MetaCache* meta);
+
+// the stats of the hot cache of this process, as they are now
+void metrics_hot_cache(const HotCacheStats* stats);
+
+// the stats of the fs pool of this process, as they are now
+void metrics_fs_pool(const FsPoolStats* stats);
+
+// CLOCK_MONOTONIC in ns, what the recorded times are differences of
+uint64_t metrics_clock();
+
+// the first byte of a response went out ns after its request was taken
+void metrics_first_byte(uint32_t code, int content_type, uint64_t ns);
+
+// the last byte went out, counts the response
+void metrics_done(uint32_t code, int content_type, uint64_t ns);
+
+// a memfd holding every slot summed up in the Prometheus text format, -1 after printing why
+int metrics_body();
+
+// the histogram bucket of a value of ns
+int metrics_bucket(uint64_t ns);
+
+// the largest value bucket holds, 0 for the last one which has no bound
+uint64_t metrics_bucket_bound(int bucket);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef NBH_PHASH_FN_HEADER
+#define NBH_PHASH_FN_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The hash behind the generated tables in phash.h, shared with phash_gen
+ * so both sides always agree.
+ *
+ * Packs the length and four bytes of the key into one word and takes the
+ * top bits of its product with a seed that phash_gen searched for. fold is
+ * or'ed into every byte, 0x20 makes letters compare case-insensitively.
+ * Needs len > 0.
+ */
+static inline uint32_t phash_mix(const char* s, size_t len, uint64_t seed, uint8_t fold, int bits)
+{
+    size_t back = len > 2 ? len - 3 : 0;
+    uint64_t x = (uint64_t)(uint8_t)(s[0] | fold) | (uint64_t)(uint8_t)(s[len / 2] | fold) << 8 |
+                 (uint64_t)(uint8_t)(s[back] | fold) << 16 | (uint64_t)(uint8_t)(s[len - 1] | fold) << 24 |
+                 (uint64_t)len << 32;
+    return (uint32_t)((x * seed) >> (64 - bits));
+}
+
+// a slot of a generated table, len 0 when empty
+typedef struct {
+    const char* key;
+    uint8_t len;
+    uint8_t id;
+} PhashEntry;
+
+#endif
@@ -0,0 +1,164 @@
+/* Build time generator for phash.h.
+ *
+ * For every key set it searches for a seed that sends each key to its own
+ * slot of a power of two table and prints the table plus a lookup function
+ * that needs one multiply and one compare. If a set can not be made
+ * collision-free within the search budget this exits non-zero and the
+ * build stops, so adding a key can never silently slow down or break a
+ * lookup.
+ *
+ * usage: ./phash_gen > phash.h
+ */
+#include "phash_fn.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_BITS 8
+#define SEED_TRIES 1000000
+
+typedef struct {
+    const char* key;
+    const char* id;
+} Key;
+
+typedef struct {
+    const char* name;
+    uint8_t fold;
+    const Key* keys;
+    size_t count;
+} KeySet;
+
+static const Key methods[] = {
+    {"GET", "REQ_METHOD_GET"},
+    {"HEAD", "REQ_METHOD_HEAD"},
+    {"OPTIONS", "REQ_METHOD_OPTIONS"},
+    {"TRACE", "REQ_METHOD_TRACE"},
+    {"PUT", "REQ_METHOD_PUT"},
+    {"DELETE", "REQ_METHOD_DELETE"},
+    {"POST", "REQ_METHOD_POST"},
+    {"PATCH", "REQ_METHOD_PATCH"},
+    {"CONNECT", "REQ_METHOD_CONNECT"},
+};
+
+static const Key versions[] = {
+    {"HTTP/1.0", "REQ_VERSION_1_0"},
+    {"HTTP/1.1", "REQ_VERSION_1_1"},
+    {"HTTP/2.0", "REQ_VERSION_2_0"},
+};
+
+// lower case, matched case-insensitively
+static const Key headers[] = {
+    {"host", "HDR_HOST"},
+    {"connection", "HDR_CONNECTION"},
+    {"if-none-match", "HDR_IF_NONE_MATCH"},
+    {"if-modified-since", "HDR_IF_MODIFIED_SINCE"},
+    {"range", "HDR_RANGE"},
+    {"accept-encoding", "HDR_ACCEPT_ENCODING"},
+    {"content-length", "HDR_CONTENT_LENGTH"},
+    {"if-range", "HDR_IF_RANGE"},
+    {"upgrade", "HDR_UPGRADE"},
+    {"http2-settings", "HDR_HTTP2_SETTINGS"},
+};
+
+#define KEY_SET(n, f, k) {n, f, k, sizeof(k) / sizeof(k[0])}
+
+static const KeySet sets[] = {
+    KEY_SET("method", 0, methods),
+    KEY_SET("version", 0, versions),
+    KEY_SET("header", 0x20, headers),
+};
+
+static uint64_t splitmix64(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// fills slots with the index of the key in each slot, -1 for empty
+static bool try_seed(const KeySet* set, uint64_t seed, int bits, int* slots)
+{
+    for (int i = 0; i < (1 << bits); i++) {
+        slots[i] = -1;
+    }
+    for (size_t k = 0; k < set->count; k++) {
+        const char* key = set->keys[k].key;
+        uint32_t h = phash_mix(key, strlen(key), seed, set->fold, bits);
+        if (slots[h] >= 0) {
+            return false;
+        }
+        slots[h] = k;
+    }
+    return true;
+}
+
+static bool emit(const KeySet* set)
+{
+    size_t max_len = 0;
+    for (size_t k = 0; k < set->count; k++) {
+        size_t len = strlen(set->keys[k].key);
+        if (len == 0 || len > UINT8_MAX) {
+            fprintf(stderr, "phash_gen: bad %s key \"%s\"\n", set->name, set->keys[k].key);
+            return false;
+        }
+        max_len = len > max_len ? len : max_len;
+    }
+
+    int bits = 1;
+    while ((1u << bits) < set->count) {
+        bits++;
+    }
+    int slots[1 << MAX_BITS];
+    uint64_t state = 1;
+    for (; bits <= MAX_BITS; bits++) {
+        for (int tries = 0; tries < SEED_TRIES; tries++) {
+            uint64_t seed = splitmix64(&state) | 1;
+            if (!try_seed(set, seed, bits, slots)) {
+                continue;
+            }
+
+            printf("static const PhashEntry phash_%s_table[%i] = {\n", set->name, 1 << bits);
+            for (int i = 0; i < (1 << bits); i++) {
+                if (slots[i] >= 0) {
+                    const Key* key = &set->keys[slots[i]];
+                    printf("    [%i] = {\"%s\", %zu, %s},\n", i, key->key, strlen(key->key), key->id);
+                }
+            }
+            printf("};\n\n");
+            printf("static inline int phash_%s(const char* s, size_t len)\n{\n", set->name);
+            printf("    if (len == 0 || len > %zu) {\n        return -1;\n    }\n", max_len);
+            printf(
+                "    const PhashEntry* e = &phash_%s_table[phash_mix(s, len, 0x%016llxull, 0x%02x, %i)];\n",
+                set->name,
+                (unsigned long long)seed,
+                set->fold,
+                bits
+            );
+            printf(
+                "    if (e->len != len || %s(e->key, s, len) != 0) {\n        return -1;\n    }\n",
+                set->fold ? "strncasecmp" : "memcmp"
+            );
+            printf("    return e->id;\n}\n\n");
+            return true;
+        }
+    }
+    fprintf(stderr, "phash_gen: no collision-free seed for the %s keys\n", set->name);
+    return false;
+}
+
+int main()
+{
+    printf("// generated by phash_gen, do not edit\n");
+    printf("#ifndef NBH_PHASH_HEADER\n#define NBH_PHASH_HEADER\n\n");
+    printf("#include \"phash_fn.h\"\n\n#include <string.h>\n#include <strings.h>\n\n");
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        if (!emit(&sets[i])) {
+            return 1;
+        }
+    }
+    printf("#endif\n");
+    return 0;
+}
@@ -0,0 +1,395 @@
+#include "router.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// node 0 starts the path trie, node 1 the extension trie
+#define PATH_ROOT 0
+#define EXTENSION_ROOT 1
+
+typedef struct {
+    uint16_t status; // 0 for a rewrite
+    bool append;     // the target ended in *, the rest of the uri goes there
+    uint16_t target_len;
+    uint32_t target; // offset into Router.strings
+} RouteRule;
+
+typedef struct {
+    uint32_t edges; // first of edge_count in edge_bytes and edge_nodes, sorted by byte
+    uint16_t edge_count;
+    int32_t exact;  // rule for a uri ending here, -1 for none
+    int32_t prefix; // rule for a uri going on from here, -1 for none
+    // while the trie is being built, children are a list
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint8_t byte;
+} RouteNode;
+
+struct Router {
+    RouteNode* nodes;
+    uint32_t node_count;
+    uint32_t node_cap;
+    uint8_t* edge_bytes;
+    uint32_t* edge_nodes;
+    RouteRule* rules;
+    uint32_t rule_count;
+    uint32_t rule_cap;
+    char* strings;
+    uint32_t strings_len;
+    uint32_t strings_cap;
+};
+
+// what "/" and "/inside/" always did, a routes file can replace them
+static const char* builtin_rules[] = {
+    "rewrite / /index.html",
+    "rewrite /inside/ /index.html",
+};
+
+#define BUILTIN_RULE_COUNT (sizeof(builtin_rules) / sizeof(builtin_rules[0]))
+
+static bool grow(void** array, uint32_t* cap, uint32_t need, size_t size)
+{
+    if (need <= *cap) {
+        return true;
+    }
+    uint32_t next = *cap ? *cap : 16;
+    while (next < need) {
+        next *= 2;
+    }
+    void* grown = realloc(*array, next * size);
+    if (grown == NULL) {
+        return false;
+    }
+    *array = grown;
+    *cap = next;
+    return true;
+}
+
+static int64_t add_node(Router* r, uint8_t byte)
+{
+    if (!grow((void**)&r->nodes, &r->node_cap, r->node_count + 1, sizeof(RouteNode))) {
+        return -1;
+    }
+    r->nodes[r->node_count] = (RouteNode){.exact = -1, .prefix = -1, .byte = byte};
+    return r->node_count++;
+}
+
+// the node key leads to from root, created as needed
+static int64_t insert(Router* r, uint32_t root, const char* key, size_t len)
+{
+    uint32_t node = root;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = key[i];
+        uint32_t child = r->nodes[node].first_child;
+        while (child && r->nodes[child].byte != byte) {
+            child = r->nodes[child].next_sibling;
+        }
+        if (child == 0) {
+            int64_t added = add_node(r, byte);
+            if (added < 0) {
+                return -1;
+            }
+            child = added;
+            r->nodes[child].next_sibling = r->nodes[node].first_child;
+            r->nodes[node].first_child = child;
+        }
+        node = child;
+    }
+    return node;
+}
+
+static int32_t add_target(Router* r, uint16_t status, const char* target, size_t len, bool append)
+{
+    if (!grow((void**)&r->rules, &r->rule_cap, r->rule_count + 1, sizeof(RouteRule)) ||
+        !grow((void**)&r->strings, &r->strings_cap, r->strings_len + len, 1)) {
+        return -1;
+    }
+    memcpy(r->strings + r->strings_len, target, len);
+    r->rules[r->rule_count] = (RouteRule){
+        .status = status,
+        .append = append,
+        .target_len = len,
+        .target = r->strings_len,
+    };
+    r->strings_len += len;
+    return r->rule_count++;
+}
+
+// adds one "rewrite pattern target" or "redirect status pattern target", NULL on success or why not
+static const char* add_rule(Router* r, char* line)
+{
+    char* words[4];
+    int count = 0;
+    char* save;
+    for (char* word = strtok_r(line, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+        if (count == 4) {
+            return "too many words";
+        }
+        words[count++] = word;
+    }
+    uint16_t status = 0;
+    const char* pattern;
+    const char* target;
+    if (count == 3 && strcmp(words[0], "rewrite") == 0) {
+        pattern = words[1];
+        target = words[2];
+    } else if (count == 4 && strcmp(words[0], "redirect") == 0) {
+        status = atoi(words[1]);
+        if (status != 301 && status != 302 && status != 307 && status != 308) {
+            return "redirect status must be 301, 302, 307 or 308";
+        }
+        pattern = words[2];
+        target = words[3];
+    } else {
+        return "expected rewrite <pattern> <target> or redirect <status> <pattern> <target>";
+    }
+    size_t pattern_len = strlen(pattern);
+    size_t target_len = strlen(target);
+    if (pattern_len >= WS_PATH_BUFFER_SIZE || target_len >= WS_PATH_BUFFER_SIZE) {
+        return "too long";
+    }
+    bool extension = pattern[0] == '*' && pattern[1] == '.';
+    bool prefix = !extension && pattern[pattern_len - 1] == '*';
+    bool append = target[target_len - 1] == '*';
+    if (!extension && pattern[0] != '/') {
+        return "pattern must start with / or *.";
+    } else if (extension && (pattern_len == 2 || strpbrk(pattern + 2, "/.*"))) {
+        return "bad extension";
+    } else if (!extension && memchr(pattern, '*', pattern_len - prefix)) {
+        return "* only ends a pattern";
+    } else if (status == 0 && target[0] != '/') {
+        return "rewrite target must start with /";
+    } else if (append && !prefix) {
+        return "only a prefix pattern can end its target with *";
+    } else if (memchr(target, '*', target_len - append)) {
+        return "* only ends a target";
+    }
+
+    int32_t rule = add_target(r, status, target, target_len - append, append);
+    int64_t node = rule < 0 ? -1
+                   : extension ? insert(r, EXTENSION_ROOT, pattern + 2, pattern_len - 2)
+                               : insert(r, PATH_ROOT, pattern, pattern_len - prefix);
+    if (node < 0) {
+        return "out of memory";
+    }
+    if (prefix) {
+        r->nodes[node].prefix = rule;
+    } else {
+        r->nodes[node].exact = rule;
+    }
+    return NULL;
+}
+
+// lays the children of every node out as one sorted run of edges
+static bool compile(Router* r)
+{
+    // every node but the two roots is the child of one edge
+    uint32_t edge_total = r->node_count - 2;
+    r->edge_bytes = malloc(edge_total ? edge_total : 1);
+    r->edge_nodes = malloc((edge_total ? edge_total : 1) * sizeof(uint32_t));
+    if (r->edge_bytes == NULL || r->edge_nodes == NULL) {
+        return false;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < r->node_count; i++) {
+        RouteNode* n = &r->nodes[i];
+        n->edges = used;
+        for (uint32_t child = n->first_child; child; child = r->nodes[child].next_sibling) {
+            // insertion sort, a node has at most 256 children
+            uint32_t at = used++;
+            uint8_t byte = r->nodes[child].byte;
+            while (at > n->edges && r->edge_bytes[at - 1] > byte) {
+                r->edge_bytes[at] = r->edge_bytes[at - 1];
+                r->edge_nodes[at] = r->edge_nodes[at - 1];
+                at--;
+            }
+            r->edge_bytes[at] = byte;
+            r->edge_nodes[at] = child;
+        }
+        n->edge_count = used - n->edges;
+    }
+    return true;
+}
+
+Router* Router_load(const char* path)
+{
+    Router* r = calloc(1, sizeof(Router));
+    if (r == NULL || add_node(r, 0) < 0 || add_node(r, 0) < 0) {
+        DebugErr("Router_load() out of memory\n");
+        Router_destroy(r);
+        return NULL;
+    }
+    bool ok = true;
+    for (size_t i = 0; ok && i < BUILTIN_RULE_COUNT; i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "%s", builtin_rules[i]);
+        ok = add_rule(r, line) == NULL;
+    }
+
+    FILE* file = NULL;
+    if (ok && path) {
+        file = fopen(path, "r");
+        if (file == NULL) {
+            int en = errno;
+            DebugErr("%s: %s\n", path, strerror(en));
+            ok = false;
+        }
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    for (int number = 1; ok && file && getline(&line, &cap, file) >= 0; number++) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+        const char* why = add_rule(r, line);
+        if (why) {
+            DebugErr("%s:%i: %s\n", path, number, why);
+            ok = false;
+        }
+    }
+    free(line);
+    if (file) {
+        fclose(file);
+    }
+    if (ok && !compile(r)) {
+        DebugErr("Router_load() out of memory\n");
+        ok = false;
+    }
+    if (!ok) {
+        Router_destroy(r);
+        return NULL;
+    }
+    if (path) {
+        DebugMsg("%s: %u rules\n", path, r->rule_count);
+    }
+    return r;
+}
+
+void Router_destroy(Router* router)
+{
+    if (router == NULL) {
+        return;
+    }
+    free(router->nodes);
+    free(router->edge_bytes);
+    free(router->edge_nodes);
+    free(router->rules);
+    free(router->strings);
+    free(router);
+}
+
+// the child of node along byte, -1 if there is none
+static int64_t follow(const Router* r, const RouteNode* node, uint8_t byte)
+{
+    const uint8_t* bytes = r->edge_bytes + node->edges;
+    uint32_t low = 0;
+    uint32_t high = node->edge_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (bytes[mid] < byte) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < node->edge_count && bytes[low] == byte ? (int64_t)r->edge_nodes[node->edges + low] : -1;
+}
+
+// the rule for the extension of the last path segment, -1 if there is none
+static int32_t extension_rule(const Router* r, const char* uri, size_t len)
+{
+    size_t start = len;
+    while (start > 0 && uri[start - 1] != '/' && uri[start - 1] != '.') {
+        start--;
+    }
+    if (start == 0 || uri[start - 1] != '.') {
+        return -1;
+    }
+    const RouteNode* node = &r->nodes[EXTENSION_ROOT];
+    for (size_t i = start; i < len; i++) {
+        int64_t next = follow(r, node, uri[i]);
+        if (next < 0) {
+            return -1;
+        }
+        node = &r->nodes[next];
+    }
+    return node->exact;
+}
+
+int Router_route(const Router* router, char uri[WS_URI_BUFFER_SIZE], const char* root)
+{
+    size_t len = strnlen(uri, WS_PATH_BUFFER_SIZE);
+    int32_t rule = -1;
+    size_t matched = 0;
+    const RouteNode* node = &router->nodes[PATH_ROOT];
+    for (size_t i = 0;; i++) {
+        if (node->prefix >= 0) {
+            // the longest prefix so far
+            rule = node->prefix;
+            matched = i;
+        }
+        if (i == len) {
+            if (node->exact >= 0) {
+                rule = node->exact;
+                matched = len;
+            }
+            break;
+        }
+        int64_t next = follow(router, node, uri[i]);
+        if (next < 0) {
+            break;
+        }
+        node = &router->nodes[next];
+    }
+    if (rule < 0) {
+        rule = extension_rule(router, uri, len);
+        matched = 0;
+    }
+
+    // without a rule the whole uri goes under root
+    const RouteRule* r = rule >= 0 ? &router->rules[rule] : NULL;
+    const char* target = r ? router->strings + r->target : "";
+    size_t target_len = r ? r->target_len : 0;
+    size_t tail = r == NULL || r->append ? len - matched : 0;
+    size_t front = r && r->status ? 0 : strlen(root);
+    if (front + target_len + tail >= WS_URI_BUFFER_SIZE) {
+        return -1;
+    }
+    // the rest of the uri first, target and root then go in front of it
+    memmove(uri + front + target_len, uri + matched, tail);
+    memcpy(uri + front, target, target_len);
+    memcpy(uri, root, front);
+    uri[front + target_len + tail] = '\0';
+    return r ? r->status : 0;
+}
+
+static Router* active = NULL;
+static Router* builtin = NULL;
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static void builtin_init() { builtin = Router_load(NULL); }
+
+bool router_start()
+{
+    const char* path = ws_config->routes[0] ? ws_config->routes : NULL;
+    Router* router = Router_load(path);
+    if (router == NULL) {
+        return false;
+    }
+    active = router;
+    return true;
+}
+
+const Router* router_active()
+{
+    if (active) {
+        return active;
+    }
+    pthread_once(&builtin_once, builtin_init);
+    return builtin;
+}
@@ -0,0 +1,51 @@
+#ifndef NBH_ROUTER_HEADER
+#define NBH_ROUTER_HEADER
+
+#include "common.h"
+
+#include <stdbool.h>
+
+// A routes file has one rule per line, # starts a comment:
+//
+//     rewrite /inside/ /index.html          exact path
+//     rewrite /docs/* /manual/*             prefix, the rest of the uri follows the target
+//     rewrite /old/* /index.html            prefix, the rest is dropped
+//     rewrite *.php /index.html             extension of the last path segment
+//     redirect 301 /blog/* https://blog.example.com/*
+
+/* Rewrite and redirect rules compiled into a trie.
+ *
+ * A rewrite changes the file served, a redirect answers with its status
+ * and a Location header. An exact rule beats the longest matching prefix,
+ * which beats an extension rule; a pattern given twice keeps the last rule.
+ * "/" and "/inside/" rewrite to "/index.html" unless the file says otherwise.
+ *
+ * Paths are one trie and extensions another, each node keeps its edges
+ * sorted in one array, so routing walks the uri once however many rules
+ * there are.
+ */
+typedef struct Router Router;
+
+// the builtin rules and those in the file at path, or only the builtins when path is NULL; NULL after printing why
+Router* Router_load(const char* path);
+
+void Router_destroy(Router* router);
+
+/* Routes uri in place, writing its path under root or the redirect target.
+ *
+ * Returns 0 when uri holds the path of the file to serve, the 3xx status
+ * when it holds the Location to redirect to, and -1 when the result does
+ * not fit.
+ */
+int Router_route(const Router* router, char uri[WS_URI_BUFFER_SIZE], const char* root);
+
+/* Compiles the routes file of the configuration for uri_to_path(), before
+ * forking so every worker shares it. Until then only the builtin rules
+ * apply. Returns false after printing why.
+ */
+bool router_start();
+
+// the router uri_to_path() uses
+const Router* router_active();
+
+#endif
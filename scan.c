@@ -0,0 +1,93 @@
+#include "scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+// finds the first byte equal to a, b or c, pass a byte twice for fewer
+typedef size_t (*scan_fn)(const char* src, size_t len, char a, char b, char c);
+
+static size_t scan3_scalar(const char* src, size_t len, char a, char b, char c)
+{
+    for (size_t i = 0; i < len; i++) {
+        char x = src[i];
+        if (x == a || x == b || x == c) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#if SCAN_X86
+__attribute__((target("sse2"))) static size_t scan3_sse2(const char* src, size_t len, char a, char b, char c)
+{
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan3_scalar(src + i, len - i, a, b, c);
+}
+
+__attribute__((target("avx2"))) static size_t scan3_avx2(const char* src, size_t len, char a, char b, char c)
+{
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+            _mm256_cmpeq_epi8(v, vc)
+        );
+        uint32_t mask = _mm256_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    // most request lines end in the last partial block
+    return i + scan3_sse2(src + i, len - i, a, b, c);
+}
+#endif
+
+static scan_fn scan3 = scan3_scalar;
+
+int scan_select(int isa)
+{
+#if SCAN_X86
+    __builtin_cpu_init();
+    if (isa >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        scan3 = scan3_avx2;
+        return SCAN_AVX2;
+    }
+    if (isa >= SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+        scan3 = scan3_sse2;
+        return SCAN_SSE2;
+    }
+#endif
+    scan3 = scan3_scalar;
+    return SCAN_SCALAR;
+}
+
+__attribute__((constructor)) static void scan_init() { scan_select(SCAN_AVX2); }
+
+size_t scan_lf(const char* src, size_t len) { return scan3(src, len, '\n', '\n', '\n'); }
+
+size_t scan_space(const char* src, size_t len) { return scan3(src, len, ' ', '\r', '\t'); }
+
+size_t scan_colon(const char* src, size_t len) { return scan3(src, len, ':', ':', ':'); }
+
+size_t scan_cr_or_nul(const char* src, size_t len) { return scan3(src, len, '\r', '\0', '\0'); }
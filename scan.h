@@ -0,0 +1,36 @@
+#ifndef NBH_SCAN_HEADER
+#define NBH_SCAN_HEADER
+
+#include <stddef.h>
+
+/* Vectorized byte scanners for the request parser.
+ *
+ * Each returns the index of the first match in src[0, len) or len when
+ * there is none. The best implementation the cpu supports is picked at
+ * startup: AVX2 (32 bytes per step), SSE2 (16) or plain C.
+ */
+
+// first '\n'
+size_t scan_lf(const char* src, size_t len);
+
+// first ' ', '\r' or '\t', the whitespace parse_word splits on
+size_t scan_space(const char* src, size_t len);
+
+// first ':'
+size_t scan_colon(const char* src, size_t len);
+
+// first '\r' or '\0', what http_nlen stops on
+size_t scan_cr_or_nul(const char* src, size_t len);
+
+#define SCAN_SCALAR 0
+#define SCAN_SSE2 1
+#define SCAN_AVX2 2
+
+/* Switches implementation, returns the one now in use.
+ *
+ * Asking for more than the cpu has gives the best it does have. Only
+ * meant for tests and benchmarks.
+ */
+int scan_select(int isa);
+
+#endif
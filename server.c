@@ -1,24 +1,58 @@
+#define _GNU_SOURCE
+
+#include "accesslog.h"
 #include "common.h"
+#include "epoll_loop.h"
+#include "file_cache.h"
+#include "hot_cache.h"
+#include "metrics.h"
+#include "router.h"
+#include "tls.h"
+#include "uring_loop.h"
+#include "watcher.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
-#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#define BACKLOG 128
-#define CHUNK_SIZE 16384
+// a worker that dies this soon after being forked is not respawned right away
+#define WS_RESPAWN_BACKOFF 1000
 
 static int sfd = -1;
-static int cfd = -1;
+
+typedef struct {
+    pid_t pid;
+    struct timespec started;
+} Worker;
+
+// pid 0 when the slot is empty
+static Worker workers[WS_MAX_WORKERS];
+static int worker_count = 0;
+// keeps meta_cache in step with the files, -1 when not running
+static pid_t watcher_pid = -1;
+// writes the access log, -1 when not running
+static pid_t logger_pid = -1;
+static struct timespec logger_started;
+static const char* port_str = NULL;
+
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+static int engine = ENGINE_EPOLL;
+static MetaCache* meta_cache = NULL;
+static const char* archive_file = NULL;
+static bool zerocopy = false;
+static TlsContext* tls = NULL;
 
 #define Fatal(rv, call)                                                                                                \
     {                                                                                                                  \
@@ -52,128 +86,414 @@ void netprint(const char* buffer, size_t size);
 void parent_setup_signal_handlers();
 void child_setup_signal_handlers();
 
+void raise_fd_limit();
+void spawn_worker(int slot);
+void spawn_watcher();
+void spawn_logger();
+void supervise_workers();
+int run_engine();
+
+// the workers setting with auto resolved to one per online core
+static int workers_wanted()
+{
+    if (ws_config->workers >= 0) {
+        return ws_config->workers;
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online <= 0 ? 1 : online < WS_MAX_WORKERS ? online : WS_MAX_WORKERS;
+}
+
+// "key=" value as one override, the shorthand options are applied like -o
+static const char* shorthand(const char* key, const char* value)
+{
+    char* key_value = malloc(strlen(key) + strlen(value) + 1);
+    if (key_value) {
+        strcpy(key_value, key);
+        strcat(key_value, value);
+    }
+    return key_value;
+}
+
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
+    const char* cert_file = NULL;
+    const char* key_file = NULL;
+    const char* config_file = NULL;
+    // in the order given, later ones win
+    const char** overrides = calloc(argc, sizeof(char*));
+    int override_count = 0;
+    if (overrides == NULL) {
+        return 1;
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "w:e:t:m:zc:k:a:f:o:")) != -1) {
+        switch (opt) {
+        case 'w':
+            overrides[override_count++] = shorthand("workers=", optarg);
+            break;
+        case 't':
+            overrides[override_count++] = shorthand("fs_threads=", optarg);
+            break;
+        case 'm':
+            overrides[override_count++] = shorthand("hot_cache_mb=", optarg);
+            break;
+        case 'o':
+            overrides[override_count++] = optarg;
+            break;
+        case 'f':
+            config_file = optarg;
+            break;
+        case 'z':
+            zerocopy = true;
+            break;
+        case 'c':
+            cert_file = optarg;
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'a':
+            archive_file = optarg;
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                engine = ENGINE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                engine = ENGINE_URING;
+            } else {
+                useage();
+                return 1;
+            }
+            break;
+        default:
+            useage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || (cert_file == NULL) != (key_file == NULL)) {
         useage();
         return 1;
     }
+    port_str = argv[optind];
+    for (int i = 0; i < override_count; i++) {
+        if (overrides[i] == NULL) {
+            return 1;
+        }
+    }
+    // before anything reads ws_config, the workers inherit it
+    if (!config_start(config_file, overrides, override_count)) {
+        return 1;
+    }
+    if (!router_start()) {
+        return 1;
+    }
+    // mapped before forking so every worker shares it
+    if (!metrics_start()) {
+        DebugErr("nothing is recorded for %s\n", ws_config->metrics_path);
+    }
+    if (ws_config->access_log[0] && !accesslog_start()) {
+        return 1;
+    }
+    worker_count = workers_wanted();
+
+    if (cert_file) {
+        // loaded before forking, every worker gets a copy
+        tls = TlsContext_create(cert_file, key_file);
+        if (tls == NULL) {
+            return 1;
+        }
+        if (engine == ENGINE_URING) {
+            DebugErr("TLS needs the epoll engine, using it\n");
+            engine = ENGINE_EPOLL;
+        }
+    }
+
+    if (engine == ENGINE_URING && !uring_loop_supported()) {
+        DebugErr("io_uring is not available, falling back to epoll\n");
+        engine = ENGINE_EPOLL;
+    }
 
     parent_setup_signal_handlers();
+    raise_fd_limit();
+
+    // mapped before forking so every worker shares it
+    meta_cache = MetaCache_create(ws_config->meta_entries);
+    if (meta_cache == NULL) {
+        int en = errno;
+        DebugErr("MetaCache_create() %s, files are not cached\n", strerror(en));
+    }
+    metrics_meta_cache(meta_cache);
+    if (archive_file) {
+        // checked once here, every worker maps it itself and then follows renames on its own
+        Archive* archive = Archive_open(archive_file);
+        if (archive == NULL || meta_cache == NULL) {
+            return 1;
+        }
+        Archive_release(archive);
+    }
 
     Address server_address;
     int rv;
 
-    Fatal(sfd, bind_socket(NULL, argv[1], &server_address));
-    FatalCheckErrno(rv, listen(sfd, BACKLOG), "listen");
+    // the parent binds first so a bad port fails here instead of in every worker
+    Fatal(sfd, bind_socket(NULL, port_str, true, &server_address));
+    if (meta_cache && archive_file == NULL) {
+        spawn_watcher();
+    }
+    if (ws_config->access_log[0]) {
+        spawn_logger();
+    }
 
-    Address client_address;
-    while (1) {
-        cfd = accept(sfd, Address_sockaddr(&client_address), &client_address.addrlen);
-        if (cfd < 0) {
-            int en = errno;
-            DebugErr("accept() %s\n", strerror(en));
+    if (worker_count == 0) {
+        // serve from this process, handy under a debugger
+        metrics_worker(WS_MAX_WORKERS);
+        accesslog_worker(WS_MAX_WORKERS);
+        FatalCheckErrno(rv, listen(sfd, ws_config->backlog), "listen");
+        return run_engine();
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        spawn_worker(i);
+    }
+    supervise_workers();
+    return 0;
+}
+
+// cached descriptors come on top of one per connection
+void raise_fd_limit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur >= limit.rlim_max) {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        int en = errno;
+        DebugErr("setrlimit() %s\n", strerror(en));
+    }
+}
+
+static void pin_to_cpu(int slot)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        int en = errno;
+        DebugErr("sched_getaffinity() %s\n", strerror(en));
+        return;
+    }
+    int cpu_count = CPU_COUNT(&allowed);
+    if (cpu_count == 0) {
+        return;
+    }
+
+    // slot n goes on the n-th cpu this process is allowed to use
+    int nth = slot % cpu_count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
             continue;
         }
-        int cpid;
-        if (!(cpid = fork())) {
-            child_setup_signal_handlers();
-            close(sfd); // close listener
-            cpid = getpid();
-
-            struct pollfd pfd[1];
-            pfd[0].fd = cfd;
-            pfd[0].events = POLLIN;
-
-            char recv_buff[WS_BUFFER_SIZE];
-            size_t recv_buffer_index = 0;
-            memset(recv_buff, 0, WS_BUFFER_SIZE);
-
-            char send_buff[CHUNK_SIZE];
-
-            for (size_t r = 0; r < 500; r++) {
-                int num_events = poll(pfd, 1, WS_CHILD_TIMEOUT);
-                if (num_events == 0) {
-                    goto clean_exit;
-                }
-                if (num_events > 0 && pfd[0].revents & POLLIN) {
-                    int recv_count = recv(cfd, recv_buff + recv_buffer_index, WS_BUFFER_SIZE - recv_buffer_index, 0);
-                    if (recv_count < 0) {
-                        int en = errno;
-                        DebugErr("recv() %s\n", strerror(en));
-                        goto clean_exit;
-                    } else if (recv_count == 0) {
-                        // client has closed the connection
-                        goto clean_exit;
-                    } else if (http_nlen(recv_buff, WS_BUFFER_SIZE) == WS_BUFFER_SIZE) {
-                        // need more data from recv
-                        recv_buffer_index += recv_count;
-                        continue;
-                    }
-
-                    HttpRequest request = HttpRequest_create(recv_buff);
-                    HttpResponse response = HttpResponse_create(&request, send_buff, CHUNK_SIZE);
-
-                    // send header
-                    size_t header_bytes_sent = 0;
-                    while (header_bytes_sent < response.header_size) {
-                        rv = send(
-                            cfd,
-                            send_buff + header_bytes_sent,
-                            response.header_size - header_bytes_sent,
-                            MSG_NOSIGNAL
-                        );
-                        if (rv < 0) {
-                            int en = errno;
-                            DebugErr("send() %s\n", strerror(en));
-                            goto clean_exit;
-                        }
-                        header_bytes_sent += rv;
-                    }
-
-                    // send the file
-                    if (response.code == 200 && request.line.method == REQ_METHOD_GET) {
-                        sendfile(cfd, response.fd, NULL, response.file_size);
-                        close(response.fd);
-                    }
-
-                    const char* connect_str = "none";
-                    if (request.headers.connection == REQ_CONNECTION_KEEP_ALIVE) {
-                        connect_str = "keep-alive";
-                    } else if (request.headers.connection == REQ_CONNECTION_CLOSE) {
-                        connect_str = "close";
-                    }
-                    DebugMsg(
-                        "%i: %s%i%s %-48s Connection: %s\n",
-                        cpid,
-                        response.code == 200 ? "\e[32m" : "\e[31m",
-                        response.code,
-                        "\e[0m",
-                        request.line.uri,
-                        connect_str
-                    );
-
-                    if (request.headers.connection != REQ_CONNECTION_KEEP_ALIVE) {
-                        goto clean_exit;
-                    }
-
-                    // clear recv_buff
-                    memset(recv_buff, 0, recv_count);
-                    recv_buffer_index = 0;
-                }
+        if (nth-- == 0) {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            if (sched_setaffinity(0, sizeof(pinned), &pinned) < 0) {
+                int en = errno;
+                DebugErr("sched_setaffinity() %s\n", strerror(en));
             }
+            return;
+        }
+    }
+}
+
+static void worker_main(int slot)
+{
+    child_setup_signal_handlers();
+    // the parents socket never listens, each worker gets its own
+    close(sfd);
+    sfd = -1;
 
-        clean_exit:
-            shutdown(cfd, SHUT_RDWR);
-            fflush(stdout);
-            fflush(stderr);
-            exit(EXIT_SUCCESS);
+    pin_to_cpu(slot);
+    metrics_worker(slot);
+    accesslog_worker(slot);
+
+    Address worker_address;
+    int rv;
+    Fatal(sfd, bind_socket(NULL, port_str, true, &worker_address));
+    FatalCheckErrno(rv, listen(sfd, ws_config->backlog), "listen");
+    DebugMsg("worker %i listening in slot %i\n", getpid(), slot);
+
+    run_engine();
+    fflush(stdout);
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+}
+
+int run_engine()
+{
+    Archive* archive = NULL;
+    if (archive_file && (archive = Archive_open(archive_file)) == NULL) {
+        return -1;
+    }
+    size_t hot_budget = (size_t)ws_config->hot_cache_mb << 20;
+    if (engine == ENGINE_URING) {
+        return uring_loop_run(sfd, meta_cache, archive, hot_budget);
+    }
+    return epoll_loop_run(sfd, ws_config->fs_threads, meta_cache, archive, hot_budget, zerocopy, tls);
+}
+
+void spawn_worker(int slot)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        int en = errno;
+        DebugErr("fork() %s\n", strerror(en));
+        workers[slot].pid = 0;
+        return;
+    } else if (pid == 0) {
+        worker_main(slot);
+    }
+    workers[slot].pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &workers[slot].started);
+}
+
+void spawn_watcher()
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        int en = errno;
+        DebugErr("fork() %s, cached file info expires after %i ms\n", strerror(en), ws_config->meta_ttl);
+        return;
+    } else if (pid == 0) {
+        child_setup_signal_handlers();
+        close(sfd);
+        // never outlive the server, the cache would be trusted with nobody watching
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        watcher_run(meta_cache);
+        fflush(stdout);
+        fflush(stderr);
+        exit(EXIT_SUCCESS);
+    }
+    watcher_pid = pid;
+}
+
+void spawn_logger()
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        int en = errno;
+        DebugErr("fork() %s, responses are not logged\n", strerror(en));
+        return;
+    } else if (pid == 0) {
+        child_setup_signal_handlers();
+        close(sfd);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        accesslog_run();
+        fflush(stdout);
+        fflush(stderr);
+        exit(EXIT_SUCCESS);
+    }
+    logger_pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &logger_started);
+}
+
+static long ms_since(const struct timespec* then)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// after a reload, spawns the slots that were added and stops the ones dropped
+static void resize_workers()
+{
+    int count = workers_wanted();
+    if (count == worker_count) {
+        return;
+    }
+    DebugMsg("parent %i going from %i to %i workers\n", getpid(), worker_count, count);
+    for (int i = count; i < worker_count; i++) {
+        if (workers[i].pid > 0) {
+            // reaped below without being replaced
+            kill(workers[i].pid, SIGINT);
+        }
+    }
+    int before = worker_count;
+    worker_count = count;
+    for (int i = before; i < count; i++) {
+        if (workers[i].pid == 0) {
+            spawn_worker(i);
         }
+    }
+}
 
-        // if parent shutdown(clie_fd, SHUT_WR) then childs pipe will break.
-        // so child is responsable for shutting down the socket
-        close(cfd);
-        cfd = -1;
+/* parent loop, reaps and replaces workers and follows reloads.
+ *
+ * SIGCHLD and SIGHUP stay blocked and are taken with sigwaitinfo(), so one
+ * arriving between looking for work and waiting is still pending then.
+ */
+void supervise_workers()
+{
+    sigset_t wanted;
+    sigemptyset(&wanted);
+    sigaddset(&wanted, SIGCHLD);
+    sigaddset(&wanted, SIGHUP);
+    sigprocmask(SIG_BLOCK, &wanted, NULL);
+    while (true) {
+        // also picks up a SIGHUP the handler took before the mask was set
+        if (config_refresh()) {
+            resize_workers();
+        }
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0) {
+            if (sigwaitinfo(&wanted, NULL) == SIGHUP) {
+                config_request_reload();
+            }
+            continue;
+        } else if (pid < 0) {
+            int en = errno;
+            DebugErr("waitpid() %s\n", strerror(en));
+            sleep(1);
+            continue;
+        }
+
+        if (pid == logger_pid) {
+            // the records wait in the rings until a new one is up
+            logger_pid = -1;
+            DebugMsg("\e[31m%i\e[0m logger exited, status %i\n", pid, status);
+            if (ms_since(&logger_started) < WS_RESPAWN_BACKOFF) {
+                usleep(WS_RESPAWN_BACKOFF * 1000);
+            }
+            spawn_logger();
+            continue;
+        }
+        if (pid == watcher_pid) {
+            // until a new one is up the cache goes back to its TTL
+            MetaCache_set_watched(meta_cache, false);
+            watcher_pid = -1;
+            DebugMsg("\e[31m%i\e[0m watcher exited, status %i\n", pid, status);
+            if (WIFSIGNALED(status)) {
+                usleep(WS_RESPAWN_BACKOFF * 1000);
+                spawn_watcher();
+            }
+            continue;
+        }
+        for (int i = 0; i < WS_MAX_WORKERS; i++) {
+            if (workers[i].pid != pid) {
+                continue;
+            }
+            DebugMsg("\e[31m%i\e[0m worker in slot %i exited, status %i\n", pid, i, status);
+            workers[i].pid = 0;
+            if (i >= worker_count) {
+                break;
+            }
+            if (ms_since(&workers[i].started) < WS_RESPAWN_BACKOFF) {
+                usleep(WS_RESPAWN_BACKOFF * 1000);
+            }
+            spawn_worker(i);
+            break;
+        }
     }
 }
 
@@ -181,6 +501,21 @@ void parent_sigint_handler(int signal)
 {
     DebugMsg("parent %i SIGINT handler\n", getpid());
 
+    // workers only see the signal on their own when it came from a terminal
+    int stopping = 0;
+    for (int i = 0; i < WS_MAX_WORKERS; i++) {
+        if (workers[i].pid > 0 && kill(workers[i].pid, SIGINT) == 0) {
+            stopping++;
+        }
+    }
+    if (watcher_pid > 0 && kill(watcher_pid, SIGINT) == 0) {
+        stopping++;
+    }
+    // the logger goes last, once no worker can append to its ring any more
+    if (stopping == 0 && logger_pid > 0) {
+        kill(logger_pid, SIGINT);
+    }
+
     int child_pid = 0;
     int status = 0;
     while (true) {
@@ -193,11 +528,15 @@ void parent_sigint_handler(int signal)
             DebugMsg("wait() %s\n", strerror(en));
         } else {
             DebugMsg("\e[31m%i\e[0m reaped child, status %i\n", child_pid, status);
+            if (child_pid != logger_pid && --stopping == 0 && logger_pid > 0) {
+                kill(logger_pid, SIGINT);
+            }
         }
     }
 
+    // the parents socket is bound but never listens, that is not an error
     int rv = shutdown(sfd, 2);
-    if (rv < 0) {
+    if (rv < 0 && errno != ENOTCONN) {
         int en = errno;
         DebugErr("shutdown() %s\n", strerror(en));
     }
@@ -206,6 +545,9 @@ void parent_sigint_handler(int signal)
     exit(0);
 }
 
+// reload the configuration file
+void parent_sighup_handler(int signal) { config_request_reload(); }
+
 void parent_setup_signal_handlers()
 {
     int rv;
@@ -213,11 +555,19 @@ void parent_setup_signal_handlers()
     sigemptyset(&sa.sa_mask);
 
     sa.sa_flags = 0;
-    sa.sa_handler = SIG_IGN;
+    // workers are reaped by supervise_workers() so they can be respawned
+    sa.sa_handler = SIG_DFL;
     FatalCheckErrno(rv, sigaction(SIGCHLD, &sa, NULL), "SIGCHLD sigaction()");
+    // sendfile() has no MSG_NOSIGNAL, a reset peer must not kill the server
+    sa.sa_handler = SIG_IGN;
+    FatalCheckErrno(rv, sigaction(SIGPIPE, &sa, NULL), "SIGPIPE sigaction()");
 
     sa.sa_handler = parent_sigint_handler;
     FatalCheckErrno(rv, sigaction(SIGINT, &sa, NULL), "parent SIGINT sigaction()");
+
+    // only until supervise_workers() blocks it and waits for it instead
+    sa.sa_handler = parent_sighup_handler;
+    FatalCheckErrno(rv, sigaction(SIGHUP, &sa, NULL), "parent SIGHUP sigaction()");
 }
 
 void child_setup_signal_handlers()
@@ -230,7 +580,17 @@ void child_setup_signal_handlers()
 
     sa.sa_handler = SIG_DFL;
     FatalCheckErrno(rv, sigaction(SIGINT, &sa, NULL), "reset child SIGINT sigaction()");
-    FatalCheckErrno(rv, sigaction(SIGINT, &sa, NULL), "child SIGINT sigaction()");
+
+    // only the parent reloads, the children pick the result up from it
+    sa.sa_handler = SIG_IGN;
+    FatalCheckErrno(rv, sigaction(SIGHUP, &sa, NULL), "child SIGHUP sigaction()");
+
+    // forked from supervise_workers() with the signals it waits for blocked
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGHUP);
+    sigprocmask(SIG_UNBLOCK, &blocked, NULL);
 }
 
-void useage() { DebugErr("./server <port number>\n"); }
+void useage() { DebugErr("./server [-f config] [-o key=value] [-w workers] [-e epoll|uring] [-t fs threads] [-m hot cache MiB] [-z] [-c cert.pem -k key.pem] [-a site.pack] <port number>\n"); }
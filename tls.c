@@ -0,0 +1,232 @@
+#include "tls.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if WS_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/sendfile.h>
+
+// the most plaintext one TLS record carries
+#define TLS_RECORD 16384
+
+struct TlsContext {
+    SSL_CTX* ctx;
+};
+
+struct Tls {
+    SSL* ssl;
+    bool kernel_send;
+};
+
+TlsContext* TlsContext_create(const char* cert_file, const char* key_file)
+{
+    TlsContext* tls = calloc(1, sizeof(TlsContext));
+    if (tls == NULL) {
+        return NULL;
+    }
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if (tls->ctx == NULL) {
+        goto fail;
+    }
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+    // writes are retried from a rebuilt iovec, possibly longer than before
+    SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls->ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls->ctx) != 1) {
+        goto fail;
+    }
+    return tls;
+
+fail:
+    DebugErr("TLS setup with %s and %s failed\n", cert_file, key_file);
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(tls->ctx);
+    free(tls);
+    return NULL;
+}
+
+Tls* Tls_create(TlsContext* ctx, int fd)
+{
+    Tls* tls = calloc(1, sizeof(Tls));
+    if (tls == NULL) {
+        return NULL;
+    }
+    tls->ssl = SSL_new(ctx->ctx);
+    if (tls->ssl == NULL || SSL_set_fd(tls->ssl, fd) != 1) {
+        ERR_clear_error();
+        SSL_free(tls->ssl);
+        free(tls);
+        return NULL;
+    }
+    SSL_set_accept_state(tls->ssl);
+    return tls;
+}
+
+void Tls_destroy(Tls* tls)
+{
+    if (SSL_is_init_finished(tls->ssl)) {
+        SSL_shutdown(tls->ssl);
+    }
+    ERR_clear_error();
+    SSL_free(tls->ssl);
+    free(tls);
+}
+
+// maps a failed SSL call onto errno, -1 always
+static int tls_error(Tls* tls, int rv)
+{
+    int err = SSL_get_error(tls->ssl, rv);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+    } else if (err != SSL_ERROR_SYSCALL || errno == 0) {
+        errno = EPROTO;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+int Tls_handshake(Tls* tls)
+{
+    ERR_clear_error();
+    int rv = SSL_do_handshake(tls->ssl);
+    if (rv == 1) {
+        tls->kernel_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+        DebugMsg("%i: TLS handshake done, %s, kTLS send %s\n", getpid(), SSL_get_cipher_name(tls->ssl),
+                 tls->kernel_send ? "on" : "off");
+        return 1;
+    }
+    if (tls_error(tls, rv) < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    return -1;
+}
+
+bool Tls_kernel_send(const Tls* tls) { return tls->kernel_send; }
+
+ssize_t Tls_recv(Tls* tls, void* buf, size_t len)
+{
+    ERR_clear_error();
+    size_t n;
+    int rv = SSL_read_ex(tls->ssl, buf, len, &n);
+    if (rv == 1) {
+        return n;
+    } else if (SSL_get_error(tls->ssl, rv) == SSL_ERROR_ZERO_RETURN) {
+        ERR_clear_error();
+        return 0;
+    }
+    return tls_error(tls, rv);
+}
+
+static ssize_t tls_write(Tls* tls, const void* buf, size_t len)
+{
+    ERR_clear_error();
+    size_t n;
+    int rv = SSL_write_ex(tls->ssl, buf, len, &n);
+    if (rv == 1) {
+        return n;
+    }
+    return tls_error(tls, rv);
+}
+
+ssize_t Tls_sendv(Tls* tls, const struct iovec* iov, int iovcnt)
+{
+    if (iovcnt == 1 || iov[0].iov_len >= TLS_RECORD) {
+        return tls_write(tls, iov[0].iov_base, iov[0].iov_len);
+    }
+    // small pieces share a record rather than each getting their own
+    char record[TLS_RECORD];
+    size_t len = 0;
+    for (int i = 0; i < iovcnt && len < TLS_RECORD; i++) {
+        size_t k = iov[i].iov_len < TLS_RECORD - len ? iov[i].iov_len : TLS_RECORD - len;
+        memcpy(record + len, iov[i].iov_base, k);
+        len += k;
+    }
+    return tls_write(tls, record, len);
+}
+
+ssize_t Tls_sendfile(Tls* tls, int fd, off_t* offset, size_t count)
+{
+    if (tls->kernel_send) {
+        return sendfile(SSL_get_fd(tls->ssl), fd, offset, count);
+    }
+    char record[TLS_RECORD];
+    ssize_t len = pread(fd, record, count < TLS_RECORD ? count : TLS_RECORD, *offset);
+    if (len <= 0) {
+        return len;
+    }
+    ssize_t rv = tls_write(tls, record, len);
+    if (rv > 0) {
+        *offset += rv;
+    }
+    return rv;
+}
+
+#else
+
+TlsContext* TlsContext_create(const char* cert_file, const char* key_file)
+{
+    (void)cert_file;
+    (void)key_file;
+    DebugErr("built without TLS, rebuild with make TLS=1\n");
+    return NULL;
+}
+
+Tls* Tls_create(TlsContext* ctx, int fd)
+{
+    (void)ctx;
+    (void)fd;
+    return NULL;
+}
+
+void Tls_destroy(Tls* tls) { (void)tls; }
+
+int Tls_handshake(Tls* tls)
+{
+    (void)tls;
+    return -1;
+}
+
+bool Tls_kernel_send(const Tls* tls)
+{
+    (void)tls;
+    return false;
+}
+
+ssize_t Tls_recv(Tls* tls, void* buf, size_t len)
+{
+    (void)tls;
+    (void)buf;
+    (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t Tls_sendv(Tls* tls, const struct iovec* iov, int iovcnt)
+{
+    (void)tls;
+    (void)iov;
+    (void)iovcnt;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t Tls_sendfile(Tls* tls, int fd, off_t* offset, size_t count)
+{
+    (void)tls;
+    (void)fd;
+    (void)offset;
+    (void)count;
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
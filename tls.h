@@ -0,0 +1,50 @@
+#ifndef NBH_TLS_HEADER
+#define NBH_TLS_HEADER
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// set by make TLS=1, which also links OpenSSL
+#ifndef WS_TLS
+#define WS_TLS 0
+#endif
+
+/* TLS termination for the epoll engine.
+ *
+ * The handshake runs in OpenSSL, which then hands the session keys to the
+ * kernel (kTLS) where it can. From there on the socket takes plaintext:
+ * sendmsg() and sendfile() work unchanged and file bodies still go from
+ * the page cache to the socket without passing through userspace. Without
+ * kTLS every byte goes through Tls_sendv/Tls_sendfile instead.
+ *
+ * All calls are non-blocking, -1 with errno EAGAIN means try again once the
+ * socket is ready, with the same or more data.
+ */
+typedef struct TlsContext TlsContext;
+typedef struct Tls Tls;
+
+// NULL after saying why when the files do not load or TLS is not compiled in
+TlsContext* TlsContext_create(const char* cert_file, const char* key_file);
+
+Tls* Tls_create(TlsContext* ctx, int fd);
+
+// sends close_notify if it can, does not close fd
+void Tls_destroy(Tls* tls);
+
+// 1 once done, 0 when the socket would block, -1 on failure
+int Tls_handshake(Tls* tls);
+
+// true when the kernel encrypts whatever is written to the socket
+bool Tls_kernel_send(const Tls* tls);
+
+// like recv(), 0 once the peer closed
+ssize_t Tls_recv(Tls* tls, void* buf, size_t len);
+
+// like writev(), at most one record per call
+ssize_t Tls_sendv(Tls* tls, const struct iovec* iov, int iovcnt);
+
+// like sendfile(), at most one record per call
+ssize_t Tls_sendfile(Tls* tls, int fd, off_t* offset, size_t count);
+
+#endif
@@ -1,7 +1,24 @@
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
 
+#include "accesslog.h"
+#include "archive.h"
 #include "common.h"
+#include "file_cache.h"
+#include "hot_cache.h"
+#include "hpack.h"
+#include "metrics.h"
+#include "router.h"
+#include "scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define FILE_COUNT 2
 
@@ -201,6 +218,62 @@ void happy_sanitize_uri(void)
     }
 }
 
+void router_rules(void)
+{
+    char path[] = "/tmp/nbh_routes_XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT_FATAL(fd >= 0);
+    FILE* file = fdopen(fd, "w");
+    fprintf(file, "rewrite /docs/* /manual/*  # moved\n"
+                  "rewrite /docs/old/* /index.html\n"
+                  "rewrite /docs/keep /keep.html\n"
+                  "rewrite *.php /index.html\n"
+                  "redirect 301 /blog/* https://blog.example.com/*\n"
+                  "redirect 308 / /home/\n");
+    for (int i = 0; i < 300; i++) {
+        fprintf(file, "redirect 301 /legacy/%i.html /pages/%i\n", i, i);
+    }
+    fclose(file);
+    Router* router = Router_load(path);
+    CU_ASSERT_FATAL(router != NULL);
+
+    struct {
+        const char* uri;
+        int status;
+        const char* routed;
+    } tests[] = {
+        {"/docs/a/b.html", 0, "www/manual/a/b.html"},
+        // the longest prefix wins, an exact rule beats any prefix
+        {"/docs/old/x", 0, "www/index.html"},
+        {"/docs/keep", 0, "www/keep.html"},
+        {"/docs/keep2", 0, "www/manual/keep2"},
+        // a prefix beats an extension
+        {"/x/y.php", 0, "www/index.html"},
+        {"/docs/y.php", 0, "www/manual/y.php"},
+        {"/x.php/y", 0, "www/x.php/y"},
+        {"/blog/2020/post", 301, "https://blog.example.com/2020/post"},
+        {"/legacy/123.html", 301, "/pages/123"},
+        {"/legacy/123.htm", 0, "www/legacy/123.htm"},
+        // the file replaced one builtin rule, the other stays
+        {"/", 308, "/home/"},
+        {"/inside/", 0, "www/index.html"},
+        {"/other.html", 0, "www/other.html"},
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        char uri[WS_URI_BUFFER_SIZE] = {};
+        strcpy(uri, tests[i].uri);
+        CU_ASSERT(Router_route(router, uri, "www") == tests[i].status);
+        CU_ASSERT(strcmp(uri, tests[i].routed) == 0);
+    }
+    Router_destroy(router);
+
+    file = fopen(path, "w");
+    fprintf(file, "rewrite docs /x\n");
+    fclose(file);
+    CU_ASSERT(Router_load(path) == NULL);
+    unlink(path);
+}
+
 void happy_connection_parse_header(void)
 {
     char tests[][WS_URI_BUFFER_SIZE] = {
@@ -270,6 +343,38 @@ void happy_request_create()
     }
 }
 
+void header_lookup()
+{
+    const char* names[] = {
+        "Host", "connection", "IF-NONE-MATCH", "If-Modified-Since", "Range", "accept-encoding", "Content-Length",
+        "If-Range", "Upgrade", "HTTP2-Settings", "Content-Type", "Hosts", "Ranges", "Accept", "If-Match", "", "X",
+    };
+    int ans[] = {
+        HDR_HOST, HDR_CONNECTION, HDR_IF_NONE_MATCH, HDR_IF_MODIFIED_SINCE, HDR_RANGE, HDR_ACCEPT_ENCODING,
+        HDR_CONTENT_LENGTH, HDR_IF_RANGE, HDR_UPGRADE, HDR_HTTP2_SETTINGS, -1, -1, -1, -1, -1, -1, -1,
+    };
+    for (size_t i = 0; i < sizeof(ans) / sizeof(int); i++) {
+        CU_ASSERT(header_id(names[i], strlen(names[i])) == ans[i]);
+    }
+
+    char tests[][WS_BUFFER_SIZE] = {
+        "GET / HTTP/1.1\r\nHost:  example.com \r\nUser-Agent: x\r\nAccept-Encoding: gzip\r\n"
+        "accept-encoding: br\r\nRange: bytes=0-1\r\n\r\n",
+        "POST / HTTP/1.1\r\nConnection: keep-alive\r\nContent-Length: 3\r\n\r\nabc",
+    };
+    HttpRequest req = HttpRequest_create(tests[0]);
+    StringView host = HttpHeaders_get(&req.headers, HDR_HOST);
+    StringView ae = HttpHeaders_get(&req.headers, HDR_ACCEPT_ENCODING);
+    StringView range = HttpHeaders_get(&req.headers, HDR_RANGE);
+    CU_ASSERT(host.size == strlen("example.com") && strncmp(host.ptr, "example.com", host.size) == 0);
+    CU_ASSERT(ae.size == strlen("gzip, br") && strncmp(ae.ptr, "gzip, br", ae.size) == 0);
+    CU_ASSERT(range.size == strlen("bytes=0-1") && strncmp(range.ptr, "bytes=0-1", range.size) == 0);
+    CU_ASSERT(HttpHeaders_get(&req.headers, HDR_IF_NONE_MATCH).size == 0);
+
+    req = HttpRequest_create(tests[1]);
+    CU_ASSERT(req.headers.connection == REQ_CONNECTION_CLOSE);
+}
+
 void happy_parse_word()
 {
     char tests[][WS_BUFFER_SIZE] = {
@@ -291,6 +396,853 @@ void happy_parse_word()
     }
 }
 
+void parser_fragmented_feed()
+{
+    const char* req = "GET /css/style.css HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\nGET /";
+    size_t head_len = strlen(req) - strlen("GET /");
+    char buffer[WS_BUFFER_SIZE];
+
+    // every split point, including between \r and \n
+    for (size_t split = 1; split < strlen(req); split++) {
+        HttpParser p;
+        HttpParser_init(&p);
+        memcpy(buffer, req, split);
+        int first = HttpParser_feed(&p, buffer, split);
+        memcpy(buffer + split, req + split, strlen(req) - split);
+        int second = HttpParser_feed(&p, buffer, strlen(req));
+        CU_ASSERT(first == (split >= head_len ? PARSE_DONE : PARSE_INCOMPLETE));
+        CU_ASSERT(second == PARSE_DONE);
+        CU_ASSERT(p.head_len == head_len);
+        CU_ASSERT(p.request.line.method == REQ_METHOD_GET);
+        CU_ASSERT(p.request.line.version == REQ_VERSION_1_1);
+        CU_ASSERT(p.request.headers.connection == REQ_CONNECTION_KEEP_ALIVE);
+        CU_ASSERT(strcmp(p.request.line.uri, "/css/style.css") == 0);
+    }
+
+    // one byte at a time never rescans, scanned only moves forward
+    HttpParser p;
+    HttpParser_init(&p);
+    size_t last_scanned = 0;
+    for (size_t i = 1; i <= head_len; i++) {
+        HttpParser_feed(&p, req, i);
+        CU_ASSERT(p.scanned == i);
+        CU_ASSERT(p.scanned >= last_scanned);
+        last_scanned = p.scanned;
+    }
+    CU_ASSERT(p.state == PARSE_DONE);
+}
+
+void parser_head_too_large()
+{
+    char buffer[WS_BUFFER_SIZE];
+    memset(buffer, 'a', WS_BUFFER_SIZE);
+    HttpParser p;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, buffer, WS_BUFFER_SIZE) == PARSE_ERROR);
+    CU_ASSERT(p.request.line.method == REQ_ERROR_URI_SIZE);
+
+    const char* line = "GET / HTTP/1.1\r\n";
+    memcpy(buffer, line, strlen(line));
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, buffer, WS_BUFFER_SIZE) == PARSE_ERROR);
+    CU_ASSERT(p.request.line.method == REQ_ERROR_HEADERS_PARSE);
+}
+
+void parser_pipelined_heads()
+{
+    const char* buffer = "GET /a.html HTTP/1.1\r\n\r\nHEAD /b.css HTTP/1.0\r\n\r\nGET /c";
+    size_t len = strlen(buffer);
+    HttpParser p;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, buffer, len) == PARSE_DONE);
+    CU_ASSERT(strcmp(p.request.line.uri, "/a.html") == 0);
+    // persistent by default since HTTP/1.1
+    CU_ASSERT(p.request.headers.connection == REQ_CONNECTION_KEEP_ALIVE);
+
+    size_t offset = p.head_len;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, buffer + offset, len - offset) == PARSE_DONE);
+    CU_ASSERT(p.request.line.method == REQ_METHOD_HEAD);
+    CU_ASSERT(strcmp(p.request.line.uri, "/b.css") == 0);
+    CU_ASSERT(p.request.headers.connection == 0);
+
+    offset += p.head_len;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, buffer + offset, len - offset) == PARSE_INCOMPLETE);
+}
+
+void response_headers()
+{
+    const char* buffer = "GET /missing.html HTTP/1.0\r\nConnection: keep-alive\r\n\r\n";
+    HttpParser p;
+    HttpParser_init(&p);
+    CU_ASSERT_FATAL(HttpParser_feed(&p, buffer, strlen(buffer)) == PARSE_DONE);
+    char header[512];
+    HttpResponse ret;
+    FileInfo file = {.err = ENOENT, .fd = -1};
+    CU_ASSERT(!HttpResponse_begin(&p.request, &ret, header));
+    HttpResponse_finish(&p.request, &file, (StringView){}, &ret, header);
+    const char* head = "HTTP/1.0 404 Not Found\r\nConnection: keep-alive\r\nKeep-Alive: timeout=10, max=500\r\n"
+                       "Content-Type: text/html\r\nContent-Length: 49\r\n\r\n";
+    CU_ASSERT(ret.code == 404);
+    CU_ASSERT(ret.header_size == strlen(head) + 49);
+    CU_ASSERT(memcmp(header, head, strlen(head)) == 0);
+
+    // HEAD gets the same header without the body
+    p.request.line.method = REQ_METHOD_HEAD;
+    HttpResponse_finish(&p.request, &file, (StringView){}, &ret, header);
+    CU_ASSERT(ret.header_size == strlen(head));
+
+    FileInfo found = {.fd = -1, .size = 1234567, .content_type = content_type_id("a.css")};
+    p.request.headers.connection = REQ_CONNECTION_CLOSE;
+    HttpResponse_finish(&p.request, &found, (StringView){}, &ret, header);
+    const char* ok = "HTTP/1.0 200 Ok\r\nConnection: close\r\nContent-Type: text/css\r\nContent-Length: 1234567\r\nETag: ";
+    CU_ASSERT(ret.code == 200 && ret.file_size == 1234567);
+    CU_ASSERT(ret.header_size > strlen(ok) && memcmp(header, ok, strlen(ok)) == 0);
+    CU_ASSERT(memcmp(header + ret.header_size - 4, "\r\n\r\n", 4) == 0);
+}
+
+// the status of the answer to head, built from the cached entity header when there is one
+static uint32_t entity_code(const char* head, const FileInfo* file, StringView entity, char* header)
+{
+    HttpParser p;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, head, strlen(head)) == PARSE_DONE);
+    HttpResponse ret;
+    HttpResponse_finish(&p.request, file, entity, &ret, header);
+    header[ret.header_size] = '\0';
+    return ret.code;
+}
+
+static uint32_t conditional_code(const char* head, const FileInfo* file, char* header)
+{
+    return entity_code(head, file, (StringView){}, header);
+}
+
+void conditional_get()
+{
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    FileInfo file = {.fd = -1, .size = 10, .mtime_ns = 784111777000000000, .ino = 0xabc, .content_type = 0};
+    char header[512];
+    char request[256];
+    CU_ASSERT(conditional_code("GET / HTTP/1.1\r\n\r\n", &file, header) == 200);
+    CU_ASSERT(strstr(header, "ETag: \"abc-a-ae1b981bc490a00\"\r\n") != NULL);
+    CU_ASSERT(strstr(header, "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n") != NULL);
+
+    const char* matching[] = {"\"abc-a-ae1b981bc490a00\"", "W/\"abc-a-ae1b981bc490a00\"", "\"x\", \"abc-a-ae1b981bc490a00\"", "*"};
+    for (size_t i = 0; i < sizeof(matching) / sizeof(matching[0]); i++) {
+        snprintf(request, sizeof(request), "GET / HTTP/1.1\r\nIf-None-Match: %s\r\n\r\n", matching[i]);
+        CU_ASSERT(conditional_code(request, &file, header) == 304);
+        CU_ASSERT(strstr(header, "Content-Length") == NULL && strstr(header, "ETag: ") != NULL);
+    }
+    CU_ASSERT(conditional_code("HEAD / HTTP/1.1\r\nIf-None-Match: \"abc-a-1\"\r\n\r\n", &file, header) == 200);
+
+    CU_ASSERT(conditional_code("GET / HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", &file, header) == 304);
+    CU_ASSERT(conditional_code("GET / HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:36 GMT\r\n\r\n", &file, header) == 200);
+    CU_ASSERT(conditional_code("GET / HTTP/1.1\r\nIf-Modified-Since: yesterday\r\n\r\n", &file, header) == 200);
+    // If-None-Match wins over a matching date
+    CU_ASSERT(
+        conditional_code(
+            "GET / HTTP/1.1\r\nIf-None-Match: \"old\"\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", &file, header
+        ) == 200
+    );
+
+    // a stored header is sliced after its own Content-Length line, whatever type it was built with
+    const char* stored = "Content-Type: application/x-from-another-table\r\nContent-Length: 10\r\nETag: \"stored\"\r\n\r\n";
+    StringView entity = {stored, strlen(stored)};
+    CU_ASSERT(entity_code("GET / HTTP/1.1\r\nIf-None-Match: *\r\n\r\n", &file, entity, header) == 304);
+    CU_ASSERT(strcmp(header + strlen(header) - 18, "ETag: \"stored\"\r\n\r\n") == 0 && strstr(header, "Type") == NULL);
+    CU_ASSERT(entity_code("GET / HTTP/1.1\r\nRange: bytes=1-2\r\n\r\n", &file, entity, header) == 206);
+    CU_ASSERT(strstr(header, "Content-Range: bytes 1-2/10\r\nETag: \"stored\"\r\n\r\n") != NULL);
+}
+
+static int ranges_of(const char* head, const FileInfo* file, ByteRange* ranges)
+{
+    HttpParser p;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, head, strlen(head)) == PARSE_DONE);
+    return parse_ranges(&p.request, file, ranges);
+}
+
+void byte_ranges()
+{
+    FileInfo file = {.fd = -1, .size = 1000, .mtime_ns = 784111777000000000, .ino = 0xabc, .content_type = 0};
+    ByteRange r[WS_RANGE_MAX];
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\n\r\n", &file, r) == 0);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=0-499\r\n\r\n", &file, r) == 1);
+    CU_ASSERT(r[0].start == 0 && r[0].size == 500);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=900-\r\n\r\n", &file, r) == 1);
+    CU_ASSERT(r[0].start == 900 && r[0].size == 100);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=-100\r\n\r\n", &file, r) == 1);
+    CU_ASSERT(r[0].start == 900 && r[0].size == 100);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=-5000\r\n\r\n", &file, r) == 1);
+    CU_ASSERT(r[0].start == 0 && r[0].size == 1000);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=990-2000\r\n\r\n", &file, r) == 1);
+    CU_ASSERT(r[0].start == 990 && r[0].size == 10);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=0-0, 5000-, 10-19\r\n\r\n", &file, r) == 2);
+    CU_ASSERT(r[0].size == 1 && r[1].start == 10 && r[1].size == 10);
+
+    // unsatisfiable
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=1000-\r\n\r\n", &file, r) == -1);
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=-0\r\n\r\n", &file, r) == -1);
+    // ignored
+    const char* ignored[] = {
+        "HEAD / HTTP/1.1\r\nRange: bytes=0-1\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: lines=0-1\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: bytes=5-1\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: bytes=a-\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: bytes=\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: \"old\"\r\n\r\n",
+        "GET / HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: Sun, 06 Nov 1994 08:49:36 GMT\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++) {
+        CU_ASSERT(ranges_of(ignored[i], &file, r) == 0);
+    }
+    CU_ASSERT(ranges_of("GET / HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: \"abc-3e8-ae1b981bc490a00\"\r\n\r\n", &file, r) == 1);
+    CU_ASSERT(
+        ranges_of("GET / HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", &file, r) == 1
+    );
+
+    char header[1024];
+    CU_ASSERT(conditional_code("GET / HTTP/1.1\r\nRange: bytes=10-19\r\n\r\n", &file, header) == 206);
+    CU_ASSERT(strstr(header, "Content-Length: 10\r\nContent-Range: bytes 10-19/1000\r\n") != NULL);
+    CU_ASSERT(conditional_code("GET / HTTP/1.1\r\nRange: bytes=2000-\r\n\r\n", &file, header) == 416);
+    CU_ASSERT(strstr(header, "Content-Range: bytes */1000\r\n") != NULL);
+
+    // the Content-Length of a multipart body adds up
+    HttpParser p;
+    HttpParser_init(&p);
+    const char* head = "GET / HTTP/1.1\r\nRange: bytes=0-9,-10\r\n\r\n";
+    CU_ASSERT(HttpParser_feed(&p, head, strlen(head)) == PARSE_DONE);
+    HttpResponse ret;
+    HttpResponse_finish(&p.request, &file, (StringView){}, &ret, header);
+    CU_ASSERT_FATAL(ret.code == 206 && ret.range_count == 2);
+    char part[WS_PART_HEADER_MAX];
+    size_t length = 20;
+    for (int i = 0; i <= 2; i++) {
+        length += multipart_header(&ret, &file, i, part);
+    }
+    part[multipart_header(&ret, &file, 1, part)] = '\0';
+    CU_ASSERT(strstr(part, "Content-Range: bytes 990-999/1000\r\n\r\n") != NULL);
+    CU_ASSERT(ret.file_size == length);
+    header[ret.header_size] = '\0';
+    CU_ASSERT(strstr(header, "Content-Type: multipart/byteranges; boundary=") != NULL);
+}
+
+static uint8_t accepted(const char* value)
+{
+    char head[256];
+    snprintf(head, sizeof(head), "GET / HTTP/1.1\r\nAccept-Encoding: %s\r\n\r\n", value);
+    HttpParser p;
+    HttpParser_init(&p);
+    CU_ASSERT(HttpParser_feed(&p, head, strlen(head)) == PARSE_DONE);
+    return accepted_encodings(&p.request);
+}
+
+void content_negotiation()
+{
+    CU_ASSERT(accepted("gzip, deflate, br") == (ENC_GZIP | ENC_BR));
+    CU_ASSERT(accepted("deflate") == 0);
+    CU_ASSERT(accepted("GZIP;q=0.5") == ENC_GZIP);
+    CU_ASSERT(accepted("br;q=0, gzip") == ENC_GZIP);
+    CU_ASSERT(accepted("br;q=0.0") == 0);
+    CU_ASSERT(accepted("br;q=0.01") == ENC_BR);
+    CU_ASSERT(accepted("*") == (ENC_GZIP | ENC_BR));
+    CU_ASSERT(accepted("*, br;q=0") == ENC_GZIP);
+    CU_ASSERT(accepted("identity") == 0);
+
+    char path[WS_URI_BUFFER_SIZE] = "/tmp/nbh_enc_XXXXXX.css";
+    int fd = mkstemps(path, 4);
+    CU_ASSERT_FATAL(fd >= 0);
+    close(fd);
+    FileInfo plain = file_open(path, false);
+    CU_ASSERT(plain.encodings == 0 && plain.encoding == 0);
+
+    char gz[WS_URI_BUFFER_SIZE + 3];
+    snprintf(gz, sizeof(gz), "%s.gz", path);
+    fd = open(gz, O_WRONLY | O_CREAT, 0600);
+    CU_ASSERT(write(fd, "gz", 2) == 2);
+    close(fd);
+    plain = file_open(path, false);
+    CU_ASSERT(plain.encodings == ENC_GZIP);
+    FileInfo encoded = file_open(gz, false);
+    CU_ASSERT(encoded.encoding == ENC_GZIP && encoded.size == 2);
+    CU_ASSERT(encoded.content_type == content_type_id(path));
+    char header[WS_ENTITY_HEADER_MAX];
+    header[entity_header(&encoded, header)] = '\0';
+    CU_ASSERT(strstr(header, "Content-Type: text/css\r\n") != NULL);
+    CU_ASSERT(strstr(header, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n") != NULL);
+
+    char negotiated[WS_URI_BUFFER_SIZE];
+    strcpy(negotiated, path);
+    CU_ASSERT(sidecar_path(negotiated, plain.encodings & ENC_GZIP) == ENC_GZIP);
+    CU_ASSERT(strcmp(negotiated, gz) == 0);
+    unlink(gz);
+    unlink(path);
+}
+
+void scanners_match_scalar()
+{
+    char buffer[200];
+    const char needles[] = {'\n', '\r', ' ', '\t', ':', '\0'};
+    for (int isa = SCAN_SCALAR; isa <= SCAN_AVX2; isa++) {
+        scan_select(isa);
+        for (size_t len = 0; len < 100; len++) {
+            for (size_t pos = 0; pos <= len; pos++) {
+                for (size_t n = 0; n < sizeof(needles); n++) {
+                    memset(buffer, 'a', sizeof(buffer));
+                    buffer[pos] = needles[n];
+                    // a '\n' two bytes on, which scan_lf finds when the needle is not one
+                    if (pos + 2 < sizeof(buffer)) {
+                        buffer[pos + 2] = '\n';
+                    }
+                    char c = needles[n];
+                    size_t want_lf = c == '\n' && pos < len ? pos : len;
+                    size_t want_space = (c == ' ' || c == '\r' || c == '\t') && pos < len ? pos : len;
+                    size_t want_colon = c == ':' && pos < len ? pos : len;
+                    size_t want_cr_nul = (c == '\r' || c == '\0') && pos < len ? pos : len;
+                    CU_ASSERT(scan_lf(buffer, len) == (pos + 2 < len && want_lf == len ? pos + 2 : want_lf));
+                    CU_ASSERT(scan_space(buffer, len) == want_space);
+                    CU_ASSERT(scan_colon(buffer, len) == want_colon);
+                    CU_ASSERT(scan_cr_or_nul(buffer, len) == want_cr_nul);
+                }
+            }
+        }
+    }
+    scan_select(SCAN_AVX2);
+}
+
+void file_cache_hit_and_change()
+{
+    char path[] = "/tmp/nbh_cache_XXXXXX.txt";
+    int fd = mkstemps(path, 4);
+    CU_ASSERT_FATAL(fd >= 0);
+    CU_ASSERT(write(fd, "abc", 3) == 3);
+    close(fd);
+
+    FileCache* cache = FileCache_create(MetaCache_create(64), 16);
+    CU_ASSERT_FATAL(cache != NULL);
+    FileInfo file;
+    CachedFile* ref;
+    CU_ASSERT(!FileCache_get(cache, path, true, &file, &ref));
+
+    FileInfo opened = file_open(path, true);
+    CU_ASSERT(opened.err == 0 && opened.size == 3);
+    FileCache_put(cache, path, &opened, &ref);
+    CU_ASSERT_FATAL(ref != NULL);
+
+    CachedFile* ref2;
+    CU_ASSERT(FileCache_get(cache, path, true, &file, &ref2));
+    CU_ASSERT(ref2 == ref && file.fd == opened.fd && file.size == 3);
+    CU_ASSERT(file.content_type == content_type_id(path));
+    FileCache_release(cache, ref2);
+
+    // the new open replaces the old one, which stays usable while referenced
+    FILE* f = fopen(path, "a");
+    fputs("def", f);
+    fclose(f);
+    FileInfo reopened = file_open(path, true);
+    FileCache_put(cache, path, &reopened, &ref2);
+    CU_ASSERT_FATAL(ref2 != NULL && ref2 != ref);
+    CU_ASSERT(fcntl(opened.fd, F_GETFD) >= 0);
+    FileCache_release(cache, ref);
+    CU_ASSERT(fcntl(opened.fd, F_GETFD) < 0);
+
+    CU_ASSERT(FileCache_get(cache, path, false, &file, &ref));
+    CU_ASSERT(file.fd < 0 && file.size == 6);
+    FileCache_release(cache, ref2);
+
+    unlink(path);
+    FileInfo missing = file_open(path, true);
+    FileCache_put(cache, path, &missing, &ref);
+    CU_ASSERT(ref == NULL);
+    CU_ASSERT(FileCache_get(cache, path, true, &file, &ref));
+    CU_ASSERT(file.err == ENOENT && ref == NULL);
+
+    // running out of descriptors is no reason to answer 404 from then on
+    char busy[] = "/tmp/nbh_cache_busy.txt";
+    FileInfo exhausted = {.err = EMFILE, .fd = -1, .looked_ms = missing.looked_ms + 1};
+    FileCache_put(cache, busy, &exhausted, &ref);
+    CU_ASSERT(ref == NULL);
+    CU_ASSERT(!FileCache_get(cache, busy, true, &file, &ref));
+    exhausted.err = EIO;
+    FileCache_put(cache, busy, &exhausted, &ref);
+    CU_ASSERT(!FileCache_get(cache, busy, false, &file, &ref));
+    exhausted.err = ENOTDIR;
+    FileCache_put(cache, busy, &exhausted, &ref);
+    CU_ASSERT(FileCache_get(cache, busy, false, &file, &ref));
+    CU_ASSERT(file.err == ENOTDIR);
+    FileCache_destroy(cache);
+}
+
+void meta_cache_invalidation()
+{
+    char path[] = "/tmp/nbh_watch_XXXXXX.txt";
+    int fd = mkstemps(path, 4);
+    CU_ASSERT_FATAL(fd >= 0);
+    close(fd);
+
+    MetaCache* meta = MetaCache_create(64);
+    FileCache* cache = FileCache_create(meta, 16);
+    CU_ASSERT_FATAL(cache != NULL);
+    FileInfo file;
+    CachedFile* ref;
+    FileInfo before = file_open(path, false);
+    FileCache_put(cache, path, &before, &ref);
+    CU_ASSERT(FileCache_get(cache, path, false, &file, &ref));
+    MetaCache_invalidate(meta, path, strlen(path));
+    CU_ASSERT(!FileCache_get(cache, path, false, &file, &ref));
+
+    // a lookup that started before the invalidation may have seen the old file
+    FileCache_put(cache, path, &before, &ref);
+    CU_ASSERT(!FileCache_get(cache, path, false, &file, &ref));
+    usleep(2000);
+    FileInfo after = file_open(path, false);
+    FileCache_put(cache, path, &after, &ref);
+    CU_ASSERT(FileCache_get(cache, path, false, &file, &ref));
+
+    MetaCache_flush(meta);
+    CU_ASSERT(!FileCache_get(cache, path, false, &file, &ref));
+    MetaCache_set_watched(meta, true);
+    MetaCacheStats stats;
+    MetaCache_stats(meta, &stats);
+    CU_ASSERT(stats.invalidations == 1 && stats.flushes == 1 && stats.watched);
+
+    // the watcher never names a path like this, so it is not cached
+    char odd[sizeof(path) + 1];
+    snprintf(odd, sizeof(odd), "/tmp/%s", path + 4);
+    usleep(2000);
+    FileInfo odd_info = file_open(odd, false);
+    CU_ASSERT(odd_info.err == 0);
+    FileCache_put(cache, odd, &odd_info, &ref);
+    CU_ASSERT(!FileCache_get(cache, odd, false, &file, &ref));
+    FileCache_destroy(cache);
+    unlink(path);
+}
+
+void hot_cache_admit_and_change()
+{
+    char path[] = "/tmp/nbh_hot_XXXXXX.txt";
+    int fd = mkstemps(path, 4);
+    CU_ASSERT_FATAL(fd >= 0);
+    CU_ASSERT(write(fd, "abc", 3) == 3);
+    close(fd);
+
+    HotCache* cache = HotCache_create(1 << 20);
+    CU_ASSERT_FATAL(cache != NULL);
+    FileInfo file = file_open(path, true);
+    CU_ASSERT_FATAL(file.err == 0);
+
+    // read in on the second request only
+    CU_ASSERT(HotCache_get(cache, path, &file) == NULL);
+    CU_ASSERT(HotCache_admit(cache, path, &file) == NULL);
+    CU_ASSERT(HotCache_get(cache, path, &file) == NULL);
+    HotEntry* entry = HotCache_admit(cache, path, &file);
+    CU_ASSERT_FATAL(entry != NULL);
+    char expected[WS_ENTITY_HEADER_MAX + 3];
+    size_t expected_size = entity_header(&file, expected);
+    memcpy(expected + expected_size, "abc", 3);
+    expected_size += 3;
+    CU_ASSERT(HotEntry_size(entry) == expected_size);
+    CU_ASSERT(memcmp(HotEntry_data(entry), expected, expected_size) == 0);
+    CU_ASSERT(HotCache_get(cache, path, &file) == entry);
+    HotCache_release(cache, entry);
+    close(file.fd);
+
+    // a changed file evicts the entry, the old body stays readable while referenced
+    FILE* f = fopen(path, "a");
+    fputs("def", f);
+    fclose(f);
+    FileInfo changed = file_open(path, false);
+    CU_ASSERT(HotCache_get(cache, path, &changed) == NULL);
+    CU_ASSERT(memcmp(HotEntry_data(entry), expected, expected_size) == 0);
+    HotCache_release(cache, entry);
+
+    HotCacheStats stats;
+    HotCache_stats(cache, &stats);
+    CU_ASSERT(stats.hits == 1 && stats.misses == 3 && stats.admitted == 1 && stats.evicted == 1);
+    CU_ASSERT(stats.entries == 0 && stats.bytes == 0);
+    unlink(path);
+    HotCache_destroy(cache);
+}
+
+// decoded fields as "name: value\n" lines
+typedef struct {
+    char text[512];
+    size_t len;
+} FieldText;
+
+static void collect_field(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    FieldText* t = ctx;
+    t->len += snprintf(t->text + t->len, sizeof(t->text) - t->len, "%.*s: %.*s\n", (int)name_len, name,
+                       (int)value_len, value);
+}
+
+static int decode_hex(HpackDecoder* d, const char* hex, FieldText* t)
+{
+    uint8_t block[256];
+    size_t len = strlen(hex) / 2;
+    for (size_t i = 0; i < len; i++) {
+        sscanf(hex + 2 * i, "%2hhx", &block[i]);
+    }
+    t->len = 0;
+    t->text[0] = '\0';
+    return HpackDecoder_decode(d, block, len, collect_field, t);
+}
+
+void archive_pack_and_lookup()
+{
+    char root[] = "/tmp/nbh_pack_XXXXXX";
+    CU_ASSERT_FATAL(mkdtemp(root) != NULL);
+    char page[64], sub[64], style[64], out[64];
+    snprintf(page, sizeof(page), "%s/index.html", root);
+    snprintf(sub, sizeof(sub), "%s/css", root);
+    snprintf(style, sizeof(style), "%s/css/site.css", root);
+    snprintf(out, sizeof(out), "%s.pack", root);
+    int fd = open(page, O_WRONLY | O_CREAT, 0644);
+    CU_ASSERT(write(fd, "<p>hi</p>", 9) == 9);
+    close(fd);
+    CU_ASSERT_FATAL(mkdir(sub, 0755) == 0);
+    fd = open(style, O_WRONLY | O_CREAT, 0644);
+    CU_ASSERT(write(fd, "p{}", 3) == 3);
+    close(fd);
+
+    CU_ASSERT_FATAL(Archive_pack(root, out));
+    Archive* archive = Archive_open(out);
+    CU_ASSERT_FATAL(archive != NULL);
+    FileInfo file;
+    StringView entity;
+    CU_ASSERT_FATAL(Archive_lookup(archive, style, strlen(style), &file, &entity));
+    CU_ASSERT(file.size == 3 && file.offset % WSPACK_ALIGN == 0 && file.fd == Archive_fd(archive));
+    char body[4] = {};
+    CU_ASSERT(pread(file.fd, body, 3, file.offset) == 3 && strcmp(body, "p{}") == 0);
+    CU_ASSERT(!Archive_lookup(archive, sub, strlen(sub), &file, &entity));
+
+    // the same answer file_open() and entity_header() give
+    CU_ASSERT_FATAL(Archive_lookup(archive, page, strlen(page), &file, &entity));
+    FileInfo disk = file_open(page, false);
+    char expect[WS_ENTITY_HEADER_MAX];
+    size_t expect_size = entity_header(&disk, expect);
+    CU_ASSERT(file.content_type == disk.content_type && file.mtime_ns == disk.mtime_ns && file.ino == disk.ino);
+    CU_ASSERT(entity.size == expect_size && memcmp(entity.ptr, expect, expect_size) == 0);
+
+    // ranges and 304s slice the validators out of the stored header
+    char header[1024];
+    const char* range = "GET /index.html HTTP/1.1\r\nRange: bytes=2-4\r\n\r\n";
+    CU_ASSERT(entity_code(range, &file, entity, header) == 206);
+    CU_ASSERT(strstr(header, "\r\nContent-Type: text/html\r\nContent-Length: 3\r\nContent-Range: bytes 2-4/9\r\nETag: \"") != NULL);
+    CU_ASSERT(strstr(strstr(header, "ETag: "), "Type") == NULL);
+    CU_ASSERT(strcmp(header + strlen(header) - 8, " GMT\r\n\r\n") == 0);
+    const char* match = "GET /index.html HTTP/1.1\r\nIf-None-Match: *\r\n\r\n";
+    CU_ASSERT(entity_code(match, &file, entity, header) == 304);
+    CU_ASSERT(strstr(header, "Content-Length") == NULL && strstr(header, "Type") == NULL);
+    CU_ASSERT(strstr(header, "\r\nETag: \"") != NULL && strcmp(header + strlen(header) - 8, " GMT\r\n\r\n") == 0);
+
+    // a cache on top of it never asks the filesystem
+    FileCache* cache = FileCache_create(MetaCache_create(64), 16);
+    CU_ASSERT_FATAL(cache != NULL);
+    FileCache_use_archive(cache, archive);
+    Archive_release(archive);
+    CachedFile* ref;
+    unlink(page);
+    CU_ASSERT(FileCache_get(cache, page, true, &file, &ref));
+    CU_ASSERT_FATAL(ref != NULL);
+    CU_ASSERT(file.err == 0 && file.size == 9 && CachedFile_entity(ref).size == expect_size);
+    FileCache_release(cache, ref);
+    CU_ASSERT(FileCache_get(cache, sub, true, &file, &ref));
+    CU_ASSERT(file.err == ENOENT && ref == NULL);
+    FileCache_destroy(cache);
+
+    unlink(style);
+    rmdir(sub);
+    rmdir(root);
+    unlink(out);
+}
+
+void uri_decode_and_beneath_root(void)
+{
+    char uri[WS_URI_BUFFER_SIZE] = "/a%20b%2fc.html?x=%41";
+    char query[WS_URI_BUFFER_SIZE];
+    CU_ASSERT(uri_decode(uri, query));
+    CU_ASSERT(strcmp(uri, "/a b/c.html") == 0 && strcmp(query, "x=%41") == 0);
+    const char* bad[] = {"/x%0", "/x%00", "/x%g1", "x.html", "?x"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        strcpy(uri, bad[i]);
+        CU_ASSERT(!uri_decode(uri, query));
+    }
+
+    char dir[] = "/tmp/nbh_root_XXXXXX";
+    CU_ASSERT_FATAL(mkdtemp(dir) != NULL);
+    char root[64], inside[96], outside[64], link_in[96], link_out[96], setting[80];
+    snprintf(root, sizeof(root), "%s/www", dir);
+    snprintf(inside, sizeof(inside), "%s/in.txt", root);
+    snprintf(outside, sizeof(outside), "%s/out.txt", dir);
+    snprintf(link_in, sizeof(link_in), "%s/ok.txt", root);
+    snprintf(link_out, sizeof(link_out), "%s/escape.txt", root);
+    CU_ASSERT_FATAL(mkdir(root, 0755) == 0);
+    close(open(inside, O_WRONLY | O_CREAT, 0644));
+    close(open(outside, O_WRONLY | O_CREAT, 0644));
+    CU_ASSERT(symlink("in.txt", link_in) == 0 && symlink("../out.txt", link_out) == 0);
+
+    // from here on every path under root resolves beneath it
+    snprintf(setting, sizeof(setting), "root=%s", root);
+    const char* overrides[] = {setting};
+    CU_ASSERT_FATAL(config_start(NULL, overrides, 1));
+    char path[WS_URI_BUFFER_SIZE];
+    struct {
+        const char* uri;
+        bool found;
+        // through a symlink, so the watcher can not be relied on for it
+        bool untracked;
+    } tests[] = {
+        {"/in.txt", true, false},
+        {"/ok.txt", true, true},
+        {"/../out.txt", false, false},
+        {"/escape.txt", false, true},
+        {"//in.txt", true, false},
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        strcpy(path, tests[i].uri);
+        CU_ASSERT(uri_to_path(path) == 0);
+        FileInfo file = file_open(path, true);
+        CU_ASSERT((file.err == 0) == tests[i].found);
+        CU_ASSERT(file.untracked == tests[i].untracked);
+        if (file.fd >= 0) {
+            close(file.fd);
+        }
+    }
+    // a path outside the root is opened as it is
+    FileInfo file = file_open(outside, false);
+    CU_ASSERT(file.err == 0 && file.untracked);
+
+    unlink(link_in);
+    unlink(link_out);
+    unlink(inside);
+    unlink(outside);
+    rmdir(root);
+    rmdir(dir);
+}
+
+void config_file_and_overrides()
+{
+    char path[] = "/tmp/nbh_conf_XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT_FATAL(fd >= 0);
+    const char* text = "# tuning\n"
+                       "  keepalive_requests 20   # per connection\n"
+                       "workers auto\n"
+                       "root /srv/site//\n"
+                       "mime svg image/svg+xml\n"
+                       "mime txt text/plain;charset=utf-8\n";
+    CU_ASSERT(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+
+    Config config;
+    Config_defaults(&config);
+    int builtin_types = config.mime_count;
+    CU_ASSERT_FATAL(Config_load(&config, path));
+    CU_ASSERT(config.keepalive_requests == 20 && config.workers == -1);
+    CU_ASSERT(strcmp(config.root, "/srv/site") == 0);
+    // a new extension is appended, a known one keeps its id
+    CU_ASSERT(config.mime_count == builtin_types + 1);
+    CU_ASSERT(strcmp(config.mime[builtin_types].ext, "svg") == 0);
+    CU_ASSERT(strcmp(config.mime[content_type_id("a.txt")].type, "text/plain;charset=utf-8") == 0);
+
+    CU_ASSERT(Config_override(&config, "send_buffer=8192") && config.send_buffer == 8192);
+    CU_ASSERT(!Config_override(&config, "send_buffer=1024"));
+    CU_ASSERT(!Config_override(&config, "send_buffer"));
+    CU_ASSERT(!Config_override(&config, "no_such_key=1"));
+    CU_ASSERT(!Config_override(&config, "workers=many"));
+    CU_ASSERT(Config_override(&config, "metrics_path=") && config.metrics_path[0] == '\0');
+    CU_ASSERT(!Config_override(&config, "metrics_path=metrics"));
+    CU_ASSERT(config.send_buffer == 8192 && config.workers == -1);
+
+    // one bad line fails the whole file
+    fd = open(path, O_WRONLY | O_APPEND);
+    CU_ASSERT(write(fd, "backlog 0\n", 10) == 10);
+    close(fd);
+    Config_defaults(&config);
+    CU_ASSERT(!Config_load(&config, path));
+    CU_ASSERT(!Config_load(&config, "/tmp/nbh_no_such_conf"));
+    unlink(path);
+}
+
+void metrics_buckets_and_body()
+{
+    CU_ASSERT(metrics_bucket(0) == 0);
+    CU_ASSERT(metrics_bucket(1024) == 0);
+    CU_ASSERT(metrics_bucket(1025) == 1);
+    CU_ASSERT(metrics_bucket(UINT64_MAX) == METRICS_BUCKETS - 1);
+    // every bound is the largest value of its bucket
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+        uint64_t bound = metrics_bucket_bound(b);
+        CU_ASSERT(metrics_bucket(bound) == b);
+        CU_ASSERT(metrics_bucket(bound + 1) == b + 1);
+    }
+    CU_ASSERT(metrics_bucket_bound(METRICS_BUCKETS - 1) == 0);
+
+    CU_ASSERT_FATAL(metrics_start());
+    metrics_worker(0);
+    metrics_hot_cache(&(HotCacheStats){.hits = 5, .entries = 2});
+    metrics_fs_pool(&(FsPoolStats){.submitted = 3, .max_depth = 4, .wait_ns_total = 1500});
+    metrics_first_byte(200, 0, 1000);
+    metrics_done(200, 0, 1500);
+    metrics_done(200, 0, 5000);
+    // a second worker, the scrape adds both up
+    metrics_worker(1);
+    metrics_hot_cache(&(HotCacheStats){.hits = 7, .entries = 1});
+    metrics_fs_pool(&(FsPoolStats){.submitted = 1, .max_depth = 2, .wait_ns_total = 500});
+    metrics_done(404, -1, 1 << 20);
+    metrics_done(200, 0, 3000);
+
+    int fd = metrics_body();
+    CU_ASSERT_FATAL(fd >= 0);
+    char text[65536];
+    ssize_t len = pread(fd, text, sizeof(text) - 1, 0);
+    close(fd);
+    CU_ASSERT_FATAL(len > 0);
+    text[len] = '\0';
+    CU_ASSERT(strstr(text, "ws_responses_total{code=\"200\",type=\"text/html\"} 3\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_responses_total{code=\"404\",type=\"none\"} 1\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_response_seconds_bucket{code=\"200\",le=\"1.536e-06\"} 1\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_response_seconds_bucket{code=\"200\",le=\"3.072e-06\"} 2\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_response_seconds_bucket{code=\"200\",le=\"+Inf\"} 3\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_response_seconds_count{code=\"200\"} 3\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_response_seconds_sum{code=\"200\"} 0.000009500\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_first_byte_by_type_seconds_count{type=\"text/html\"} 1\n") != NULL);
+    // counters and gauges of the caches add up, the deepest pool queue is the largest one
+    CU_ASSERT(strstr(text, "ws_hot_cache_hits_total 12\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_hot_cache_entries 3\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_fs_pool_jobs_total 4\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_fs_pool_max_depth 4\n") != NULL);
+    CU_ASSERT(strstr(text, "ws_fs_pool_wait_seconds_total 0.000002000\n") != NULL);
+    // no response was a 304, its series are left out
+    CU_ASSERT(strstr(text, "code=\"304\"") == NULL);
+
+    // the path is answered ahead of the files, HEAD gets the length without a body
+    char requests[][WS_BUFFER_SIZE] = {"GET /metrics HTTP/1.1\r\n\r\n", "HEAD /metrics HTTP/1.1\r\n\r\n"};
+    char buffer[1024];
+    HttpRequest req = HttpRequest_create(requests[0]);
+    HttpResponse resp = HttpResponse_create(&req, buffer, sizeof(buffer));
+    CU_ASSERT(resp.code == 200 && resp.fd >= 0 && resp.file_size > 0);
+    if (resp.fd >= 0) {
+        close(resp.fd);
+    }
+    req = HttpRequest_create(requests[1]);
+    resp = HttpResponse_create(&req, buffer, sizeof(buffer));
+    CU_ASSERT(resp.code == 200 && resp.fd < 0);
+    buffer[resp.header_size] = '\0';
+    CU_ASSERT(strstr(buffer, "Content-Type: text/plain; version=0.0.4") != NULL);
+}
+
+void access_log_ring_and_format()
+{
+    CU_ASSERT_FATAL(accesslog_start());
+    accesslog_worker(3);
+    CU_ASSERT_FATAL(accesslog_on());
+
+    char requests[][WS_BUFFER_SIZE] = {"GET /a%20b?q=\"1\" HTTP/1.1\r\n\r\n", ""};
+    snprintf(requests[1], WS_BUFFER_SIZE, "HEAD /%0100i HTTP/1.0\r\n\r\n", 0);
+    AccessRecord record = {.family = 4, .addr = {127, 0, 0, 1}, .port = 5555, .bytes = 10, .first_byte_us = 5};
+    HttpRequest req = HttpRequest_create(requests[0]);
+    accesslog_request(&record, &req);
+    accesslog_append(&record, 200, 7000);
+    req = HttpRequest_create(requests[1]);
+    accesslog_request(&record, &req);
+    accesslog_append(&record, 404, 1000);
+    // a full ring drops what does not fit instead of waiting
+    for (int i = 0; i < WS_ACCESS_RING; i++) {
+        accesslog_append(&record, 404, 1000);
+    }
+
+    char path[] = "/tmp/nbh_access_XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT_FATAL(fd >= 0);
+    // appending like the logger's own file
+    CU_ASSERT(fcntl(fd, F_SETFL, O_APPEND) == 0);
+    // a write failing halfway through a record leaves nothing behind, the records go out whole on the next round
+    struct rlimit limit;
+    CU_ASSERT_FATAL(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {sizeof(AccessLogHeader) + 100 * sizeof(AccessRecord) + 64, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+    CU_ASSERT(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    CU_ASSERT(accesslog_drain(fd) == -1);
+    CU_ASSERT(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    struct stat st;
+    CU_ASSERT(fstat(fd, &st) == 0 && st.st_size == 0);
+    CU_ASSERT(accesslog_drain(fd) == WS_ACCESS_RING);
+    CU_ASSERT(accesslog_drain(fd) == 0);
+    CU_ASSERT(fstat(fd, &st) == 0 && st.st_size == (off_t)(sizeof(AccessLogHeader) + WS_ACCESS_RING * sizeof(AccessRecord)));
+
+    AccessLogHeader header;
+    AccessRecord read_back[2];
+    CU_ASSERT(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    CU_ASSERT(memcmp(header.magic, WS_ACCESS_MAGIC, 8) == 0 && header.record_size == sizeof(AccessRecord));
+    CU_ASSERT(pread(fd, read_back, sizeof(read_back), sizeof(header)) == sizeof(read_back));
+    close(fd);
+    unlink(path);
+
+    char line[512];
+    AccessRecord_format(&read_back[0], false, line, sizeof(line));
+    CU_ASSERT(strncmp(line, "127.0.0.1 - - [", 15) == 0);
+    CU_ASSERT(strstr(line, "] \"GET /a%20b?q=\\x221\\x22 HTTP/1.1\" 200 10 5us 7us 3") != NULL);
+    AccessRecord_format(&read_back[0], true, line, sizeof(line));
+    CU_ASSERT(strstr(line, "\"addr\":\"127.0.0.1\",\"port\":5555,\"method\":\"GET\",\"uri\":\"/a%20b?q=\\\"1\\\"\"") != NULL);
+    CU_ASSERT(strstr(line, "\"status\":200,\"bytes\":10,\"first_byte_us\":5,\"duration_us\":7,\"worker\":3}") != NULL);
+    // the target is cut, and says so
+    AccessRecord_format(&read_back[1], false, line, sizeof(line));
+    CU_ASSERT(strstr(line, "00... HTTP/1.0\" 404 10 5us 1us 3") != NULL);
+    // a line never outgrows its buffer
+    CU_ASSERT(AccessRecord_format(&read_back[1], true, line, 40) == 39);
+}
+
+void hpack_round_trip()
+{
+    // RFC 7541 C.3 and C.4, the same requests without and with Huffman coding
+    const char* blocks[2][3] = {
+        {"828684410f7777772e6578616d706c652e636f6d", "828684be58086e6f2d6361636865",
+         "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"},
+        {"828684418cf1e3c2e5f23a6ba0ab90f4ff", "828684be5886a8eb10649cbf",
+         "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"},
+    };
+    const char* fields[3] = {
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+        ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n",
+    };
+    FieldText t;
+    for (int huffman = 0; huffman < 2; huffman++) {
+        HpackDecoder d;
+        HpackDecoder_init(&d);
+        for (int i = 0; i < 3; i++) {
+            CU_ASSERT(decode_hex(&d, blocks[huffman][i], &t) == 0);
+            CU_ASSERT(strcmp(t.text, fields[i]) == 0);
+        }
+        CU_ASSERT(d.count == 3 && d.size == 164);
+    }
+
+    HpackDecoder d;
+    HpackDecoder_init(&d);
+    // a reference past the end of the table, and a string longer than the block
+    CU_ASSERT(decode_hex(&d, "c0", &t) < 0);
+    CU_ASSERT(decode_hex(&d, "400a637573", &t) < 0);
+
+    uint8_t block[256];
+    size_t len = hpack_encode_status(block, sizeof(block), 200);
+    len += hpack_encode_status(block + len, sizeof(block) - len, 416);
+    len += hpack_encode_field(block + len, sizeof(block) - len, "content-type", 12, "text/html", 9);
+    len += hpack_encode_field(block + len, sizeof(block) - len, "x-unknown", 9, "1", 1);
+    HpackDecoder_init(&d);
+    t.len = 0;
+    CU_ASSERT(HpackDecoder_decode(&d, block, len, collect_field, &t) == 0);
+    CU_ASSERT(strcmp(t.text, ":status: 200\n:status: 416\ncontent-type: text/html\nx-unknown: 1\n") == 0);
+    CU_ASSERT(d.count == 0);
+    CU_ASSERT(hpack_encode_field(block, 4, "content-type", 12, "text/html", 9) == 0);
+}
+
 int main()
 {
     CU_initialize_registry();
@@ -301,12 +1253,32 @@ int main()
     CU_add_test(suite, "version parsing error handling", request_version_parse_error);
     CU_add_test(suite, "uri parsing error handling", request_uri_parse_error);
     CU_add_test(suite, "uri size error handling", request_uri_size_error);
+    CU_add_test(suite, "parser fragmented feed", parser_fragmented_feed);
+    CU_add_test(suite, "parser head too large", parser_head_too_large);
+    CU_add_test(suite, "response headers", response_headers);
+    CU_add_test(suite, "conditional get", conditional_get);
+    CU_add_test(suite, "byte ranges", byte_ranges);
+    CU_add_test(suite, "content negotiation", content_negotiation);
+    CU_add_test(suite, "parser pipelined heads", parser_pipelined_heads);
     CU_pSuite suite2 = CU_add_suite("WsResponseTestSuite", 0, 0);
     CU_add_test(suite2, "get content type happy", happy_content_type);
     CU_add_test(suite2, "map specific uris happy", happy_sanitize_uri);
+    CU_add_test(suite2, "rewrite and redirect rules", router_rules);
     CU_add_test(suite2, "connection parse header happy", happy_connection_parse_header);
     CU_add_test(suite2, "http request create happy", happy_request_create);
+    CU_add_test(suite2, "header lookup", header_lookup);
     CU_add_test(suite2, "http parse word", happy_parse_word);
+    CU_add_test(suite2, "simd scanners match scalar", scanners_match_scalar);
+    CU_add_test(suite2, "file cache hit and change", file_cache_hit_and_change);
+    CU_add_test(suite2, "meta cache invalidation", meta_cache_invalidation);
+    CU_add_test(suite2, "hot cache admit and change", hot_cache_admit_and_change);
+    CU_add_test(suite2, "hpack round trip", hpack_round_trip);
+    CU_add_test(suite2, "metrics buckets and body", metrics_buckets_and_body);
+    CU_add_test(suite2, "access log ring and format", access_log_ring_and_format);
+    CU_add_test(suite2, "archive pack and lookup", archive_pack_and_lookup);
+    CU_add_test(suite2, "config file and overrides", config_file_and_overrides);
+    // changes the root of every later test
+    CU_add_test(suite2, "uri decode and beneath root", uri_decode_and_beneath_root);
     CU_basic_run_tests();
     CU_cleanup_registry();
 
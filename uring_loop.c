@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+
+#include "uring_loop.h"
+#include "connection.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+
+// provided recv buffers, one is only held between its cqe and the copy out
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_GROUP 1
+
+// default pipe capacity, one splice pair moves at most this much
+#define URING_SPLICE_CHUNK 65536
+
+// how often idle connections are checked for keepalive_timeout
+#define URING_TICK_SEC 1
+
+// user_data is a Connection* with the operation in the low bits
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_SPLICE_IN 3
+#define OP_SPLICE_OUT 4
+#define OP_PROVIDE 5
+#define OP_TICK 6
+#define OP_MASK 7
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned cq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_cqe* cqes;
+    // sqes queued since the last io_uring_enter
+    unsigned pending;
+
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+} Ring;
+
+typedef struct {
+    Ring ring;
+    int sfd;
+    bool multishot;
+    char* buffers;
+    // of every provided buffer, recv_buffer when the loop started
+    size_t buffer_size;
+    struct __kernel_timespec tick;
+    ConnectionList idle;
+    MetaCache* meta;
+    FileCache* files;
+    HotCache* hot;
+} UringLoop;
+
+static int ring_setup(Ring* r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    r->ring_ptr = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->ring_ptr == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->ring_ptr, r->ring_size);
+        close(r->fd);
+        return -1;
+    }
+
+    char* base = r->ring_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+    r->sq_head = (unsigned*)(base + p.sq_off.head);
+    r->sq_tail = (unsigned*)(base + p.sq_off.tail);
+    r->sq_array = (unsigned*)(base + p.sq_off.array);
+    r->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+    r->cq_head = (unsigned*)(base + p.cq_off.head);
+    r->cq_tail = (unsigned*)(base + p.cq_off.tail);
+    r->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_destroy(Ring* r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring_ptr, r->ring_size);
+    close(r->fd);
+}
+
+// submits everything queued and optionally waits for wait_nr completions
+static int ring_enter(Ring* r, unsigned wait_nr)
+{
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int rv = syscall(__NR_io_uring_enter, r->fd, r->pending, wait_nr, flags, NULL, 0);
+    if (rv < 0) {
+        return -1;
+    }
+    r->pending -= rv;
+    return rv;
+}
+
+/* Returns a zeroed sqe that is already published.
+ *
+ * Without SQPOLL the kernel only reads sqes inside io_uring_enter so the
+ * caller can fill it in after the tail moved.
+ */
+static struct io_uring_sqe* ring_sqe(Ring* r)
+{
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (ring_enter(r, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
+}
+
+static uint64_t tag(Connection* conn, int op) { return (uint64_t)(uintptr_t)conn | op; }
+
+static void queue_accept(UringLoop* loop)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->sfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->multishot) {
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+}
+
+static void queue_tick(UringLoop* loop)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->tick;
+    sqe->len = 1;
+    sqe->user_data = tag(NULL, OP_TICK);
+}
+
+static void queue_provide(UringLoop* loop, int bid, int count)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(loop->buffers + (size_t)bid * loop->buffer_size);
+    sqe->len = loop->buffer_size;
+    sqe->off = bid;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = tag(NULL, OP_PROVIDE);
+}
+
+static void queue_recv(UringLoop* loop, Connection* conn)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    // the kernel picks a buffer, never hand back more than recv_buff can take
+    sqe->len = conn->recv_size - conn->recv_len;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = tag(conn, OP_RECV);
+    conn->inflight++;
+}
+
+static void queue_sendmsg(UringLoop* loop, Connection* conn, int iovcnt, bool link)
+{
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = iovcnt;
+
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+    sqe->len = 1;
+    // WAITALL makes a short send fail the link instead of splicing early
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (link) {
+        // hold the header back to share a segment with the body
+        sqe->msg_flags |= MSG_MORE;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    sqe->user_data = tag(conn, OP_SEND);
+    conn->inflight++;
+}
+
+static void queue_splice_out(UringLoop* loop, Connection* conn, size_t len, bool more)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->pipe_fds[0];
+    sqe->splice_off_in = -1;
+    sqe->fd = conn->fd;
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->splice_flags = more ? SPLICE_F_MORE : 0;
+    sqe->user_data = tag(conn, OP_SPLICE_OUT);
+    conn->inflight++;
+}
+
+static int queue_splice_body(UringLoop* loop, Connection* conn, PendingResponse* body)
+{
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+        int en = errno;
+        DebugErr("pipe2() %s\n", strerror(en));
+        return -1;
+    }
+    size_t len = body->body_remaining < URING_SPLICE_CHUNK ? body->body_remaining : URING_SPLICE_CHUNK;
+    Connection_readahead(body);
+
+    struct io_uring_sqe* sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = body->fd;
+    sqe->splice_off_in = body->body_offset;
+    sqe->fd = conn->pipe_fds[1];
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag(conn, OP_SPLICE_IN);
+    conn->inflight++;
+
+    queue_splice_out(loop, conn, len, body->body_remaining > len || conn->queue_len > 1);
+    return 0;
+}
+
+static void close_connection(UringLoop* loop, Connection* conn)
+{
+    ConnectionList_unlink(&loop->idle, conn);
+    if (conn->inflight > 0) {
+        // let the pending operations fail, the last cqe closes for real
+        conn->state = CONN_CLOSING;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    Connection_destroy(conn);
+}
+
+// returns 1 when a write was queued, 0 when every queued response is out
+static int queue_write(UringLoop* loop, Connection* conn)
+{
+    if (conn->pipe_bytes > 0) {
+        queue_splice_out(loop, conn, conn->pipe_bytes, true);
+        return 1;
+    }
+    // nothing is left in the pipe so fully spliced bodies are really out
+    Connection_finish_responses(conn);
+    if (conn->queue_len == 0 || conn->state != CONN_READING) {
+        return 0;
+    }
+
+    PendingResponse* body;
+    int iovcnt = Connection_gather(conn, conn->iov, WS_IOV_MAX, &body);
+    if (iovcnt > 0) {
+        queue_sendmsg(loop, conn, iovcnt, body != NULL);
+        if (body && queue_splice_body(loop, conn, body) < 0) {
+            conn->failed = true;
+        }
+        return 1;
+    }
+    body = Connection_body(conn);
+    if (body == NULL || queue_splice_body(loop, conn, body) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/* Queues the next operation once nothing is in flight for a connection.
+ *
+ * Completions only update counters so short sends, short splices and
+ * cancelled links all end up here and resume from what actually moved.
+ */
+static void advance(UringLoop* loop, Connection* conn)
+{
+    if (conn->failed) {
+        conn->state = CONN_CLOSING;
+    }
+    while (1) {
+        switch (conn->state) {
+        case CONN_READING: {
+            while (Connection_request_ready(conn)) {
+                Connection_respond(conn);
+            }
+            int rv = queue_write(loop, conn);
+            if (rv < 0) {
+                close_connection(loop, conn);
+                return;
+            } else if (rv > 0) {
+                return;
+            }
+            if (conn->state == CONN_READING && !Connection_request_ready(conn)) {
+                queue_recv(loop, conn);
+                return;
+            }
+            break;
+        }
+
+        case CONN_CLOSING:
+        default:
+            close_connection(loop, conn);
+            return;
+        }
+    }
+}
+
+static void on_accept(UringLoop* loop, struct io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -EINVAL && loop->multishot) {
+            // kernel older than 5.19, re-arm a single accept per connection
+            loop->multishot = false;
+        }
+        queue_accept(loop);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EINVAL) {
+            DebugErr("accept() %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    Connection* conn = Connection_create(cqe->res, loop->files, loop->hot);
+    if (conn == NULL) {
+        DebugErr("Connection_create() out of memory\n");
+        close(cqe->res);
+        return;
+    }
+    ConnectionList_push(&loop->idle, conn);
+    queue_recv(loop, conn);
+}
+
+static void on_recv(UringLoop* loop, Connection* conn, struct io_uring_cqe* cqe)
+{
+    if (cqe->res == -ENOBUFS) {
+        // every buffer is waiting on a provide in this same batch
+        return;
+    } else if (cqe->res == 0 && Connection_request_ready(conn)) {
+        // client has closed the connection, answer what it already sent
+        return;
+    } else if (cqe->res <= 0) {
+        if (cqe->res < 0 && cqe->res != -ECONNRESET) {
+            DebugErr("recv() %s\n", strerror(-cqe->res));
+        }
+        conn->failed = true;
+        return;
+    }
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    memcpy(conn->recv_buff + conn->recv_len, loop->buffers + (size_t)bid * loop->buffer_size, cqe->res);
+    conn->recv_len += cqe->res;
+    queue_provide(loop, bid, 1);
+    ConnectionList_touch(&loop->idle, conn);
+}
+
+static void on_transfer(Connection* conn, int op, struct io_uring_cqe* cqe)
+{
+    if (cqe->res < 0) {
+        // a cancelled link is resumed by advance(), anything else is fatal
+        if (cqe->res != -ECANCELED) {
+            if (cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+                DebugErr("send/splice() %s\n", strerror(-cqe->res));
+            }
+            conn->failed = true;
+        }
+        return;
+    }
+    PendingResponse* body;
+    switch (op) {
+    case OP_SEND:
+        Connection_sent(conn, cqe->res);
+        break;
+    case OP_SPLICE_IN:
+        body = Connection_body(conn);
+        if (cqe->res == 0 || body == NULL) {
+            // file shrank underneath us, the length promised can not be met
+            conn->failed = true;
+            break;
+        }
+        conn->pipe_bytes += cqe->res;
+        body->body_offset += cqe->res;
+        body->body_remaining -= cqe->res;
+        break;
+    case OP_SPLICE_OUT:
+        conn->pipe_bytes -= cqe->res;
+        break;
+    }
+}
+
+static void close_idle(UringLoop* loop)
+{
+    uint64_t now = now_ms();
+    while (loop->idle.head && now - loop->idle.head->last_active >= (uint64_t)ws_config->keepalive_timeout) {
+        close_connection(loop, loop->idle.head);
+    }
+}
+
+static void handle_cqe(UringLoop* loop, struct io_uring_cqe* cqe)
+{
+    int op = cqe->user_data & OP_MASK;
+    Connection* conn = (Connection*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+    switch (op) {
+    case OP_ACCEPT:
+        on_accept(loop, cqe);
+        return;
+    case OP_TICK:
+        if (config_refresh()) {
+            listen(loop->sfd, ws_config->backlog);
+        }
+        close_idle(loop);
+        if (root_dir_check() && loop->meta) {
+            // whatever was looked up in the old root is wrong now
+            MetaCache_flush(loop->meta);
+        }
+        if (loop->files) {
+            FileCache_check_archive(loop->files);
+        }
+        if (loop->hot) {
+            HotCache_report(loop->hot);
+            HotCacheStats hot_stats;
+            HotCache_stats(loop->hot, &hot_stats);
+            metrics_hot_cache(&hot_stats);
+        }
+        queue_tick(loop);
+        return;
+    case OP_PROVIDE:
+        if (cqe->res < 0) {
+            DebugErr("provide buffers() %s\n", strerror(-cqe->res));
+        }
+        return;
+    case OP_RECV:
+        on_recv(loop, conn, cqe);
+        break;
+    default:
+        on_transfer(conn, op, cqe);
+        break;
+    }
+
+    conn->inflight--;
+    if (conn->inflight == 0) {
+        advance(loop, conn);
+    }
+}
+
+bool uring_loop_supported()
+{
+    Ring ring;
+    if (ring_setup(&ring, 4) < 0) {
+        return false;
+    }
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    bool supported = false;
+    if (probe && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) >= 0) {
+        const int needed[] = {
+            IORING_OP_ACCEPT,
+            IORING_OP_RECV,
+            IORING_OP_SENDMSG,
+            IORING_OP_SPLICE,
+            IORING_OP_PROVIDE_BUFFERS,
+            IORING_OP_TIMEOUT,
+        };
+        supported = true;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(int); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = false;
+            }
+        }
+    }
+    free(probe);
+    ring_destroy(&ring);
+    return supported;
+}
+
+int uring_loop_run(int sfd, MetaCache* meta, Archive* archive, size_t hot_budget)
+{
+    UringLoop loop = {.sfd = sfd, .multishot = true, .meta = meta};
+    loop.tick.tv_sec = URING_TICK_SEC;
+
+    if (meta) {
+        loop.files = FileCache_create(meta, ws_config->fd_cache_entries);
+        if (loop.files == NULL) {
+            DebugErr("FileCache_create() failed, files are not cached\n");
+        }
+    }
+    if (archive) {
+        if (loop.files) {
+            FileCache_use_archive(loop.files, archive);
+        }
+        Archive_release(archive);
+        if (loop.files == NULL) {
+            DebugErr("no file cache to serve the archive from\n");
+            return -1;
+        }
+    }
+    if (hot_budget > 0) {
+        loop.hot = HotCache_create(hot_budget);
+        if (loop.hot == NULL) {
+            DebugErr("HotCache_create() failed, bodies are not cached\n");
+        }
+    }
+
+    if (ring_setup(&loop.ring, URING_ENTRIES) < 0) {
+        int en = errno;
+        DebugErr("io_uring_setup() %s\n", strerror(en));
+        return -1;
+    }
+    loop.buffer_size = ws_config->recv_buffer;
+    loop.buffers = malloc((size_t)URING_BUFFER_COUNT * loop.buffer_size);
+    if (loop.buffers == NULL) {
+        DebugErr("uring_loop_run() out of memory\n");
+        ring_destroy(&loop.ring);
+        return -1;
+    }
+
+    queue_provide(&loop, 0, URING_BUFFER_COUNT);
+    queue_accept(&loop);
+    queue_tick(&loop);
+
+    while (1) {
+        if (ring_enter(&loop.ring, 1) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            int en = errno;
+            DebugErr("io_uring_enter() %s\n", strerror(en));
+            break;
+        }
+
+        Ring* r = &loop.ring;
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+            head++;
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+            handle_cqe(&loop, &cqe);
+        }
+    }
+
+    free(loop.buffers);
+    ring_destroy(&loop.ring);
+    return -1;
+}
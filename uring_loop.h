@@ -0,0 +1,29 @@
+#ifndef NBH_URING_LOOP_HEADER
+#define NBH_URING_LOOP_HEADER
+
+#include "file_cache.h"
+#include "hot_cache.h"
+
+#include <stdbool.h>
+
+/* Probes the running kernel for every io_uring feature uring_loop_run needs.
+ *
+ * The server uses this at startup to fall back to the epoll engine.
+ */
+bool uring_loop_supported();
+
+/* Single process io_uring engine.
+ *
+ * Uses multishot accept, provided buffer recv, and linked send plus
+ * file -> pipe -> socket splices for the body, submitting every queued
+ * operation for every connection in one io_uring_enter per wakeup.
+ * Only returns on a fatal error.
+ *
+ * With meta set open files are cached on top of it, with archive set as
+ * well they come out of that instead and the loop takes over that
+ * reference. With hot_budget > 0 small popular
+ * files are served from a HotCache of that many bytes.
+ */
+int uring_loop_run(int sfd, MetaCache* meta, Archive* archive, size_t hot_budget);
+
+#endif
@@ -0,0 +1,286 @@
+#include "watcher.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// what changes a cached stat() result or a lookup under the directory
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// on the directory holding the root, only the root itself coming or going matters
+#define WATCH_ROOT_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct {
+    int fd;
+    MetaCache* meta;
+    // path of the directory each watch descriptor is on, NULL when unused
+    char** dirs;
+    size_t dir_cap;
+    size_t watches;
+    int root_wd;
+    const char* root;
+    // last component of root, what root_wd reports it as
+    const char* root_name;
+    uint64_t last_report;
+    MetaCacheStats reported;
+} Watcher;
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool remember(Watcher* w, int wd, const char* path)
+{
+    if ((size_t)wd >= w->dir_cap) {
+        size_t cap = w->dir_cap ? w->dir_cap : 64;
+        while (cap <= (size_t)wd) {
+            cap *= 2;
+        }
+        char** dirs = realloc(w->dirs, cap * sizeof(char*));
+        if (dirs == NULL) {
+            return false;
+        }
+        memset(dirs + w->dir_cap, 0, (cap - w->dir_cap) * sizeof(char*));
+        w->dirs = dirs;
+        w->dir_cap = cap;
+    }
+    if (w->dirs[wd]) {
+        // already watched, under another name when a bind mount leads here twice
+        return strcmp(w->dirs[wd], path) == 0;
+    }
+    w->dirs[wd] = strdup(path);
+    w->watches++;
+    return w->dirs[wd] != NULL;
+}
+
+static void forget(Watcher* w, int wd)
+{
+    if (wd >= 0 && (size_t)wd < w->dir_cap && w->dirs[wd]) {
+        free(w->dirs[wd]);
+        w->dirs[wd] = NULL;
+        w->watches--;
+    }
+}
+
+static bool is_dir(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Watches path and every directory below it. Symlinks below the root are
+ * not followed, file_open() marks what it reaches through them untracked.
+ */
+static bool watch_tree(Watcher* w, const char* path, int depth)
+{
+    if (depth > WS_WATCH_DEPTH) {
+        DebugErr("%s nests deeper than %i directories\n", path, WS_WATCH_DEPTH);
+        return false;
+    }
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | (depth > 0 ? IN_DONT_FOLLOW : 0));
+    if (wd < 0) {
+        // gone again, its parent reports that
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return true;
+        }
+        int en = errno;
+        DebugErr("inotify_add_watch(%s) %s\n", path, strerror(en));
+        return false;
+    }
+    if (!remember(w, wd, path)) {
+        DebugErr("%s is watched under two names\n", path);
+        return false;
+    }
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return true;
+    }
+    bool ok = true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        char sub[PATH_MAX];
+        if (snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name) >= (int)sizeof(sub)) {
+            continue;
+        }
+        // anything but a directory fails with ENOTDIR
+        ok = watch_tree(w, sub, depth + 1);
+    }
+    closedir(dir);
+    return ok;
+}
+
+/* Drops every watch and sets them up again from scratch, then flushes the
+ * cache so whatever changed in between is looked up anew.
+ */
+static bool rescan(Watcher* w, const char* why)
+{
+    DebugMsg("%i: watcher rescan, %s\n", getpid(), why);
+    for (size_t wd = 0; wd < w->dir_cap; wd++) {
+        if (w->dirs[wd]) {
+            inotify_rm_watch(w->fd, wd);
+            forget(w, wd);
+        }
+    }
+    bool ok = watch_tree(w, w->root, 0);
+    MetaCache_flush(w->meta);
+    return ok;
+}
+
+static bool watched_dir(const Watcher* w, const char* path)
+{
+    for (size_t wd = 0; wd < w->dir_cap; wd++) {
+        if (w->dirs[wd] && strcmp(w->dirs[wd], path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Drops the watches on path and every directory below it. A watch follows
+ * its directory when it moves, so they would report the old names.
+ */
+static void unwatch_tree(Watcher* w, const char* path, size_t len)
+{
+    for (size_t wd = 0; wd < w->dir_cap; wd++) {
+        const char* dir = w->dirs[wd];
+        if (dir && strncmp(dir, path, len) == 0 && (dir[len] == '\0' || dir[len] == '/')) {
+            inotify_rm_watch(w->fd, wd);
+            forget(w, wd);
+        }
+    }
+}
+
+// false once the tree can no longer be covered
+static bool handle(Watcher* w, const struct inotify_event* ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        return rescan(w, "event queue overflow");
+    } else if (ev->wd == w->root_wd) {
+        if (ev->len > 0 && strcmp(ev->name, w->root_name) == 0) {
+            return rescan(w, "root replaced");
+        }
+        return true;
+    } else if (ev->mask & IN_IGNORED) {
+        forget(w, ev->wd);
+        return true;
+    }
+    if (ev->len == 0 || ev->wd < 0 || (size_t)ev->wd >= w->dir_cap || w->dirs[ev->wd] == NULL) {
+        return true;
+    }
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s", w->dirs[ev->wd], ev->name);
+    if (len >= (int)sizeof(path)) {
+        return true;
+    }
+
+    bool added = ev->mask & (IN_CREATE | IN_MOVED_TO);
+    bool removed = ev->mask & (IN_DELETE | IN_MOVED_FROM);
+    if ((ev->mask & IN_ISDIR) || (added && is_dir(path)) || (removed && watched_dir(w, path))) {
+        // every path below it changed at once
+        if (removed) {
+            unwatch_tree(w, path, len);
+        }
+        if (added && !watch_tree(w, path, 1)) {
+            return false;
+        }
+        MetaCache_flush(w->meta);
+        return true;
+    }
+    MetaCache_invalidate(w->meta, path, len);
+    if (len > 3 && (strcmp(path + len - 3, ".gz") == 0 || strcmp(path + len - 3, ".br") == 0)) {
+        // the original lists which sidecars it has
+        MetaCache_invalidate(w->meta, path, len - 3);
+    }
+    return true;
+}
+
+static void report(Watcher* w)
+{
+    uint64_t now = now_ms();
+    if (now - w->last_report < WS_WATCH_REPORT_MS) {
+        return;
+    }
+    MetaCacheStats stats;
+    MetaCache_stats(w->meta, &stats);
+    if (stats.invalidations == w->reported.invalidations && stats.flushes == w->reported.flushes) {
+        return;
+    }
+    w->last_report = now;
+    w->reported = stats;
+    DebugMsg("%i: watcher watches=%zu invalidations=%lu flushes=%lu\n", getpid(), w->watches, stats.invalidations,
+             stats.flushes);
+}
+
+void watcher_run(MetaCache* meta)
+{
+    Watcher w = {.meta = meta, .root_wd = -1, .root = ws_config->root};
+    int ttl = ws_config->meta_ttl;
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0) {
+        int en = errno;
+        DebugErr("inotify_init1() %s, cached file info expires after %i ms\n", strerror(en), ttl);
+        return;
+    }
+    char parent[WS_ROOT_MAX];
+    const char* slash = strrchr(w.root, '/');
+    if (slash == NULL) {
+        strcpy(parent, ".");
+        w.root_name = w.root;
+    } else {
+        size_t len = slash == w.root ? 1 : (size_t)(slash - w.root);
+        memcpy(parent, w.root, len);
+        parent[len] = '\0';
+        w.root_name = slash + 1;
+    }
+    w.root_wd = inotify_add_watch(w.fd, parent, WATCH_ROOT_EVENTS);
+    if (w.root_wd < 0 || !rescan(&w, "start")) {
+        DebugErr("%s can not be watched, cached file info expires after %i ms\n", w.root, ttl);
+        goto done;
+    }
+    MetaCache_set_watched(meta, true);
+    DebugMsg("%i: watching %zu directories under %s\n", getpid(), w.watches, w.root);
+
+    _Alignas(struct inotify_event) char buffer[64 * 1024];
+    while (true) {
+        ssize_t n = read(w.fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int en = errno;
+            DebugErr("inotify read() %s\n", strerror(en));
+            break;
+        }
+        for (char* p = buffer; p < buffer + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            if (!handle(&w, ev)) {
+                DebugErr("%s is no longer fully watched, cached file info expires after %i ms\n", w.root, ttl);
+                goto done;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        report(&w);
+    }
+
+done:
+    MetaCache_set_watched(meta, false);
+    for (size_t wd = 0; wd < w.dir_cap; wd++) {
+        free(w.dirs[wd]);
+    }
+    free(w.dirs);
+    close(w.fd);
+}
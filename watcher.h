@@ -0,0 +1,28 @@
+#ifndef NBH_WATCHER_HEADER
+#define NBH_WATCHER_HEADER
+
+#include "file_cache.h"
+
+// the counters are printed at most this often while they change
+#define WS_WATCH_REPORT_MS 10000
+
+// deepest directory nesting watched
+#define WS_WATCH_DEPTH 32
+
+/* Keeps the metadata cache in step with the root directory so a hit never needs a
+ * stat() to revalidate.
+ *
+ * Runs in a process of its own that the parent forks before the workers.
+ * It has an inotify watch on every directory under the root and one on the
+ * directory holding it, so moving a new tree into its place is seen as
+ * well. A change to a file invalidates that path, and the original for a
+ * .gz/.br sidecar. Directories coming or going, a queue overflow or a new
+ * root flush the whole cache, and the last two also rebuild the watches.
+ *
+ * Entries are only trusted past meta_ttl while every directory is
+ * watched. Returns once that can not be kept up, e.g. when the inotify
+ * watch limit is reached, and the cache is back to its TTL.
+ */
+void watcher_run(MetaCache* meta);
+
+#endif
@@ -0,0 +1,72 @@
+#include "accesslog.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// records read at once
+#define BATCH 256
+
+static bool print_log(const char* path, bool json)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        int en = errno;
+        DebugErr("%s: %s\n", path, strerror(en));
+        return false;
+    }
+    AccessLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, WS_ACCESS_MAGIC, sizeof(header.magic)) != 0) {
+        DebugErr("%s: not an access log\n", path);
+        fclose(file);
+        return false;
+    } else if (header.byte_order != 0x01020304 || header.record_size != sizeof(AccessRecord)) {
+        DebugErr("%s: written by a server of another byte order or version\n", path);
+        fclose(file);
+        return false;
+    }
+    static AccessRecord records[BATCH];
+    char line[1024];
+    size_t n;
+    while ((n = fread(records, sizeof(AccessRecord), BATCH, file)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            AccessRecord_format(&records[i], json, line, sizeof(line));
+            puts(line);
+        }
+    }
+    bool ok = !ferror(file);
+    if (!ok) {
+        int en = errno;
+        DebugErr("%s: %s\n", path, strerror(en));
+    }
+    fclose(file);
+    return ok;
+}
+
+/* Prints the access logs given, as the logger of ./server wrote them, one
+ * response per line: the Common Log Format followed by the time to first
+ * byte, the duration and the worker, or with -j one JSON object per line.
+ */
+int main(int argc, char** argv)
+{
+    bool json = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j")) != -1) {
+        if (opt != 'j') {
+            DebugErr("./wslog [-j] <access.log>...\n");
+            return 1;
+        }
+        json = true;
+    }
+    if (optind == argc) {
+        DebugErr("./wslog [-j] <access.log>...\n");
+        return 1;
+    }
+    bool ok = true;
+    for (int i = optind; i < argc; i++) {
+        ok = print_log(argv[i], json) && ok;
+    }
+    return ok ? 0 : 1;
+}
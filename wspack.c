@@ -0,0 +1,18 @@
+#include "archive.h"
+#include "common.h"
+
+#include <stdio.h>
+
+/* Packs the root directory, www unless given, into the archive given, for
+ * ./server -a. Members are looked up under the server's root, so pack the
+ * one it is configured with. Running it again while a server serves the
+ * archive swaps the site atomically.
+ */
+int main(int argc, char** argv)
+{
+    if (argc != 2 && argc != 3) {
+        DebugErr("./wspack <site.pack> [root]\n");
+        return 1;
+    }
+    return Archive_pack(argc == 3 ? argv[2] : ws_config->root, argv[1]) ? 0 : 1;
+}